@@ -968,7 +968,7 @@ static void bcachefs_fuse_fsyncdir(fuse_req_t req, fuse_ino_t inum, int datasync
 static void bcachefs_fuse_statfs(fuse_req_t req, fuse_ino_t inum)
 {
 	struct bch_fs *c = fuse_req_userdata(req);
-	struct bch_fs_usage_short usage = bch2_fs_usage_read_short(c);
+	struct bch_fs_usage_short usage = bch2_fs_usage_read_short_cached(c);
 	unsigned shift = c->block_bits;
 	struct statvfs statbuf = {
 		.f_bsize	= block_bytes(c),
@@ -454,4 +454,6 @@ static inline void bio_init(struct bio *bio,
 	bio->bi_max_vecs = max_vecs;
 }
 
+static inline void bio_uninit(struct bio *bio) {}
+
 #endif /* __LINUX_BIO_H */
@@ -559,33 +559,179 @@ err:
 	return ERR_PTR(ret);
 }
 
-int bch2_alloc_read(struct bch_fs *c)
+/*
+ * Walking the alloc info for every bucket on a large filesystem is slow, so the
+ * passes that do so (at mount time) run in parallel: each device's buckets are
+ * split into ranges, up to one range per cpu, and every range gets its own
+ * thread:
+ */
+
+/* Don't split a device into ranges smaller than this: */
+#define BUCKET_RANGE_MIN_BUCKETS	(1U << 18)
+
+struct bucket_ranges;
+
+struct bucket_range_job {
+	struct bucket_ranges	*s;
+	struct bch_dev		*ca;
+	u64			start;
+	u64			end;
+	int			ret;
+};
+
+typedef int (*bucket_range_fn)(struct btree_trans *, struct bucket_range_job *);
+
+struct bucket_ranges {
+	struct bch_fs		*c;
+	const char		*name;
+	bucket_range_fn		fn;
+	unsigned long		last_updated;
+	atomic_t		nr_running;
+	struct completion	done;
+	DARRAY(struct bucket_range_job) jobs;
+};
+
+static int bucket_ranges_add_dev(struct bucket_ranges *s, struct bch_dev *ca)
+{
+	u64 start = ca->mi.first_bucket;
+	u64 nbuckets = ca->mi.nbuckets - start;
+	unsigned i, nr = clamp_t(u64, div64_u64(nbuckets, BUCKET_RANGE_MIN_BUCKETS),
+				 1, num_online_cpus());
+	int ret;
+
+	for (i = 0; i < nr; i++) {
+		struct bucket_range_job j = {
+			.s	= s,
+			.ca	= ca,
+			.start	= start + div_u64(nbuckets * i, nr),
+			.end	= start + div_u64(nbuckets * (i + 1), nr),
+		};
+
+		ret = darray_push(&s->jobs, j);
+		if (ret)
+			return ret;
+
+		percpu_ref_get(&ca->ref);
+	}
+
+	return 0;
+}
+
+static void bucket_ranges_exit(struct bucket_ranges *s)
+{
+	struct bucket_range_job *j;
+
+	darray_for_each(s->jobs, j)
+		percpu_ref_put(&j->ca->ref);
+	darray_exit(&s->jobs);
+}
+
+static void bucket_range_progress(struct bucket_range_job *j, u64 bucket)
+{
+	struct bucket_ranges *s = j->s;
+	unsigned long last_updated = READ_ONCE(s->last_updated);
+
+	if (time_after(jiffies, last_updated + HZ * 10) &&
+	    cmpxchg(&s->last_updated, last_updated, jiffies) == last_updated)
+		bch_info(j->ca, "%s: currently at %llu (range %llu-%llu of %llu)",
+			 s->name, bucket, j->start, j->end, j->ca->mi.nbuckets);
+}
+
+static int bucket_range_thread(void *arg)
 {
+	struct bucket_range_job *j = arg;
+	struct bucket_ranges *s = j->s;
 	struct btree_trans trans;
-	struct btree_iter iter;
-	struct bkey_s_c k;
-	struct bch_alloc_v4 a;
+
+	bch2_trans_init(&trans, s->c, 0, 0);
+	j->ret = s->fn(&trans, j);
+	bch2_trans_exit(&trans);
+
+	if (atomic_dec_and_test(&s->nr_running))
+		complete(&s->done);
+	return 0;
+}
+
+static int bucket_ranges_run(struct bucket_ranges *s)
+{
+	struct bch_fs *c = s->c;
+	struct bucket_range_job *j;
+	int ret = 0;
+
+	if (!s->jobs.nr)
+		return 0;
+
+	s->last_updated = jiffies;
+	atomic_set(&s->nr_running, s->jobs.nr);
+	init_completion(&s->done);
+
+	/* If we can't spawn a thread, just do that range ourselves: */
+	darray_for_each(s->jobs, j)
+		if (s->jobs.nr == 1 ||
+		    IS_ERR(kthread_run(bucket_range_thread, j,
+				       "bch-%s/%s", s->name, c->name)))
+			bucket_range_thread(j);
+
+	wait_for_completion(&s->done);
+
+	darray_for_each(s->jobs, j)
+		if (j->ret && !ret) {
+			bch_err(j->ca, "%s: error %s", s->name, bch2_err_str(j->ret));
+			ret = j->ret;
+		}
+
+	return ret;
+}
+
+static int bucket_ranges_run_all_devs(struct bucket_ranges *s)
+{
 	struct bch_dev *ca;
-	int ret;
+	unsigned i;
+	int ret = 0;
 
-	bch2_trans_init(&trans, c, 0, 0);
+	for_each_member_device(ca, s->c, i) {
+		ret = bucket_ranges_add_dev(s, ca);
+		if (ret) {
+			percpu_ref_put(&ca->ref);
+			break;
+		}
+	}
 
-	for_each_btree_key(&trans, iter, BTREE_ID_alloc, POS_MIN,
-			   BTREE_ITER_PREFETCH, k, ret) {
-		/*
-		 * Not a fsck error because this is checked/repaired by
-		 * bch2_check_alloc_key() which runs later:
-		 */
-		if (!bch2_dev_bucket_exists(c, k.k->p))
-			continue;
+	ret = ret ?: bucket_ranges_run(s);
+	bucket_ranges_exit(s);
+	return ret;
+}
 
-		ca = bch_dev_bkey_exists(c, k.k->p.inode);
+/*
+ * Not a fsck error when alloc keys exist for buckets that don't: this is
+ * checked/repaired by bch2_check_alloc_key() which runs later - we only walk
+ * the ranges of buckets that exist:
+ */
+static int bch2_alloc_read_range(struct btree_trans *trans,
+				 struct bucket_range_job *j)
+{
+	struct bch_dev *ca = j->ca;
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	struct bch_alloc_v4 a;
 
+	return for_each_btree_key2_upto(trans, iter, BTREE_ID_alloc,
+				POS(ca->dev_idx, j->start),
+				POS(ca->dev_idx, j->end - 1),
+				BTREE_ITER_PREFETCH, k, ({
 		*bucket_gen(ca, k.k->p.offset) = bch2_alloc_to_v4(k, &a)->gen;
-	}
-	bch2_trans_iter_exit(&trans, &iter);
+		0;
+	}));
+}
 
-	bch2_trans_exit(&trans);
+int bch2_alloc_read(struct bch_fs *c)
+{
+	struct bucket_ranges s = {
+		.c	= c,
+		.name	= "alloc_read",
+		.fn	= bch2_alloc_read_range,
+	};
+	int ret = bucket_ranges_run_all_devs(&s);
 
 	if (ret)
 		bch_err(c, "error reading alloc info: %s", bch2_err_str(ret));
@@ -700,45 +846,48 @@ int bch2_bucket_gens_init(struct bch_fs *c)
 	return ret;
 }
 
-int bch2_bucket_gens_read(struct bch_fs *c)
+static int bch2_bucket_gens_read_range(struct btree_trans *trans,
+					struct bucket_range_job *j)
 {
-	struct btree_trans trans;
+	struct bch_dev *ca = j->ca;
 	struct btree_iter iter;
 	struct bkey_s_c k;
-	const struct bch_bucket_gens *g;
-	struct bch_dev *ca;
-	u64 b;
-	int ret;
-
-	bch2_trans_init(&trans, c, 0, 0);
+	unsigned offset;
 
-	for_each_btree_key(&trans, iter, BTREE_ID_bucket_gens, POS_MIN,
-			   BTREE_ITER_PREFETCH, k, ret) {
+	/*
+	 * Ranges needn't be aligned to bucket_gens keys: the first and last
+	 * keys may be shared with the neighbouring ranges, so we only touch the
+	 * buckets in our own range:
+	 */
+	return for_each_btree_key2_upto(trans, iter, BTREE_ID_bucket_gens,
+				alloc_gens_pos(POS(ca->dev_idx, j->start), &offset),
+				alloc_gens_pos(POS(ca->dev_idx, j->end - 1), &offset),
+				BTREE_ITER_PREFETCH, k, ({
 		u64 start = bucket_gens_pos_to_alloc(k.k->p, 0).offset;
 		u64 end = bucket_gens_pos_to_alloc(bpos_nosnap_successor(k.k->p), 0).offset;
+		const struct bch_bucket_gens *g;
+		u64 b;
 
-		if (k.k->type != KEY_TYPE_bucket_gens)
-			continue;
-
-		g = bkey_s_c_to_bucket_gens(k).v;
-
-		/*
-		 * Not a fsck error because this is checked/repaired by
-		 * bch2_check_alloc_key() which runs later:
-		 */
-		if (!bch2_dev_exists2(c, k.k->p.inode))
-			continue;
-
-		ca = bch_dev_bkey_exists(c, k.k->p.inode);
+		if (k.k->type == KEY_TYPE_bucket_gens) {
+			g = bkey_s_c_to_bucket_gens(k).v;
 
-		for (b = max_t(u64, ca->mi.first_bucket, start);
-		     b < min_t(u64, ca->mi.nbuckets, end);
-		     b++)
-			*bucket_gen(ca, b) = g->gens[b & KEY_TYPE_BUCKET_GENS_MASK];
-	}
-	bch2_trans_iter_exit(&trans, &iter);
+			for (b = max(j->start, start);
+			     b < min(j->end, end);
+			     b++)
+				*bucket_gen(ca, b) = g->gens[b & KEY_TYPE_BUCKET_GENS_MASK];
+		}
+		0;
+	}));
+}
 
-	bch2_trans_exit(&trans);
+int bch2_bucket_gens_read(struct bch_fs *c)
+{
+	struct bucket_ranges s = {
+		.c	= c,
+		.name	= "bucket_gens_read",
+		.fn	= bch2_bucket_gens_read_range,
+	};
+	int ret = bucket_ranges_run_all_devs(&s);
 
 	if (ret)
 		bch_err(c, "error reading alloc info: %s", bch2_err_str(ret));
@@ -1610,66 +1759,150 @@ int bch2_check_alloc_to_lru_refs(struct bch_fs *c)
 	return ret < 0 ? ret : 0;
 }
 
-static int bch2_discard_one_bucket(struct btree_trans *trans,
-				   struct btree_iter *need_discard_iter,
-				   struct bpos *discard_pos_done,
-				   u64 *seen,
-				   u64 *open,
-				   u64 *need_journal_commit,
-				   u64 *discarded)
+/*
+ * Discards:
+ *
+ * We scan the need_discard btree in batches, coalescing runs of adjacent
+ * buckets into ranges; each range is then discarded with a single bio, with up
+ * to opts.discard_max_inflight bios in flight and the total rate limited to
+ * opts.discard_max_rate. Once a batch's discards have completed we clear
+ * need_discard on its buckets, several buckets per transaction commit.
+ *
+ * This works without any other locks because this is the only thread that
+ * removes items from the need_discard btree.
+ */
+
+/* Buckets per scan/discard/commit pass: */
+#define DISCARD_BATCH_BUCKETS	1024
+/* Buckets per transaction commit: */
+#define DISCARD_COMMIT_BATCH	16
+
+struct discard_range {
+	struct bch_dev		*ca;
+	u64			bucket;
+	u64			nr;
+	/* false if the buckets only need their gen incremented: */
+	bool			discard;
+};
+
+struct discard_batch {
+	DARRAY(struct discard_range) ranges;
+	u64			nr_buckets;
+
+	struct closure		cl;
+	atomic_t		inflight;
+	wait_queue_head_t	wait;
+	struct bch_ratelimit	rate;
+
+	u64			seen;
+	u64			open;
+	u64			need_journal_commit;
+	u64			discarded;
+};
+
+struct discard_bio {
+	struct discard_batch	*b;
+	struct bio		bio;
+};
+
+static int discard_batch_add(struct discard_batch *b, struct bch_dev *ca,
+			     u64 bucket, bool discard)
+{
+	struct discard_range *r = b->ranges.nr ? &darray_last(b->ranges) : NULL;
+	/* bi_size is 32 bits: */
+	u64 range_max = max_t(u64, (U32_MAX >> 9) / ca->mi.bucket_size, 1);
+	int ret;
+
+	b->nr_buckets++;
+
+	if (r &&
+	    r->ca == ca &&
+	    r->discard == discard &&
+	    r->bucket + r->nr == bucket &&
+	    r->nr < range_max) {
+		r->nr++;
+		return 0;
+	}
+
+	percpu_ref_get(&ca->io_ref);
+
+	ret = darray_push(&b->ranges, ((struct discard_range) {
+		.ca		= ca,
+		.bucket		= bucket,
+		.nr		= 1,
+		.discard	= discard,
+	}));
+	if (ret)
+		percpu_ref_put(&ca->io_ref);
+	return ret;
+}
+
+static void discard_batch_reset(struct discard_batch *b)
+{
+	struct discard_range *r;
+
+	darray_for_each(b->ranges, r)
+		percpu_ref_put(&r->ca->io_ref);
+	b->ranges.nr	= 0;
+	b->nr_buckets	= 0;
+}
+
+static int bch2_discard_scan_bucket(struct btree_trans *trans,
+				    struct btree_iter *need_discard_iter,
+				    struct discard_batch *b,
+				    struct bpos *resume)
 {
 	struct bch_fs *c = trans->c;
 	struct bpos pos = need_discard_iter->pos;
 	struct btree_iter iter = { NULL };
 	struct bkey_s_c k;
 	struct bch_dev *ca;
-	struct bkey_i_alloc_v4 *a;
+	struct bch_alloc_v4 a_convert;
+	const struct bch_alloc_v4 *a;
 	struct printbuf buf = PRINTBUF;
 	int ret = 0;
 
+	*resume = bpos_successor(pos);
+
 	ca = bch_dev_bkey_exists(c, pos.inode);
 	if (!percpu_ref_tryget(&ca->io_ref)) {
 		bch2_btree_iter_set_pos(need_discard_iter, POS(pos.inode + 1, 0));
+		*resume = POS(pos.inode + 1, 0);
 		return 0;
 	}
 
 	if (bch2_bucket_is_open_safe(c, pos.inode, pos.offset)) {
-		(*open)++;
+		b->open++;
 		goto out;
 	}
 
 	if (bch2_bucket_needs_journal_commit(&c->buckets_waiting_for_journal,
 			c->journal.flushed_seq_ondisk,
 			pos.inode, pos.offset)) {
-		(*need_journal_commit)++;
+		b->need_journal_commit++;
 		goto out;
 	}
 
-	bch2_trans_iter_init(trans, &iter, BTREE_ID_alloc,
-			     need_discard_iter->pos,
+	bch2_trans_iter_init(trans, &iter, BTREE_ID_alloc, pos,
 			     BTREE_ITER_CACHED);
 	k = bch2_btree_iter_peek_slot(&iter);
 	ret = bkey_err(k);
 	if (ret)
 		goto out;
 
-	a = bch2_alloc_to_v4_mut(trans, k);
-	ret = PTR_ERR_OR_ZERO(a);
-	if (ret)
-		goto out;
+	a = bch2_alloc_to_v4(k, &a_convert);
 
-	if (BCH_ALLOC_V4_NEED_INC_GEN(&a->v)) {
-		a->v.gen++;
-		SET_BCH_ALLOC_V4_NEED_INC_GEN(&a->v, false);
-		goto write;
+	if (BCH_ALLOC_V4_NEED_INC_GEN(a)) {
+		ret = discard_batch_add(b, ca, pos.offset, false);
+		goto out;
 	}
 
-	if (a->v.journal_seq > c->journal.flushed_seq_ondisk) {
+	if (a->journal_seq > c->journal.flushed_seq_ondisk) {
 		if (test_bit(BCH_FS_CHECK_ALLOC_DONE, &c->flags)) {
 			bch2_trans_inconsistent(trans,
 				"clearing need_discard but journal_seq %llu > flushed_seq %llu\n"
 				"%s",
-				a->v.journal_seq,
+				a->journal_seq,
 				c->journal.flushed_seq_ondisk,
 				(bch2_bkey_val_to_text(&buf, c, k), buf.buf));
 			ret = -EIO;
@@ -1677,7 +1910,7 @@ static int bch2_discard_one_bucket(struct btree_trans *trans,
 		goto out;
 	}
 
-	if (a->v.data_type != BCH_DATA_need_discard) {
+	if (a->data_type != BCH_DATA_need_discard) {
 		if (test_bit(BCH_FS_CHECK_ALLOC_DONE, &c->flags)) {
 			bch2_trans_inconsistent(trans,
 				"bucket incorrectly set in need_discard btree\n"
@@ -1685,44 +1918,180 @@ static int bch2_discard_one_bucket(struct btree_trans *trans,
 				(bch2_bkey_val_to_text(&buf, c, k), buf.buf));
 			ret = -EIO;
 		}
-
 		goto out;
 	}
 
-	if (!bkey_eq(*discard_pos_done, iter.pos) &&
-	    ca->mi.discard && !c->opts.nochanges) {
-		/*
-		 * This works without any other locks because this is the only
-		 * thread that removes items from the need_discard tree
-		 */
-		bch2_trans_unlock(trans);
-		blkdev_issue_discard(ca->disk_sb.bdev,
-				     k.k->p.offset * ca->mi.bucket_size,
-				     ca->mi.bucket_size,
-				     GFP_KERNEL);
-		*discard_pos_done = iter.pos;
-
-		ret = bch2_trans_relock_notrace(trans);
-		if (ret)
-			goto out;
+	ret = discard_batch_add(b, ca, pos.offset, true);
+out:
+	b->seen++;
+	bch2_trans_iter_exit(trans, &iter);
+	percpu_ref_put(&ca->io_ref);
+	printbuf_exit(&buf);
+
+	/* Positive return value stops the scan: */
+	return ret ?: b->nr_buckets >= DISCARD_BATCH_BUCKETS;
+}
+
+static void discard_bio_endio(struct bio *bio)
+{
+	struct discard_bio *d = container_of(bio, struct discard_bio, bio);
+	struct discard_batch *b = d->b;
+
+	/* Discard errors aren't fatal, the device just keeps the old data: */
+	bio_uninit(bio);
+	kfree(d);
+
+	atomic_dec(&b->inflight);
+	wake_up(&b->wait);
+	closure_put(&b->cl);
+}
+
+static void bch2_discard_range(struct bch_fs *c, struct discard_batch *b,
+			       struct discard_range *r)
+{
+	struct bch_dev *ca = r->ca;
+	struct block_device *bdev = ca->disk_sb.bdev;
+	sector_t sector = r->bucket * ca->mi.bucket_size;
+	sector_t nr_sectors = r->nr * ca->mi.bucket_size;
+	unsigned max_inflight = max(READ_ONCE(c->opts.discard_max_inflight), 1U);
+	struct discard_bio *d;
+	u64 delay;
+
+	if (!r->discard ||
+	    !ca->mi.discard ||
+	    c->opts.nochanges ||
+	    !bdev_max_discard_sectors(bdev))
+		return;
+
+	while (b->rate.rate && (delay = bch2_ratelimit_delay(&b->rate))) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		schedule_timeout(delay);
 	}
 
-	SET_BCH_ALLOC_V4_NEED_DISCARD(&a->v, false);
-	a->v.data_type = alloc_data_type(a->v, a->v.data_type);
-write:
-	ret =   bch2_trans_update(trans, &iter, &a->k_i, 0) ?:
-		bch2_trans_commit(trans, NULL, NULL,
-				  BTREE_INSERT_USE_RESERVE|BTREE_INSERT_NOFAIL);
+	wait_event(b->wait, atomic_read(&b->inflight) < max_inflight);
+
+	d = kmalloc(sizeof(*d), GFP_KERNEL);
+	if (!d) {
+		blkdev_issue_discard(bdev, sector, nr_sectors, GFP_KERNEL);
+		goto out;
+	}
+
+	d->b	= b;
+	bio_init(&d->bio, bdev, NULL, 0, REQ_OP_DISCARD);
+	d->bio.bi_iter.bi_sector	= sector;
+	d->bio.bi_iter.bi_size		= nr_sectors << 9;
+	d->bio.bi_end_io		= discard_bio_endio;
+
+	atomic_inc(&b->inflight);
+	closure_get(&b->cl);
+	submit_bio(&d->bio);
+out:
+	if (b->rate.rate)
+		bch2_ratelimit_increment(&b->rate, nr_sectors);
+	this_cpu_inc(c->counters[BCH_COUNTER_bucket_discard_range]);
+}
+
+static int bch2_discard_commit_bucket(struct btree_trans *trans,
+				      struct bch_dev *ca, u64 bucket,
+				      bool discarded)
+{
+	struct bch_fs *c = trans->c;
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	struct bkey_i_alloc_v4 *a;
+	int ret;
+
+	bch2_trans_iter_init(trans, &iter, BTREE_ID_alloc,
+			     POS(ca->dev_idx, bucket),
+			     BTREE_ITER_CACHED);
+	k = bch2_btree_iter_peek_slot(&iter);
+	ret = bkey_err(k);
 	if (ret)
 		goto out;
 
-	this_cpu_inc(c->counters[BCH_COUNTER_bucket_discard]);
-	(*discarded)++;
+	a = bch2_alloc_to_v4_mut(trans, k);
+	ret = PTR_ERR_OR_ZERO(a);
+	if (ret)
+		goto out;
+
+	if (BCH_ALLOC_V4_NEED_INC_GEN(&a->v)) {
+		a->v.gen++;
+		SET_BCH_ALLOC_V4_NEED_INC_GEN(&a->v, false);
+	} else if (discarded &&
+		   a->v.data_type == BCH_DATA_need_discard &&
+		   a->v.journal_seq <= c->journal.flushed_seq_ondisk) {
+		SET_BCH_ALLOC_V4_NEED_DISCARD(&a->v, false);
+		a->v.data_type = alloc_data_type(a->v, a->v.data_type);
+	} else {
+		/* Raced with something else changing the bucket: */
+		goto out;
+	}
+
+	ret = bch2_trans_update(trans, &iter, &a->k_i, 0);
 out:
-	(*seen)++;
 	bch2_trans_iter_exit(trans, &iter);
-	percpu_ref_put(&ca->io_ref);
-	printbuf_exit(&buf);
+	return ret;
+}
+
+static int bch2_discard_commit_buckets(struct btree_trans *trans,
+				       struct discard_range *r,
+				       u64 bucket, unsigned nr)
+{
+	u64 i;
+	int ret = 0;
+
+	for (i = bucket; i < bucket + nr && !ret; i++)
+		ret = bch2_discard_commit_bucket(trans, r->ca, i, r->discard);
+
+	return ret ?: bch2_trans_commit(trans, NULL, NULL,
+					BTREE_INSERT_USE_RESERVE|
+					BTREE_INSERT_NOFAIL);
+}
+
+static int bch2_discard_commit_range(struct btree_trans *trans,
+				     struct discard_batch *b,
+				     struct discard_range *r)
+{
+	struct bch_fs *c = trans->c;
+	u64 bucket = r->bucket, end = r->bucket + r->nr;
+	unsigned nr;
+	int ret = 0;
+
+	while (bucket < end) {
+		nr = min_t(u64, end - bucket, DISCARD_COMMIT_BATCH);
+
+		ret = lockrestart_do(trans,
+			bch2_discard_commit_buckets(trans, r, bucket, nr));
+		if (ret)
+			break;
+
+		this_cpu_add(c->counters[BCH_COUNTER_bucket_discard], nr);
+		b->discarded += nr;
+		bucket += nr;
+	}
+
+	return ret;
+}
+
+static int bch2_discard_batch(struct btree_trans *trans, struct discard_batch *b)
+{
+	struct bch_fs *c = trans->c;
+	struct discard_range *r;
+	int ret = 0;
+
+	bch2_trans_unlock(trans);
+
+	darray_for_each(b->ranges, r)
+		bch2_discard_range(c, b, r);
+	closure_sync(&b->cl);
+
+	darray_for_each(b->ranges, r) {
+		ret = bch2_discard_commit_range(trans, b, r);
+		if (ret)
+			break;
+	}
+
+	discard_batch_reset(b);
 	return ret;
 }
 
@@ -1732,34 +2101,39 @@ static void bch2_do_discards_work(struct work_struct *work)
 	struct btree_trans trans;
 	struct btree_iter iter;
 	struct bkey_s_c k;
-	u64 seen = 0, open = 0, need_journal_commit = 0, discarded = 0;
-	struct bpos discard_pos_done = POS_MAX;
+	struct discard_batch b = { 0 };
+	struct bpos pos = POS_MIN;
 	int ret;
 
+	closure_init_stack(&b.cl);
+	init_waitqueue_head(&b.wait);
+	b.rate.rate = min_t(u64, READ_ONCE(c->opts.discard_max_rate) >> 9, U32_MAX);
+	bch2_ratelimit_reset(&b.rate);
+
 	bch2_trans_init(&trans, c, 0, 0);
 
-	/*
-	 * We're doing the commit in bch2_discard_one_bucket instead of using
-	 * for_each_btree_key_commit() so that we can increment counters after
-	 * successful commit:
-	 */
-	ret = for_each_btree_key2(&trans, iter,
-			BTREE_ID_need_discard, POS_MIN, 0, k,
-		bch2_discard_one_bucket(&trans, &iter, &discard_pos_done,
-					&seen,
-					&open,
-					&need_journal_commit,
-					&discarded));
+	do {
+		ret = for_each_btree_key2(&trans, iter,
+				BTREE_ID_need_discard, pos, 0, k,
+			bch2_discard_scan_bucket(&trans, &iter, &b, &pos));
+		if (ret < 0) {
+			discard_batch_reset(&b);
+			break;
+		}
+
+		ret = bch2_discard_batch(&trans, &b) ?: ret;
+	} while (ret > 0);
 
 	bch2_trans_exit(&trans);
+	darray_exit(&b.ranges);
 
-	if (need_journal_commit * 2 > seen)
+	if (b.need_journal_commit * 2 > b.seen)
 		bch2_journal_flush_async(&c->journal, NULL);
 
 	bch2_write_ref_put(c, BCH_WRITE_REF_discard);
 
-	trace_discard_buckets(c, seen, open, need_journal_commit, discarded,
-			      bch2_err_str(ret));
+	trace_discard_buckets(c, b.seen, b.open, b.need_journal_commit,
+			      b.discarded, bch2_err_str(min(ret, 0)));
 }
 
 void bch2_do_discards(struct bch_fs *c)
@@ -1769,22 +2143,44 @@ void bch2_do_discards(struct bch_fs *c)
 		bch2_write_ref_put(c, BCH_WRITE_REF_discard);
 }
 
+/*
+ * Invalidating cached buckets:
+ *
+ * We walk the LRU btree oldest first, invalidating up to INVALIDATE_BATCH
+ * buckets per transaction commit. should_invalidate_buckets() implements the
+ * watermarks - we start when free buckets drop below the low watermark and
+ * invalidate up to the high watermark, so that allocations don't wait for us
+ * bucket by bucket.
+ *
+ * Invalidated buckets still need to be discarded before they can be reused,
+ * so we kick the discard worker after every commit, which then runs
+ * concurrently with the rest of the invalidate pass.
+ */
+
+/* Buckets invalidated per transaction commit: */
+#define INVALIDATE_BATCH	16
+
+struct invalidated_bucket {
+	struct bpos		bucket;
+	unsigned		cached_sectors;
+};
+
+/*
+ * Returns 1 if @lru_k's bucket has been queued up for invalidation in @trans,
+ * 0 if it was skipped:
+ */
 static int invalidate_one_bucket(struct btree_trans *trans,
 				 struct btree_iter *lru_iter,
 				 struct bkey_s_c lru_k,
-				 s64 *nr_to_invalidate)
+				 struct invalidated_bucket *i)
 {
 	struct bch_fs *c = trans->c;
 	struct btree_iter alloc_iter = { NULL };
 	struct bkey_i_alloc_v4 *a = NULL;
 	struct printbuf buf = PRINTBUF;
 	struct bpos bucket = u64_to_bucket(lru_k.k->p.offset);
-	unsigned cached_sectors;
 	int ret = 0;
 
-	if (*nr_to_invalidate <= 0)
-		return 1;
-
 	if (!bch2_dev_bucket_exists(c, bucket)) {
 		prt_str(&buf, "lru entry points to invalid bucket");
 		goto err;
@@ -1807,7 +2203,8 @@ static int invalidate_one_bucket(struct btree_trans *trans,
 	if (!a->v.cached_sectors)
 		bch_err(c, "invalidating empty bucket, confused");
 
-	cached_sectors = a->v.cached_sectors;
+	i->bucket		= bucket;
+	i->cached_sectors	= a->v.cached_sectors;
 
 	SET_BCH_ALLOC_V4_NEED_INC_GEN(&a->v, false);
 	a->v.gen++;
@@ -1818,14 +2215,7 @@ static int invalidate_one_bucket(struct btree_trans *trans,
 	a->v.io_time[WRITE]	= atomic64_read(&c->io_clock[WRITE].now);
 
 	ret =   bch2_trans_update(trans, &alloc_iter, &a->k_i,
-				BTREE_TRIGGER_BUCKET_INVALIDATE) ?:
-		bch2_trans_commit(trans, NULL, NULL,
-				  BTREE_INSERT_USE_RESERVE|BTREE_INSERT_NOFAIL);
-	if (ret)
-		goto out;
-
-	trace_and_count(c, bucket_invalidate, c, bucket.inode, bucket.offset, cached_sectors);
-	--*nr_to_invalidate;
+				  BTREE_TRIGGER_BUCKET_INVALIDATE) ?: 1;
 out:
 	bch2_trans_iter_exit(trans, &alloc_iter);
 	printbuf_exit(&buf);
@@ -1852,13 +2242,98 @@ err:
 	goto out;
 }
 
+static int invalidate_buckets_batch(struct btree_trans *trans,
+				    struct btree_iter *lru_iter,
+				    struct bpos end, s64 nr_to_invalidate,
+				    struct invalidated_bucket *invalidated,
+				    unsigned *nr_invalidated, bool *done)
+{
+	struct bkey_s_c k;
+	unsigned nr = 0, seen = 0;
+	int ret = 0;
+
+	/* Bound the number of skipped entries we look at per transaction, too: */
+	while (nr < min_t(s64, INVALIDATE_BATCH, nr_to_invalidate) &&
+	       seen++ < INVALIDATE_BATCH * 4) {
+		k = bch2_btree_iter_peek_upto(lru_iter, end);
+		ret = bkey_err(k);
+		if (ret)
+			return ret;
+
+		if (!k.k) {
+			*done = true;
+			break;
+		}
+
+		ret = invalidate_one_bucket(trans, lru_iter, k, &invalidated[nr]);
+		if (ret < 0)
+			return ret;
+		nr += ret;
+
+		bch2_btree_iter_advance(lru_iter);
+	}
+
+	*nr_invalidated = nr;
+
+	return nr
+		? bch2_trans_commit(trans, NULL, NULL,
+				    BTREE_INSERT_USE_RESERVE|BTREE_INSERT_NOFAIL)
+		: 0;
+}
+
+static int invalidate_buckets_dev(struct btree_trans *trans, struct bch_dev *ca)
+{
+	struct bch_fs *c = trans->c;
+	struct invalidated_bucket invalidated[INVALIDATE_BATCH];
+	struct btree_iter iter;
+	struct bpos pos = lru_pos(ca->dev_idx, 0, 0);
+	struct bpos end = lru_pos(ca->dev_idx, U64_MAX, LRU_TIME_MAX);
+	s64 nr_to_invalidate = should_invalidate_buckets(ca, bch2_dev_usage_read(ca));
+	unsigned i, nr;
+	bool done = false;
+	int ret = 0;
+
+	if (!nr_to_invalidate)
+		return 0;
+
+	bch2_trans_iter_init(trans, &iter, BTREE_ID_lru, pos, BTREE_ITER_INTENT);
+
+	while (nr_to_invalidate > 0 && !done) {
+		bch2_trans_begin(trans);
+		bch2_btree_iter_set_pos(&iter, pos);
+
+		nr = 0;
+		ret = invalidate_buckets_batch(trans, &iter, end, nr_to_invalidate,
+					       invalidated, &nr, &done);
+		if (bch2_err_matches(ret, BCH_ERR_transaction_restart)) {
+			done = false;
+			continue;
+		}
+		if (ret)
+			break;
+
+		for (i = 0; i < nr; i++)
+			trace_and_count(c, bucket_invalidate, c,
+					invalidated[i].bucket.inode,
+					invalidated[i].bucket.offset,
+					invalidated[i].cached_sectors);
+
+		nr_to_invalidate -= nr;
+		pos = iter.pos;
+
+		if (nr)
+			bch2_do_discards(c);
+	}
+
+	bch2_trans_iter_exit(trans, &iter);
+	return ret;
+}
+
 static void bch2_do_invalidates_work(struct work_struct *work)
 {
 	struct bch_fs *c = container_of(work, struct bch_fs, invalidate_work);
 	struct bch_dev *ca;
 	struct btree_trans trans;
-	struct btree_iter iter;
-	struct bkey_s_c k;
 	unsigned i;
 	int ret = 0;
 
@@ -1869,15 +2344,7 @@ static void bch2_do_invalidates_work(struct work_struct *work)
 		goto err;
 
 	for_each_member_device(ca, c, i) {
-		s64 nr_to_invalidate =
-			should_invalidate_buckets(ca, bch2_dev_usage_read(ca));
-
-		ret = for_each_btree_key2_upto(&trans, iter, BTREE_ID_lru,
-				lru_pos(ca->dev_idx, 0, 0),
-				lru_pos(ca->dev_idx, U64_MAX, LRU_TIME_MAX),
-				BTREE_ITER_INTENT, k,
-			invalidate_one_bucket(&trans, &iter, k, &nr_to_invalidate));
-
+		ret = invalidate_buckets_dev(&trans, ca);
 		if (ret < 0) {
 			percpu_ref_put(&ca->ref);
 			break;
@@ -1895,113 +2362,100 @@ void bch2_do_invalidates(struct bch_fs *c)
 		bch2_write_ref_put(c, BCH_WRITE_REF_invalidate);
 }
 
-static int bch2_dev_freespace_init(struct bch_fs *c, struct bch_dev *ca,
-				   unsigned long *last_updated)
+/* Buckets processed per transaction commit: */
+#define FREESPACE_INIT_BATCH		16
+
+static int bch2_dev_freespace_init_range(struct btree_trans *trans,
+					 struct bucket_range_job *j)
 {
-	struct btree_trans trans;
+	struct bch_dev *ca = j->ca;
 	struct btree_iter iter;
 	struct bkey_s_c k;
 	struct bkey hole;
-	struct bpos end = POS(ca->dev_idx, ca->mi.nbuckets);
-	struct bch_member *m;
-	int ret;
-
-	bch2_trans_init(&trans, c, 0, 0);
+	struct bpos pos = POS(ca->dev_idx, j->start);
+	struct bpos end = POS(ca->dev_idx, j->end);
+	unsigned nr;
+	int ret = 0;
 
-	bch2_trans_iter_init(&trans, &iter, BTREE_ID_alloc,
-			     POS(ca->dev_idx, ca->mi.first_bucket),
+	bch2_trans_iter_init(trans, &iter, BTREE_ID_alloc, pos,
 			     BTREE_ITER_PREFETCH);
 	/*
-	 * Scan the alloc btree for every bucket on @ca, and add buckets to the
-	 * freespace/need_discard/need_gc_gens btrees as needed:
+	 * Scan the alloc btree for every bucket in our range, and add buckets
+	 * to the freespace/need_discard/need_gc_gens btrees as needed - up to
+	 * FREESPACE_INIT_BATCH keys or holes per commit; on transaction
+	 * restart we redo the whole batch:
 	 */
-	while (1) {
-		if (*last_updated + HZ * 10 < jiffies) {
-			bch_info(ca, "%s: currently at %llu/%llu",
-				 __func__, iter.pos.offset, ca->mi.nbuckets);
-			*last_updated = jiffies;
-		}
+	while (bkey_lt(pos, end)) {
+		bucket_range_progress(j, pos.offset);
 
-		bch2_trans_begin(&trans);
+		bch2_trans_begin(trans);
+		bch2_btree_iter_set_pos(&iter, pos);
 
-		if (bkey_ge(iter.pos, end)) {
-			ret = 0;
-			break;
-		}
+		for (nr = 0;
+		     nr < FREESPACE_INIT_BATCH && bkey_lt(iter.pos, end);
+		     nr++) {
+			k = bch2_get_key_or_hole(&iter, end, &hole);
+			ret = bkey_err(k);
+			if (ret)
+				break;
 
-		k = bch2_get_key_or_hole(&iter, end, &hole);
-		ret = bkey_err(k);
-		if (ret)
-			goto bkey_err;
+			if (k.k->type) {
+				struct bch_alloc_v4 a_convert;
+				const struct bch_alloc_v4 *a = bch2_alloc_to_v4(k, &a_convert);
 
-		if (k.k->type) {
-			/*
-			 * We process live keys in the alloc btree one at a
-			 * time:
-			 */
-			struct bch_alloc_v4 a_convert;
-			const struct bch_alloc_v4 *a = bch2_alloc_to_v4(k, &a_convert);
-
-			ret =   bch2_bucket_do_index(&trans, k, a, true) ?:
-				bch2_trans_commit(&trans, NULL, NULL,
-						  BTREE_INSERT_LAZY_RW|
-						  BTREE_INSERT_NOFAIL);
-			if (ret)
-				goto bkey_err;
+				ret = bch2_bucket_do_index(trans, k, a, true);
+				if (ret)
+					break;
 
-			bch2_btree_iter_advance(&iter);
-		} else {
-			struct bkey_i *freespace;
+				bch2_btree_iter_advance(&iter);
+			} else {
+				struct bkey_i *freespace;
 
-			freespace = bch2_trans_kmalloc(&trans, sizeof(*freespace));
-			ret = PTR_ERR_OR_ZERO(freespace);
-			if (ret)
-				goto bkey_err;
+				freespace = bch2_trans_kmalloc(trans, sizeof(*freespace));
+				ret = PTR_ERR_OR_ZERO(freespace);
+				if (ret)
+					break;
 
-			bkey_init(&freespace->k);
-			freespace->k.type	= KEY_TYPE_set;
-			freespace->k.p		= k.k->p;
-			freespace->k.size	= k.k->size;
+				bkey_init(&freespace->k);
+				freespace->k.type	= KEY_TYPE_set;
+				freespace->k.p		= k.k->p;
+				freespace->k.size	= k.k->size;
 
-			ret = __bch2_btree_insert(&trans, BTREE_ID_freespace, freespace, 0) ?:
-				bch2_trans_commit(&trans, NULL, NULL,
-						  BTREE_INSERT_LAZY_RW|
-						  BTREE_INSERT_NOFAIL);
-			if (ret)
-				goto bkey_err;
+				ret = __bch2_btree_insert(trans, BTREE_ID_freespace, freespace, 0);
+				if (ret)
+					break;
 
-			bch2_btree_iter_set_pos(&iter, k.k->p);
+				bch2_btree_iter_set_pos(&iter, k.k->p);
+			}
 		}
-bkey_err:
+
+		ret = ret ?: bch2_trans_commit(trans, NULL, NULL,
+					       BTREE_INSERT_LAZY_RW|
+					       BTREE_INSERT_NOFAIL);
 		if (bch2_err_matches(ret, BCH_ERR_transaction_restart))
 			continue;
 		if (ret)
 			break;
-	}
 
-	bch2_trans_iter_exit(&trans, &iter);
-	bch2_trans_exit(&trans);
-
-	if (ret < 0) {
-		bch_err(ca, "error initializing free space: %s", bch2_err_str(ret));
-		return ret;
+		pos = iter.pos;
 	}
 
-	mutex_lock(&c->sb_lock);
-	m = bch2_sb_get_members(c->disk_sb.sb)->members + ca->dev_idx;
-	SET_BCH_MEMBER_FREESPACE_INITIALIZED(m, true);
-	mutex_unlock(&c->sb_lock);
-
-	return 0;
+	bch2_trans_iter_exit(trans, &iter);
+	return ret;
 }
 
 int bch2_fs_freespace_init(struct bch_fs *c)
 {
+	struct bucket_ranges s = {
+		.c	= c,
+		.name	= "freespace_init",
+		.fn	= bch2_dev_freespace_init_range,
+	};
+	struct bucket_range_job *j;
 	struct bch_dev *ca;
+	struct bch_member *m;
 	unsigned i;
 	int ret = 0;
-	bool doing_init = false;
-	unsigned long last_updated = jiffies;
 
 	/*
 	 * We can crash during the device add path, so we need to check this on
@@ -2012,26 +2466,45 @@ int bch2_fs_freespace_init(struct bch_fs *c)
 		if (ca->mi.freespace_initialized)
 			continue;
 
-		if (!doing_init) {
-			bch_info(c, "initializing freespace");
-			doing_init = true;
-		}
-
-		ret = bch2_dev_freespace_init(c, ca, &last_updated);
+		ret = bucket_ranges_add_dev(&s, ca);
 		if (ret) {
 			percpu_ref_put(&ca->ref);
-			return ret;
+			goto err;
 		}
 	}
 
-	if (doing_init) {
-		mutex_lock(&c->sb_lock);
-		bch2_write_super(c);
-		mutex_unlock(&c->sb_lock);
+	if (!s.jobs.nr)
+		goto err;
+
+	bch_info(c, "initializing freespace (%zu threads)", s.jobs.nr);
+
+	/*
+	 * Worker threads don't hold state_lock, so they can't use the lazy rw
+	 * path in bch2_trans_commit() - go rw here if we need to:
+	 */
+	if (test_bit(BCH_FS_MAY_GO_RW, &c->flags) &&
+	    !test_bit(BCH_FS_STARTED, &c->flags) &&
+	    !test_bit(BCH_FS_RW, &c->flags)) {
+		ret = bch2_fs_read_write_early(c);
+		if (ret)
+			goto err;
+	}
+
+	ret = bucket_ranges_run(&s);
+	if (ret)
+		goto err;
 
-		bch_verbose(c, "done initializing freespace");
+	mutex_lock(&c->sb_lock);
+	darray_for_each(s.jobs, j) {
+		m = bch2_sb_get_members(c->disk_sb.sb)->members + j->ca->dev_idx;
+		SET_BCH_MEMBER_FREESPACE_INITIALIZED(m, true);
 	}
+	bch2_write_super(c);
+	mutex_unlock(&c->sb_lock);
 
+	bch_verbose(c, "done initializing freespace");
+err:
+	bucket_ranges_exit(&s);
 	return ret;
 }
 
@@ -209,16 +209,26 @@ int bch2_check_alloc_info(struct bch_fs *);
 int bch2_check_alloc_to_lru_refs(struct bch_fs *);
 void bch2_do_discards(struct bch_fs *);
 
+/*
+ * Invalidate watermarks: we start invalidating cached buckets when free buckets
+ * drop below the low watermark, and then invalidate up to the high watermark:
+ */
+#define INVALIDATE_WATERMARK_LOW_SHIFT	7
+#define INVALIDATE_WATERMARK_HIGH_SHIFT	6
+
 static inline u64 should_invalidate_buckets(struct bch_dev *ca,
 					    struct bch_dev_usage u)
 {
-	u64 want_free = ca->mi.nbuckets >> 7;
-	u64 free = max_t(s64, 0,
+	s64 free = max_t(s64, 0,
 			   u.d[BCH_DATA_free].buckets
 			 + u.d[BCH_DATA_need_discard].buckets
 			 - bch2_dev_buckets_reserved(ca, RESERVE_stripe));
 
-	return clamp_t(s64, want_free - free, 0, u.d[BCH_DATA_cached].buckets);
+	if (free >= ca->mi.nbuckets >> INVALIDATE_WATERMARK_LOW_SHIFT)
+		return 0;
+
+	return clamp_t(s64, (ca->mi.nbuckets >> INVALIDATE_WATERMARK_HIGH_SHIFT) - free,
+		       0, u.d[BCH_DATA_cached].buckets);
 }
 
 void bch2_do_invalidates(struct bch_fs *);
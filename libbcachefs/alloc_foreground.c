@@ -491,16 +491,97 @@ again:
 	return ob;
 }
 
+/*
+ * Per cpu bucket allocation caches:
+ *
+ * Each device has a small per cpu cache of open buckets on free buckets, for
+ * RESERVE_none allocations. They're refilled in bulk from a worker, via the
+ * normal allocation path; buckets in the caches are open, so nothing else can
+ * allocate them.
+ *
+ * Since cached buckets are still free as far as usage accounting is
+ * concerned, an allocation that fails to find a free bucket drains the
+ * device's caches and retries.
+ */
+
+static void bch2_bucket_alloc_cache_kick(struct bch_fs *c)
+{
+	if (bch2_write_ref_tryget(c, BCH_WRITE_REF_bucket_alloc_cache) &&
+	    !queue_work(c->write_ref_wq, &c->bucket_alloc_cache_work))
+		bch2_write_ref_put(c, BCH_WRITE_REF_bucket_alloc_cache);
+}
+
+static struct open_bucket *bch2_bucket_alloc_cache_pop(struct bch_fs *c,
+						       struct bch_dev *ca)
+{
+	struct bucket_alloc_cache *cache = raw_cpu_ptr(ca->alloc_cache);
+	struct open_bucket *ob = NULL;
+	bool kick = false;
+
+	spin_lock(&cache->lock);
+	if (cache->nr)
+		ob = c->open_buckets + cache->obs[--cache->nr];
+
+	if (cache->nr < BUCKET_ALLOC_CACHE_SIZE / 2 && !cache->want_refill) {
+		cache->want_refill = true;
+		kick = true;
+	}
+	spin_unlock(&cache->lock);
+
+	if (kick)
+		bch2_bucket_alloc_cache_kick(c);
+
+	if (!ob) {
+		this_cpu_inc(c->counters[BCH_COUNTER_bucket_alloc_cache_miss]);
+		return NULL;
+	}
+
+	atomic_dec(&c->open_buckets_cached);
+
+	/* Nocow locks may have been taken since the cache was filled: */
+	if (bch2_bucket_nocow_is_locked(&c->nocow_locks, POS(ob->dev, ob->bucket))) {
+		bch2_open_bucket_put(c, ob);
+		return NULL;
+	}
+
+	this_cpu_inc(c->counters[BCH_COUNTER_bucket_alloc_cache_hit]);
+	return ob;
+}
+
+static void bch2_bucket_alloc_cache_drain(struct bch_fs *c, struct bch_dev *ca)
+{
+	open_bucket_idx_t obs[BUCKET_ALLOC_CACHE_SIZE];
+	unsigned i, nr;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct bucket_alloc_cache *cache = per_cpu_ptr(ca->alloc_cache, cpu);
+
+		spin_lock(&cache->lock);
+		nr = cache->nr;
+		memcpy(obs, cache->obs, sizeof(obs[0]) * nr);
+		cache->nr = 0;
+		cache->want_refill = false;
+		spin_unlock(&cache->lock);
+
+		for (i = 0; i < nr; i++) {
+			atomic_dec(&c->open_buckets_cached);
+			bch2_open_bucket_put(c, c->open_buckets + obs[i]);
+		}
+	}
+}
+
 /**
  * bch_bucket_alloc - allocate a single bucket from a specific device
  *
  * Returns index of bucket on success, 0 on failure
  */
-static struct open_bucket *bch2_bucket_alloc_trans(struct btree_trans *trans,
+static struct open_bucket *__bch2_bucket_alloc_trans(struct btree_trans *trans,
 				      struct bch_dev *ca,
 				      enum alloc_reserve reserve,
 				      struct closure *cl,
-				      struct bch_dev_usage *usage)
+				      struct bch_dev_usage *usage,
+				      bool use_cache)
 {
 	struct bch_fs *c = trans->c;
 	struct open_bucket *ob = NULL;
@@ -508,6 +589,7 @@ static struct open_bucket *bch2_bucket_alloc_trans(struct btree_trans *trans,
 	u64 avail;
 	struct bucket_alloc_state s = { 0 };
 	bool waiting = false;
+	bool drained = !use_cache;
 again:
 	bch2_dev_usage_read_fast(ca, usage);
 	avail = dev_buckets_free(ca, *usage, reserve);
@@ -537,6 +619,12 @@ again:
 
 	if (waiting)
 		closure_wake_up(&c->freelist_wait);
+
+	if (use_cache && reserve == RESERVE_none && freespace) {
+		ob = bch2_bucket_alloc_cache_pop(c, ca);
+		if (ob)
+			goto err;
+	}
 alloc:
 	ob = likely(freespace)
 		? bch2_bucket_alloc_freelist(trans, ca, reserve, &s, cl)
@@ -549,6 +637,12 @@ alloc:
 		freespace = false;
 		goto alloc;
 	}
+
+	if (!ob && !drained && atomic_read(&c->open_buckets_cached)) {
+		bch2_bucket_alloc_cache_drain(c, ca);
+		drained = true;
+		goto alloc;
+	}
 err:
 	if (!ob)
 		ob = ERR_PTR(-BCH_ERR_no_buckets_found);
@@ -579,6 +673,108 @@ err:
 	return ob;
 }
 
+static struct open_bucket *bch2_bucket_alloc_trans(struct btree_trans *trans,
+				      struct bch_dev *ca,
+				      enum alloc_reserve reserve,
+				      struct closure *cl,
+				      struct bch_dev_usage *usage)
+{
+	return __bch2_bucket_alloc_trans(trans, ca, reserve, cl, usage, true);
+}
+
+static void bch2_bucket_alloc_cache_refill(struct btree_trans *trans,
+					   struct bch_dev *ca,
+					   struct bucket_alloc_cache *cache)
+{
+	struct bch_fs *c = trans->c;
+	struct bch_dev_usage usage;
+	struct open_bucket *ob;
+	int ret;
+
+	while (READ_ONCE(cache->nr) < BUCKET_ALLOC_CACHE_SIZE &&
+	       atomic_read(&c->open_buckets_cached) < OPEN_BUCKETS_CACHED_MAX &&
+	       READ_ONCE(c->open_buckets_nr_free) >
+	       open_buckets_reserved(RESERVE_none) + OPEN_BUCKETS_CACHED_MAX) {
+		/* Don't hoard the last free buckets on a device: */
+		bch2_dev_usage_read_fast(ca, &usage);
+		if (dev_buckets_free(ca, usage, RESERVE_none) <= OPEN_BUCKETS_CACHED_MAX)
+			break;
+
+		ret = lockrestart_do(trans,
+			PTR_ERR_OR_ZERO(ob = __bch2_bucket_alloc_trans(trans, ca,
+						RESERVE_none, NULL, &usage, false)));
+		if (ret)
+			break;
+
+		/*
+		 * bch2_dev_allocator_remove() clears the device from rw_devs
+		 * before draining the caches:
+		 */
+		spin_lock(&cache->lock);
+		if (cache->nr < BUCKET_ALLOC_CACHE_SIZE &&
+		    test_bit(ca->dev_idx, c->rw_devs[BCH_DATA_user].d)) {
+			cache->obs[cache->nr++] = ob - c->open_buckets;
+			atomic_inc(&c->open_buckets_cached);
+			ob = NULL;
+		}
+		spin_unlock(&cache->lock);
+
+		if (ob) {
+			bch2_open_bucket_put(c, ob);
+			break;
+		}
+	}
+
+	bch2_trans_unlock(trans);
+}
+
+static void bch2_bucket_alloc_cache_refill_work(struct work_struct *work)
+{
+	struct bch_fs *c = container_of(work, struct bch_fs, bucket_alloc_cache_work);
+	struct btree_trans trans;
+	struct bch_dev *ca;
+	unsigned i;
+	int cpu;
+
+	bch2_trans_init(&trans, c, 0, 0);
+
+	for_each_rw_member(ca, c, i)
+		for_each_possible_cpu(cpu) {
+			struct bucket_alloc_cache *cache = per_cpu_ptr(ca->alloc_cache, cpu);
+
+			if (!READ_ONCE(cache->want_refill))
+				continue;
+
+			bch2_bucket_alloc_cache_refill(&trans, ca, cache);
+
+			spin_lock(&cache->lock);
+			cache->want_refill = false;
+			spin_unlock(&cache->lock);
+		}
+
+	bch2_trans_exit(&trans);
+	bch2_write_ref_put(c, BCH_WRITE_REF_bucket_alloc_cache);
+}
+
+void bch2_dev_bucket_alloc_cache_exit(struct bch_dev *ca)
+{
+	free_percpu(ca->alloc_cache);
+	ca->alloc_cache = NULL;
+}
+
+int bch2_dev_bucket_alloc_cache_init(struct bch_dev *ca)
+{
+	int cpu;
+
+	ca->alloc_cache = alloc_percpu(struct bucket_alloc_cache);
+	if (!ca->alloc_cache)
+		return -BCH_ERR_ENOMEM_bucket_alloc_cache_init;
+
+	for_each_possible_cpu(cpu)
+		spin_lock_init(&per_cpu_ptr(ca->alloc_cache, cpu)->lock);
+	return 0;
+}
+
 struct open_bucket *bch2_bucket_alloc(struct bch_fs *c, struct bch_dev *ca,
 				      enum alloc_reserve reserve,
 				      struct closure *cl)
@@ -825,6 +1021,15 @@ static bool want_bucket(struct bch_fs *c,
 	if (ob->data_type != wp->data_type)
 		return false;
 
+	/*
+	 * Don't mix data of different temperatures in the same bucket - unless
+	 * partially allocated buckets are piling up, and would otherwise pin
+	 * too many open buckets:
+	 */
+	if (ob->temp != wp->temp &&
+	    c->open_buckets_partial_nr < ARRAY_SIZE(c->open_buckets_partial) / 2)
+		return false;
+
 	if (!ca->mi.durability &&
 	    (wp->data_type == BCH_DATA_btree || ec || *have_cache))
 		return false;
@@ -1110,6 +1315,17 @@ void bch2_open_buckets_stop(struct bch_fs *c, struct bch_dev *ca,
 	}
 	spin_unlock(&c->freelist_lock);
 
+	if (!ec) {
+		if (ca) {
+			bch2_bucket_alloc_cache_drain(c, ca);
+		} else {
+			struct bch_dev *ca2;
+
+			for_each_member_device(ca2, c, i)
+				bch2_bucket_alloc_cache_drain(c, ca2);
+		}
+	}
+
 	bch2_ec_stop_dev(c, ca);
 }
 
@@ -1140,7 +1356,7 @@ out:
 static inline bool too_many_writepoints(struct bch_fs *c, unsigned factor)
 {
 	u64 stranded	= c->write_points_nr * c->bucket_size_max;
-	u64 free	= bch2_fs_usage_read_short(c).free;
+	u64 free	= bch2_fs_usage_read_short_cached(c).free;
 
 	return stranded * factor > free;
 }
@@ -1198,6 +1414,7 @@ static struct write_point *writepoint_find(struct btree_trans *trans,
 	struct bch_fs *c = trans->c;
 	struct write_point *wp, *oldest;
 	struct hlist_head *head;
+	enum bch_data_temp temp;
 
 	if (!(write_point & 1UL)) {
 		wp = (struct write_point *) write_point;
@@ -1217,10 +1434,18 @@ lock_wp:
 		goto restart_find;
 	}
 restart_find_oldest:
+	/*
+	 * Prefer to steal a write point last used for data of the same
+	 * temperature, so that its open buckets can still be used:
+	 */
 	oldest = NULL;
+	temp = writepoint_hashed_to_temp(write_point);
 	for (wp = c->write_points;
 	     wp < c->write_points + c->write_points_nr; wp++)
-		if (!oldest || time_before64(wp->last_used, oldest->last_used))
+		if (!oldest ||
+		    (wp->temp == temp) > (oldest->temp == temp) ||
+		    ((wp->temp == temp) == (oldest->temp == temp) &&
+		     time_before64(wp->last_used, oldest->last_used)))
 			oldest = wp;
 
 	bch2_trans_mutex_lock_norelock(trans, &oldest->lock);
@@ -1242,6 +1467,7 @@ restart_find_oldest:
 	wp = oldest;
 	hlist_del_rcu(&wp->node);
 	wp->write_point = write_point;
+	wp->temp	= temp;
 	hlist_add_head_rcu(&wp->node, head);
 	mutex_unlock(&c->write_points_hash_lock);
 out:
@@ -1342,8 +1568,10 @@ alloc_done:
 
 	wp->sectors_free = UINT_MAX;
 
-	open_bucket_for_each(c, &wp->ptrs, ob, i)
+	open_bucket_for_each(c, &wp->ptrs, ob, i) {
+		ob->temp = wp->temp;
 		wp->sectors_free = min(wp->sectors_free, ob->sectors_free);
+	}
 
 	BUG_ON(!wp->sectors_free || wp->sectors_free == UINT_MAX);
 
@@ -1402,10 +1630,12 @@ void bch2_alloc_sectors_done(struct bch_fs *c, struct write_point *wp)
 }
 
 static inline void writepoint_init(struct write_point *wp,
-				   enum bch_data_type type)
+				   enum bch_data_type type,
+				   enum bch_data_temp temp)
 {
 	mutex_init(&wp->lock);
 	wp->data_type = type;
+	wp->temp = temp;
 
 	INIT_WORK(&wp->index_update_work, bch2_write_point_do_index_updates);
 	INIT_LIST_HEAD(&wp->writes);
@@ -1420,6 +1650,11 @@ void bch2_fs_allocator_foreground_init(struct bch_fs *c)
 	mutex_init(&c->write_points_hash_lock);
 	c->write_points_nr = ARRAY_SIZE(c->write_points);
 
+	INIT_WORK(&c->bucket_alloc_cache_work, bch2_bucket_alloc_cache_refill_work);
+
+	BUILD_BUG_ON(BCH_COUNTER_write_point_cold - BCH_COUNTER_write_point_hot !=
+		     BCH_DATA_TEMP_cold - BCH_DATA_TEMP_hot);
+
 	/* open bucket 0 is a sentinal NULL: */
 	spin_lock_init(&c->open_buckets[0].lock);
 
@@ -1432,13 +1667,13 @@ void bch2_fs_allocator_foreground_init(struct bch_fs *c)
 		c->open_buckets_freelist = ob - c->open_buckets;
 	}
 
-	writepoint_init(&c->btree_write_point,		BCH_DATA_btree);
-	writepoint_init(&c->rebalance_write_point,	BCH_DATA_user);
-	writepoint_init(&c->copygc_write_point,		BCH_DATA_user);
+	writepoint_init(&c->btree_write_point,		BCH_DATA_btree,	BCH_DATA_TEMP_hot);
+	writepoint_init(&c->rebalance_write_point,	BCH_DATA_user,	BCH_DATA_TEMP_cold);
+	writepoint_init(&c->copygc_write_point,		BCH_DATA_user,	BCH_DATA_TEMP_cold);
 
 	for (wp = c->write_points;
 	     wp < c->write_points + c->write_points_nr; wp++) {
-		writepoint_init(wp, BCH_DATA_user);
+		writepoint_init(wp, BCH_DATA_user, BCH_DATA_TEMP_warm);
 
 		wp->last_used	= local_clock();
 		wp->write_point	= (unsigned long) wp;
@@ -1506,15 +1741,45 @@ static const char * const bch2_write_point_states[] = {
 	NULL
 };
 
+static const char * const bch2_data_temps[] = {
+#define x(n)	#n,
+	BCH_DATA_TEMPS()
+#undef x
+	NULL
+};
+
 void bch2_write_points_to_text(struct printbuf *out, struct bch_fs *c)
 {
 	struct write_point *wp;
+	struct bch_dev *ca;
+	u64 fragmented = 0, dirty = 0;
 	unsigned i;
 
+	for (i = 0; i < BCH_DATA_TEMP_NR; i++) {
+		prt_printf(out, "%s data written: ", bch2_data_temps[i]);
+		prt_human_readable_u64(out, percpu_u64_get(
+			&c->counters[BCH_COUNTER_write_point_hot + i]) << 9);
+		prt_newline(out);
+	}
+
+	for_each_member_device(ca, c, i) {
+		struct bch_dev_usage u = bch2_dev_usage_read(ca);
+
+		fragmented	+= u.d[BCH_DATA_user].fragmented;
+		dirty		+= u.d[BCH_DATA_user].sectors;
+	}
+
+	prt_printf(out, "user data fragmented: ");
+	prt_human_readable_u64(out, fragmented << 9);
+	prt_printf(out, " (%llu%% of %llu sectors)",
+		   div64_u64(fragmented * 100, max(dirty + fragmented, 1ULL)),
+		   dirty);
+	prt_newline(out);
+
 	for (wp = c->write_points;
 	     wp < c->write_points + ARRAY_SIZE(c->write_points);
 	     wp++) {
-		prt_printf(out, "%lu: ", wp->write_point);
+		prt_printf(out, "%lu: %s ", wp->write_point, bch2_data_temps[wp->temp]);
 		prt_human_readable_u64(out, wp->sectors_allocated);
 
 		prt_printf(out, " last wrote: ");
@@ -183,6 +183,10 @@ bch2_alloc_sectors_append_ptrs_inlined(struct bch_fs *c, struct write_point *wp,
 	wp->sectors_free	-= sectors;
 	wp->sectors_allocated	+= sectors;
 
+	if (wp->data_type == BCH_DATA_user)
+		this_cpu_add(c->counters[BCH_COUNTER_write_point_hot + wp->temp],
+			     sectors);
+
 	open_bucket_for_each(c, &wp->ptrs, ob, i) {
 		struct bch_dev *ca = bch_dev_bkey_exists(c, ob->dev);
 		struct bch_extent_ptr ptr = bch2_ob_ptr(c, ob);
@@ -204,9 +208,27 @@ void bch2_alloc_sectors_done(struct bch_fs *, struct write_point *);
 
 void bch2_open_buckets_stop(struct bch_fs *c, struct bch_dev *, bool);
 
+void bch2_dev_bucket_alloc_cache_exit(struct bch_dev *);
+int bch2_dev_bucket_alloc_cache_init(struct bch_dev *);
+
+/*
+ * Hashed write points: bit 0 distinguishes them from pointers to a specific
+ * write point, bits 1-2 are the temperature of the data being written:
+ */
+static inline struct write_point_specifier
+writepoint_hashed_temp(unsigned long v, enum bch_data_temp temp)
+{
+	return (struct write_point_specifier) { .v = (v << 3) | (temp << 1) | 1 };
+}
+
+static inline enum bch_data_temp writepoint_hashed_to_temp(unsigned long v)
+{
+	return (v >> 1) & 3;
+}
+
 static inline struct write_point_specifier writepoint_hashed(unsigned long v)
 {
-	return (struct write_point_specifier) { .v = v | 1 };
+	return writepoint_hashed_temp(v, BCH_DATA_TEMP_warm);
 }
 
 static inline struct write_point_specifier writepoint_ptr(struct write_point *wp)
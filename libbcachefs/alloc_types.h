@@ -56,6 +56,8 @@ struct open_bucket {
 	enum bch_data_type	data_type:6;
 	unsigned		valid:1;
 	unsigned		on_partial_list:1;
+	/* enum bch_data_temp of the write point that last wrote to it: */
+	unsigned		temp:2;
 
 	u8			dev;
 	u8			gen;
@@ -64,6 +66,21 @@ struct open_bucket {
 	struct ec_stripe_new	*ec;
 };
 
+/*
+ * Per cpu caches of open buckets on free buckets, so that the common case of
+ * allocating a bucket touches neither the freespace btree nor freelist_lock:
+ */
+#define BUCKET_ALLOC_CACHE_SIZE	4
+/* Open buckets that may be held in per cpu caches, across all devices: */
+#define OPEN_BUCKETS_CACHED_MAX	(OPEN_BUCKETS_COUNT / 16)
+
+struct bucket_alloc_cache {
+	spinlock_t		lock;
+	u8			nr;
+	bool			want_refill;
+	open_bucket_idx_t	obs[BUCKET_ALLOC_CACHE_SIZE];
+};
+
 #define OPEN_BUCKET_LIST_MAX	15
 
 struct open_buckets {
@@ -88,6 +105,27 @@ enum write_point_state {
 	WRITE_POINT_STATE_NR
 };
 
+/*
+ * Expected lifetime of the data going to a write point - data of different
+ * temperatures is kept in different buckets, so that buckets tend to be
+ * emptied all at once and copygc has less to move:
+ *
+ * hot:		overwrites of existing data
+ * warm:	new data
+ * cold:	data being moved by copygc, rebalance and data jobs
+ */
+#define BCH_DATA_TEMPS()		\
+	x(hot)				\
+	x(warm)				\
+	x(cold)
+
+enum bch_data_temp {
+#define x(n)	BCH_DATA_TEMP_##n,
+	BCH_DATA_TEMPS()
+#undef x
+	BCH_DATA_TEMP_NR
+};
+
 struct write_point {
 	struct {
 		struct hlist_node	node;
@@ -95,6 +133,7 @@ struct write_point {
 		u64			last_used;
 		unsigned long		write_point;
 		enum bch_data_type	data_type;
+		enum bch_data_temp	temp;
 
 		/* calculated based on how many pointers we're actually going to use: */
 		unsigned		sectors_free;
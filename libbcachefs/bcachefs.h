@@ -388,6 +388,8 @@ BCH_DEBUG_PARAMS_DEBUG()
 	x(blocked_journal)			\
 	x(blocked_allocate)			\
 	x(blocked_allocate_open_bucket)		\
+	x(blocked_btree_node_lock)		\
+	x(btree_lock_cycle_check)		\
 	x(nocow_lock_contended)
 
 enum bch_time_stats {
@@ -515,6 +517,7 @@ struct bch_dev {
 	/* Allocator: */
 	u64			new_fs_bucket_idx;
 	u64			alloc_cursor;
+	struct bucket_alloc_cache __percpu *alloc_cache;
 
 	unsigned		nr_open_buckets;
 	unsigned		nr_btree_reserve;
@@ -528,6 +531,8 @@ struct bch_dev {
 	struct journal_device	journal;
 	u64			prev_journal_sector;
 
+	struct btree_write_queue btree_write_queue;
+
 	struct work_struct	io_error_work;
 
 	/* The rest of this all shows up in sysfs */
@@ -643,9 +648,11 @@ struct btree_path_buf {
 	x(fallocate)							\
 	x(discard)							\
 	x(invalidate)							\
+	x(bucket_alloc_cache)						\
 	x(delete_dead_snapshots)					\
 	x(snapshot_delete_pagecache)					\
-	x(sysfs)
+	x(sysfs)							\
+	x(btree_write_buffer)
 
 enum bch_write_ref {
 #define x(n) BCH_WRITE_REF_##n,
@@ -685,6 +692,8 @@ struct bch_fs {
 	struct bch_dev __rcu	*devs[BCH_SB_MEMBERS_MAX];
 
 	struct bch_replicas_cpu replicas;
+	/* incremented whenever replicas indices change, under mark_lock: */
+	unsigned		replicas_gen;
 	struct bch_replicas_cpu replicas_gc;
 	struct mutex		replicas_gc_lock;
 	mempool_t		replicas_delta_pool;
@@ -780,6 +789,8 @@ struct bch_fs {
 	/* btree_iter.c: */
 	struct mutex		btree_trans_lock;
 	struct list_head	btree_trans_list;
+	/* incremented whenever a transaction starts waiting on a node lock: */
+	atomic64_t		btree_lock_wait_seq;
 	mempool_t		btree_paths_pool;
 	mempool_t		btree_trans_mem_pool;
 	struct btree_path_buf  __percpu	*btree_paths_bufs;
@@ -791,6 +802,14 @@ struct bch_fs {
 	unsigned		btree_key_cache_btrees;
 
 	struct btree_write_buffer btree_write_buffer;
+	/* Background flushes, which committers may be waiting on: */
+	struct workqueue_struct	*btree_write_buffer_wq;
+	/*
+	 * Btrees flushed in parallel from the write buffer: these are waited on
+	 * by flushes that can be running on btree_update_wq, so they need
+	 * their own workqueue:
+	 */
+	struct workqueue_struct	*btree_write_buffer_flush_wq;
 
 	struct workqueue_struct	*btree_update_wq;
 	struct workqueue_struct	*btree_io_complete_wq;
@@ -833,6 +852,9 @@ struct bch_fs {
 	struct mutex		usage_scratch_lock;
 	struct bch_fs_usage_online *usage_scratch;
 
+	struct mutex		usage_snapshot_lock;
+	struct bch_fs_usage_snapshot __rcu *usage_snapshot;
+
 	struct io_clock		io_clock[2];
 
 	/* JOURNAL SEQ BLACKLIST */
@@ -849,6 +871,8 @@ struct bch_fs {
 	open_bucket_idx_t	open_buckets_freelist;
 	open_bucket_idx_t	open_buckets_nr_free;
 	struct closure_waitlist	open_buckets_wait;
+	atomic_t		open_buckets_cached;
+	struct work_struct	bucket_alloc_cache_work;
 	struct open_bucket	open_buckets[OPEN_BUCKETS_COUNT];
 	open_bucket_idx_t	open_buckets_hash[OPEN_BUCKETS_COUNT];
 
@@ -1467,7 +1467,33 @@ struct bch_sb_field_disk_groups {
 	x(write_super,					73)	\
 	x(trans_restart_would_deadlock_recursion_limit,	74)	\
 	x(trans_restart_write_buffer_flush,		75)	\
-	x(trans_restart_split_race,			76)
+	x(trans_restart_split_race,			76)	\
+	x(btree_cache_hit_hot,				77)	\
+	x(btree_cache_hit_cold,				78)	\
+	x(btree_cache_hit_streaming,			79)	\
+	x(btree_cache_miss,				80)	\
+	x(btree_cache_ghost_hit,			81)	\
+	x(btree_cache_promote,				82)	\
+	x(btree_cache_demote,				83)	\
+	x(btree_path_lockless,				84)	\
+	x(btree_path_lockless_fail,			85)	\
+	x(btree_node_lock_contended_read,		86)	\
+	x(btree_node_lock_contended_intent,		87)	\
+	x(btree_node_lock_contended_write,		88)	\
+	x(btree_node_pcpu_readers_on,			89)	\
+	x(btree_node_pcpu_readers_off,			90)	\
+	x(btree_lock_cycle_check,			91)	\
+	x(btree_lock_cycle_check_skipped,		92)	\
+	x(trans_deadlock_backoff,			93)	\
+	x(bucket_discard_range,				94)	\
+	x(bucket_alloc_cache_hit,			95)	\
+	x(bucket_alloc_cache_miss,			96)	\
+	x(write_point_hot,				97)	\
+	x(write_point_warm,				98)	\
+	x(write_point_cold,				99)	\
+	x(write_buffer_throttle,			100)	\
+	x(btree_node_compress,				101)	\
+	x(btree_node_lock_mode_evict,			102)
 
 enum bch_persistent_counters {
 #define x(t, n, ...) BCH_COUNTER_##t,
@@ -1734,7 +1760,9 @@ LE64_BITMASK(BCH_SB_WRITE_BUFFER_SIZE,	struct bch_sb, flags[4], 34, 54);
 	x(new_varint,			15)	\
 	x(journal_no_flush,		16)	\
 	x(alloc_v2,			17)	\
-	x(extents_across_btree_nodes,	18)
+	x(extents_across_btree_nodes,	18)	\
+	x(journal_compression,		19)	\
+	x(btree_node_compression,	20)
 
 #define BCH_SB_FEATURES_ALWAYS				\
 	((1ULL << BCH_FEATURE_new_extent_overwrite)|	\
@@ -2071,6 +2099,18 @@ struct jset {
 LE32_BITMASK(JSET_CSUM_TYPE,	struct jset, flags, 0, 4);
 LE32_BITMASK(JSET_BIG_ENDIAN,	struct jset, flags, 4, 5);
 LE32_BITMASK(JSET_NO_FLUSH,	struct jset, flags, 5, 6);
+LE32_BITMASK(JSET_COMPRESSION_TYPE,struct jset, flags, 6, 10);
+
+/*
+ * If JSET_COMPRESSION_TYPE is set, d[] contains a single jset_compressed
+ * header followed by the compressed entries; u64s then refers to the
+ * compressed size:
+ */
+struct jset_compressed {
+	__le32			u64s; /* uncompressed size of d[] in u64s */
+	__le32			bytes; /* size of data[] */
+	__u8			data[0];
+} __packed __aligned(8);
 
 #define BCH_JOURNAL_BUCKETS_MIN		8
 
@@ -2137,6 +2177,21 @@ LE32_BITMASK(BSET_CSUM_TYPE,	struct bset, flags, 0, 4);
 LE32_BITMASK(BSET_BIG_ENDIAN,	struct bset, flags, 4, 5);
 LE32_BITMASK(BSET_SEPARATE_WHITEOUTS,
 				struct bset, flags, 5, 6);
+LE32_BITMASK(BSET_COMPRESSION_TYPE,
+				struct bset, flags, 6, 10);
+
+/*
+ * If BSET_COMPRESSION_TYPE is set, _data[] contains a single bset_compressed
+ * header followed by the compressed keys; u64s then refers to the compressed
+ * size. The bset still occupies its uncompressed size within the btree node
+ * (BSET_OFFSET of the next bset is computed from it), only the compressed
+ * sectors are written:
+ */
+struct bset_compressed {
+	__le32			u64s; /* uncompressed size of _data[] in u64s */
+	__le32			bytes; /* size of data[] */
+	__u8			data[0];
+} __packed __aligned(8);
 
 /* Sector offset within the btree node: */
 LE32_BITMASK(BSET_OFFSET,	struct bset, flags, 16, 32);
@@ -6,54 +6,104 @@
 #include "bset.h"
 #include "extents.h"
 
+#include <linux/prefetch.h>
+
 typedef int (*sort_cmp_fn)(struct btree *,
 			   struct bkey_packed *,
 			   struct bkey_packed *);
 
-static inline bool sort_iter_end(struct sort_iter *iter)
-{
-	return !iter->used;
-}
+/*
+ * The sets being merged are the leaves of a tournament (loser) tree: with n
+ * sets, leaf j is at position n + j and internal node p has children 2p and
+ * 2p + 1. Each internal node records the set that lost the comparison there,
+ * and node 0 records the overall winner - so after advancing the winner only
+ * the path from its leaf to the root has to be replayed, which is log2(n)
+ * comparisons, no matter how many sets there are.
+ *
+ * The tree is stored in data[p].loser. Exhausted sets compare greater than
+ * everything else, and ties go to the lower numbered (older) set.
+ */
+#define SORT_ITER_EMPTY		UINT_MAX
 
-static inline void sort_iter_sift(struct sort_iter *iter, unsigned from,
-				  sort_cmp_fn cmp)
+static inline bool sort_iter_set_less(struct sort_iter *iter,
+				      unsigned l, unsigned r,
+				      sort_cmp_fn cmp)
 {
-	unsigned i;
+	struct sort_iter_set *sl = iter->data + l;
+	struct sort_iter_set *sr = iter->data + r;
+	int c;
+
+	if (sl->k == sl->end)
+		return false;
+	if (sr->k == sr->end)
+		return true;
 
-	for (i = from;
-	     i + 1 < iter->used &&
-	     cmp(iter->b, iter->data[i].k, iter->data[i + 1].k) > 0;
-	     i++)
-		swap(iter->data[i], iter->data[i + 1]);
+	c = cmp(iter->b, sl->k, sr->k);
+	return c ? c < 0 : l < r;
 }
 
 static inline void sort_iter_sort(struct sort_iter *iter, sort_cmp_fn cmp)
 {
-	unsigned i = iter->used;
+	unsigned n = iter->used, j, p, w;
+
+	for (p = 1; p < n; p++)
+		iter->data[p].loser = SORT_ITER_EMPTY;
+
+	/*
+	 * Each internal node passes one set up, once it's seen the winners of
+	 * both of its subtrees; the first one to arrive waits there:
+	 */
+	for (j = 0; j < n; j++) {
+		w = j;
+
+		for (p = (n + j) >> 1; p; p >>= 1) {
+			unsigned *l = &iter->data[p].loser;
 
-	while (i--)
-		sort_iter_sift(iter, i, cmp);
+			if (*l == SORT_ITER_EMPTY) {
+				*l = w;
+				break;
+			}
+
+			if (sort_iter_set_less(iter, *l, w, cmp))
+				swap(*l, w);
+		}
+
+		if (!p)
+			iter->data[0].loser = w;
+	}
 }
 
 static inline struct bkey_packed *sort_iter_peek(struct sort_iter *iter)
 {
-	return !sort_iter_end(iter) ? iter->data->k : NULL;
+	struct sort_iter_set *i;
+
+	if (!iter->used)
+		return NULL;
+
+	i = iter->data + iter->data[0].loser;
+	return i->k != i->end ? i->k : NULL;
 }
 
 static inline void sort_iter_advance(struct sort_iter *iter, sort_cmp_fn cmp)
 {
-	struct sort_iter_set *i = iter->data;
+	unsigned w = iter->data[0].loser, p;
+	struct sort_iter_set *i = iter->data + w;
 
 	BUG_ON(!iter->used);
+	BUG_ON(i->k == i->end);
 
 	i->k = bkey_p_next(i->k);
 
 	BUG_ON(i->k > i->end);
 
-	if (i->k == i->end)
-		array_remove_item(iter->data, iter->used, 0);
-	else
-		sort_iter_sift(iter, 0, cmp);
+	if (i->k != i->end)
+		prefetch(bkey_p_next(i->k));
+
+	for (p = (iter->used + w) >> 1; p; p >>= 1)
+		if (sort_iter_set_less(iter, iter->data[p].loser, w, cmp))
+			swap(iter->data[p].loser, w);
+
+	iter->data[0].loser = w;
 }
 
 static inline struct bkey_packed *sort_iter_next(struct sort_iter *iter,
@@ -74,21 +124,21 @@ static inline int key_sort_fix_overlapping_cmp(struct btree *b,
 					       struct bkey_packed *l,
 					       struct bkey_packed *r)
 {
-	return bch2_bkey_cmp_packed(b, l, r) ?:
+	return bch2_bkey_cmp_packed_inlined(b, l, r) ?:
 		cmp_int((unsigned long) l, (unsigned long) r);
 }
 
-static inline bool should_drop_next_key(struct sort_iter *iter)
+static inline bool should_drop_key(struct sort_iter *iter,
+				   struct bkey_packed *k)
 {
+	struct bkey_packed *next = sort_iter_peek(iter);
+
 	/*
-	 * key_sort_cmp() ensures that when keys compare equal the older key
-	 * comes first; so if l->k compares equal to r->k then l->k is older
-	 * and should be dropped.
+	 * key_sort_fix_overlapping_cmp() ensures that when keys compare equal
+	 * the older key comes first; so if @k compares equal to the next key
+	 * then @k is older and should be dropped.
 	 */
-	return iter->used >= 2 &&
-		!bch2_bkey_cmp_packed(iter->b,
-				 iter->data[0].k,
-				 iter->data[1].k);
+	return next && !bch2_bkey_cmp_packed_inlined(iter->b, k, next);
 }
 
 struct btree_nr_keys
@@ -103,15 +153,13 @@ bch2_key_sort_fix_overlapping(struct bch_fs *c, struct bset *dst,
 
 	sort_iter_sort(iter, key_sort_fix_overlapping_cmp);
 
-	while ((k = sort_iter_peek(iter))) {
+	while ((k = sort_iter_next(iter, key_sort_fix_overlapping_cmp))) {
 		if (!bkey_deleted(k) &&
-		    !should_drop_next_key(iter)) {
+		    !should_drop_key(iter, k)) {
 			bkey_copy(out, k);
 			btree_keys_account_key_add(&nr, 0, out);
 			out = bkey_p_next(out);
 		}
-
-		sort_iter_advance(iter, key_sort_fix_overlapping_cmp);
 	}
 
 	dst->u64s = cpu_to_le16((u64 *) out - dst->_data);
@@ -9,6 +9,8 @@ struct sort_iter {
 
 	struct sort_iter_set {
 		struct bkey_packed *k, *end;
+		/* tournament tree node, see bkey_sort.c: */
+		unsigned	loser;
 	} data[MAX_BSETS + 1];
 };
 
@@ -7,6 +7,7 @@
  */
 
 #include "bcachefs.h"
+#include "bkey_cmp.h"
 #include "btree_cache.h"
 #include "bset.h"
 #include "eytzinger.h"
@@ -1108,6 +1109,30 @@ static inline bool bkey_mantissa_bits_dropped(const struct btree *b,
 #endif
 }
 
+/*
+ * Compare @packed_search against the bkey_float for node @n, if that can be
+ * done without looking at the key: returns 1 if the search key is greater, 0 if
+ * less or equal, -1 if we need the slowpath:
+ */
+static __always_inline int bfloat_cmp(const struct btree *b,
+				      const struct bkey_float *f,
+				      const struct bkey_packed *packed_search,
+				      unsigned n)
+{
+	unsigned l, r;
+
+	if (unlikely(f->exponent >= BFLOAT_FAILED))
+		return -1;
+
+	l = f->mantissa;
+	r = bkey_mantissa(packed_search, f, n);
+
+	if (unlikely(l == r) && bkey_mantissa_bits_dropped(b, f, n))
+		return -1;
+
+	return l < r;
+}
+
 __flatten
 static struct bkey_packed *bset_search_tree(const struct btree *b,
 				const struct bset_tree *t,
@@ -1121,6 +1146,34 @@ static struct bkey_packed *bset_search_tree(const struct btree *b,
 	int cmp;
 
 	do {
+		/*
+		 * Descend two levels at a time: node n's children are
+		 * adjacent, and comparing against them doesn't depend on the
+		 * result at n - so all three mantissa comparisons can be done
+		 * in parallel, and the next node is picked without a branch.
+		 * This roughly halves the chain of dependent loads, which is
+		 * what bounds this loop:
+		 */
+		while (n * 2 + 1 < t->size) {
+			int c0, c1, c2;
+
+			if (likely(n << 4 < t->size))
+				prefetch(&base->f[n << 4]);
+
+			c0 = bfloat_cmp(b, &base->f[n],		packed_search, n);
+			c1 = bfloat_cmp(b, &base->f[n * 2],	packed_search, n * 2);
+			c2 = bfloat_cmp(b, &base->f[n * 2 + 1],	packed_search, n * 2 + 1);
+
+			if (unlikely((c0 | c1 | c2) < 0))
+				break;
+
+			n = n * 4 + (c0 << 1) + (c0 ? c2 : c1);
+		}
+
+		if (n >= t->size)
+			break;
+
+		/* last level, or one of the nodes needs the slowpath: */
 		if (likely(n << 4 < t->size))
 			prefetch(&base->f[n << 4]);
 
@@ -1150,6 +1203,9 @@ slowpath:
 	/*
 	 * n would have been the node we recursed to - the low bit tells us if
 	 * we recursed left or recursed right.
+	 *
+	 * The two level descent doesn't set f, so look up the last node we
+	 * compared against here:
 	 */
 	if (likely(!(n & 1))) {
 		--inorder;
@@ -1157,6 +1213,8 @@ slowpath:
 			return btree_bkey_first(b, t);
 
 		f = &base->f[eytzinger1_prev(n >> 1, t->size - 1)];
+	} else {
+		f = &base->f[n >> 1];
 	}
 
 	return cacheline_to_bkey(b, t, inorder, f->key_offset);
@@ -1196,6 +1254,22 @@ struct bkey_packed *__bch2_bset_search(struct btree *b,
 	}
 }
 
+/*
+ * bkey_iter_cmp_p_or_unp(), with the comparison of two packed keys inlined -
+ * this is the common case when scanning the tail of a search:
+ */
+static __always_inline int bkey_iter_cmp_packed_inlined(const struct btree *b,
+				const struct bkey_packed *l,
+				const struct bkey_packed *r_packed,
+				const struct bpos *r)
+{
+	int cmp = likely(bkey_packed(l))
+		? __bch2_bkey_cmp_packed_format_checked_inlined(l, r_packed, b)
+		: bpos_cmp(packed_to_bkey_c(l)->p, *r);
+
+	return cmp ?: -((int) bkey_deleted(l));
+}
+
 static __always_inline __flatten
 struct bkey_packed *bch2_bset_search_linear(struct btree *b,
 				struct bset_tree *t,
@@ -1204,14 +1278,16 @@ struct bkey_packed *bch2_bset_search_linear(struct btree *b,
 				const struct bkey_packed *lossy_packed_search,
 				struct bkey_packed *m)
 {
+	struct bkey_packed *end = btree_bkey_last(b, t);
+
 	if (lossy_packed_search)
-		while (m != btree_bkey_last(b, t) &&
-		       bkey_iter_cmp_p_or_unp(b, m,
+		while (m != end &&
+		       bkey_iter_cmp_packed_inlined(b, m,
 					lossy_packed_search, search) < 0)
 			m = bkey_p_next(m);
 
 	if (!packed_search)
-		while (m != btree_bkey_last(b, t) &&
+		while (m != end &&
 		       bkey_iter_pos_cmp(b, m, search) < 0)
 			m = bkey_p_next(m);
 
@@ -1359,6 +1435,223 @@ void bch2_btree_node_iter_init(struct btree_node_iter *iter,
 	bch2_btree_node_iter_sort(iter, b);
 }
 
+/* Lockless lookup: */
+
+/*
+ * Everything here may be racing with the node being modified, compacted or
+ * reused for a different node - the caller validates the node's lock sequence
+ * number afterwards - so nothing read from the node is trusted: every key is
+ * bounds checked before it's dereferenced, and we never call the node's
+ * compiled unpack function.
+ */
+
+static inline bool bkey_lockless_ok(const struct btree *b,
+				    const struct bkey_packed *k,
+				    const struct bkey_packed *start,
+				    const struct bkey_packed *end)
+{
+	return k >= start && k < end &&
+		k->u64s >= bkeyp_key_u64s(&b->format, k) &&
+		bkey_p_next(k) <= end;
+}
+
+static inline struct bpos bkey_lockless_pos(const struct btree *b,
+					    const struct bkey_packed *k)
+{
+	return bkey_packed(k)
+		? __bch2_bkey_unpack_key(&b->format, k).p
+		: packed_to_bkey_c(k)->p;
+}
+
+static bool bset_tree_lockless_ok(const struct btree *b,
+				  const struct bset_tree *t,
+				  unsigned data_u64s)
+{
+	unsigned aux_u64s = btree_aux_data_u64s(b);
+
+	if (btree_bkey_first_offset(t) > t->end_offset ||
+	    t->end_offset > data_u64s)
+		return false;
+
+	switch (t->extra) {
+	case BSET_NO_AUX_TREE_VAL:
+		return true;
+	case BSET_RW_AUX_TREE_VAL:
+		return t->size &&
+			t->aux_data_offset < aux_u64s &&
+			bset_aux_tree_buf_end(t) <= aux_u64s;
+	default:
+		return t->size >= 2 &&
+			t->extra == (t->size - rounddown_pow_of_two(t->size - 1)) << 1 &&
+			t->aux_data_offset < aux_u64s &&
+			bset_aux_tree_buf_end(t) <= aux_u64s;
+	}
+}
+
+static struct bkey_packed *bset_search_tree_lockless(const struct btree *b,
+				const struct bset_tree *t,
+				struct bpos search,
+				const struct bkey_packed *packed_search)
+{
+	struct ro_aux_tree *base = ro_aux_tree_base(b, t);
+	struct bkey_packed *start = __btree_node_offset_to_key(b, btree_bkey_first_offset(t));
+	struct bkey_packed *end = __btree_node_offset_to_key(b, t->end_offset);
+	struct bkey_float *f;
+	struct bkey_packed *k;
+	unsigned inorder, n = 1, l, r;
+
+	do {
+		f = &base->f[n];
+		if (f->exponent < BFLOAT_FAILED) {
+			l = f->mantissa;
+			r = bkey_mantissa(packed_search, f, n);
+
+			if (l != r || !bkey_mantissa_bits_dropped(b, f, n)) {
+				n = n * 2 + (l < r);
+				continue;
+			}
+		}
+
+		k = tree_to_bkey(b, t, n);
+		if (!bkey_lockless_ok(b, k, start, end))
+			return NULL;
+
+		n = n * 2 + bpos_lt(bkey_lockless_pos(b, k), search);
+	} while (n < t->size);
+
+	inorder = __eytzinger1_to_inorder(n >> 1, t->size - 1, t->extra);
+
+	if (likely(!(n & 1))) {
+		--inorder;
+		if (unlikely(!inorder))
+			return start;
+
+		f = &base->f[eytzinger1_prev(n >> 1, t->size - 1)];
+	}
+
+	return cacheline_to_bkey(b, t, inorder, f->key_offset);
+}
+
+static struct bkey_packed *bset_search_write_set_lockless(const struct btree *b,
+				struct bset_tree *t,
+				struct bpos search)
+{
+	unsigned l = 0, r = t->size;
+
+	while (l + 1 != r) {
+		unsigned m = (l + r) >> 1;
+
+		if (bpos_lt(rw_aux_tree(b, t)[m].k, search))
+			l = m;
+		else
+			r = m;
+	}
+
+	return rw_aux_to_bkey(b, t, l);
+}
+
+/**
+ * bch2_btree_node_search_lockless - look up a key in an unlocked btree node
+ * @c:		filesystem
+ * @_b:		btree node, not locked by the caller
+ * @search:	position to search for
+ * @ret:	returns the first live key >= @search
+ * @val_u64s_max: size of @ret's value
+ *
+ * Returns false if no key was found or an inconsistency was detected; if it
+ * returns true, the caller must still check that @_b's lock sequence number
+ * hasn't changed since it was read before trusting @ret.
+ */
+bool bch2_btree_node_search_lockless(struct bch_fs *c, struct btree *_b,
+				     struct bpos search, struct bkey_i *ret,
+				     unsigned val_u64s_max)
+{
+	struct btree b;
+	struct bkey_packed p, *best = NULL;
+	struct bpos best_pos = SPOS_MAX;
+	unsigned i, val_u64s, data_u64s = btree_bytes(c) / sizeof(u64);
+
+	/* Snapshot just the fields the lookup code uses: */
+	b.data		= READ_ONCE(_b->data);
+	b.aux_data	= READ_ONCE(_b->aux_data);
+	b.nsets		= READ_ONCE(_b->nsets);
+	b.byte_order	= READ_ONCE(_b->byte_order);
+	b.nr_key_bits	= READ_ONCE(_b->nr_key_bits);
+	b.format	= _b->format;
+	memcpy(b.set, _b->set, sizeof(b.set));
+	barrier();
+
+	if (!b.data || !b.aux_data ||
+	    b.nsets > MAX_BSETS ||
+	    (1U << min_t(unsigned, b.byte_order, 31)) != btree_bytes(c) ||
+	    !b.format.key_u64s ||
+	    b.format.key_u64s > BKEY_U64s)
+		return false;
+
+	if (bch2_bkey_pack_pos_lossy(&p, search, &b) == BKEY_PACK_POS_FAIL)
+		return false;
+
+	for (i = 0; i < b.nsets; i++) {
+		struct bset_tree *t = b.set + i;
+		struct bkey_packed *start, *end, *k;
+
+		if (!bset_tree_lockless_ok(&b, t, data_u64s))
+			return false;
+
+		start	= __btree_node_offset_to_key(&b, btree_bkey_first_offset(t));
+		end	= __btree_node_offset_to_key(&b, t->end_offset);
+
+		switch (bset_aux_tree_type(t)) {
+		case BSET_NO_AUX_TREE:
+			k = start;
+			break;
+		case BSET_RW_AUX_TREE:
+			k = bset_search_write_set_lockless(&b, t, search);
+			break;
+		case BSET_RO_AUX_TREE:
+			k = bset_search_tree_lockless(&b, t, search, &p);
+			if (!k)
+				return false;
+			break;
+		default:
+			unreachable();
+		}
+
+		for (; k != end; k = bkey_p_next(k)) {
+			struct bpos pos;
+
+			if (!bkey_lockless_ok(&b, k, start, end))
+				return false;
+
+			if (bkey_deleted(k))
+				continue;
+
+			pos = bkey_lockless_pos(&b, k);
+			if (bpos_ge(pos, search)) {
+				if (!best || bpos_lt(pos, best_pos)) {
+					best = k;
+					best_pos = pos;
+				}
+				break;
+			}
+		}
+	}
+
+	if (!best)
+		return false;
+
+	val_u64s = bkeyp_val_u64s(&b.format, best);
+	if (val_u64s > val_u64s_max)
+		return false;
+
+	ret->k = bkey_packed(best)
+		? __bch2_bkey_unpack_key(&b.format, best)
+		: *packed_to_bkey_c(best);
+	ret->k.u64s = BKEY_U64s + val_u64s;
+	memcpy_u64s(&ret->v, bkeyp_val(&b.format, best), val_u64s);
+	return true;
+}
+
 void bch2_btree_node_iter_init_from_start(struct btree_node_iter *iter,
 					  struct btree *b)
 {
@@ -332,6 +332,8 @@ void bch2_btree_node_iter_init(struct btree_node_iter *, struct btree *,
 			       struct bpos *);
 void bch2_btree_node_iter_init_from_start(struct btree_node_iter *,
 					  struct btree *);
+bool bch2_btree_node_search_lockless(struct bch_fs *, struct btree *,
+				     struct bpos, struct bkey_i *, unsigned);
 struct bkey_packed *bch2_btree_node_iter_bset_pos(struct btree_node_iter *,
 						 struct btree *,
 						 struct bset_tree *);
@@ -10,6 +10,7 @@
 #include "errcode.h"
 #include "error.h"
 
+#include <linux/hash.h>
 #include <linux/prefetch.h>
 #include <linux/sched/mm.h>
 #include <linux/seq_buf.h>
@@ -56,19 +57,45 @@ static void btree_node_to_freedlist(struct btree_cache *bc, struct btree *b)
 		list_move(&b->list, &bc->freed_nonpcpu);
 }
 
+/*
+ * Lockless lookups (btree_path_traverse_lockless()) may still be reading a
+ * node's buffers after it's been freed, so the actual free is deferred until
+ * after an RCU grace period - this is stashed at the start of the data buffer
+ * being freed:
+ */
+struct btree_node_data_rcu {
+	struct rcu_head		rcu;
+	void			*aux_data;
+	size_t			data_bytes;
+	size_t			aux_data_bytes;
+};
+
+static void btree_node_data_free_rcu(struct rcu_head *rcu)
+{
+	struct btree_node_data_rcu *d =
+		container_of(rcu, struct btree_node_data_rcu, rcu);
+
+#ifdef __KERNEL__
+	vfree(d->aux_data);
+#else
+	munmap(d->aux_data, d->aux_data_bytes);
+#endif
+	kvpfree(d, d->data_bytes);
+}
+
 static void btree_node_data_free(struct bch_fs *c, struct btree *b)
 {
 	struct btree_cache *bc = &c->btree_cache;
+	struct btree_node_data_rcu *d = (void *) b->data;
 
 	EBUG_ON(btree_node_write_in_flight(b));
 
-	kvpfree(b->data, btree_bytes(c));
+	d->aux_data		= b->aux_data;
+	d->data_bytes		= btree_bytes(c);
+	d->aux_data_bytes	= btree_aux_data_bytes(b);
+	call_rcu(&d->rcu, btree_node_data_free_rcu);
+
 	b->data = NULL;
-#ifdef __KERNEL__
-	vfree(b->aux_data);
-#else
-	munmap(b->aux_data, btree_aux_data_bytes(b));
-#endif
 	b->aux_data = NULL;
 
 	bc->used--;
@@ -163,6 +190,9 @@ void bch2_btree_node_hash_remove(struct btree_cache *bc, struct btree *b)
 
 	BUG_ON(ret);
 
+	if (test_and_clear_bit(BTREE_NODE_hot, &b->flags))
+		atomic_dec(&bc->nr_hot);
+
 	/* Cause future lookups for this node to fail: */
 	b->hash_val = 0;
 }
@@ -193,6 +223,78 @@ int bch2_btree_node_hash_insert(struct btree_cache *bc, struct btree *b,
 	return ret;
 }
 
+/* Btree in memory cache - replacement policy */
+
+static inline u64 *btree_cache_ghost(struct btree_cache *bc, u64 hash_val)
+{
+	return bc->ghosts + hash_64(hash_val, BTREE_CACHE_NR_GHOSTS_BITS);
+}
+
+/* Remember a node we're evicting, in case it's read back in soon: */
+static void btree_cache_ghost_add(struct btree_cache *bc, struct btree *b)
+{
+	lockdep_assert_held(&bc->lock);
+
+	if (b->hash_val)
+		WRITE_ONCE(*btree_cache_ghost(bc, b->hash_val), b->hash_val);
+}
+
+static bool btree_cache_ghost_hit(struct btree_cache *bc, struct btree *b)
+{
+	u64 *ghost = btree_cache_ghost(bc, b->hash_val);
+
+	if (likely(READ_ONCE(*ghost) != b->hash_val))
+		return false;
+
+	WRITE_ONCE(*ghost, 0);
+	return true;
+}
+
+static inline unsigned btree_cache_hot_target(struct btree_cache *bc)
+{
+	return bc->used * 3 / 4;
+}
+
+static void btree_cache_promote(struct bch_fs *c, struct btree *b)
+{
+	struct btree_cache *bc = &c->btree_cache;
+
+	if (atomic_read(&bc->nr_hot) >= btree_cache_hot_target(bc))
+		return;
+
+	if (!test_and_set_bit(BTREE_NODE_hot, &b->flags)) {
+		atomic_inc(&bc->nr_hot);
+		this_cpu_inc(c->counters[BCH_COUNTER_btree_cache_promote]);
+	}
+}
+
+static void btree_cache_demote(struct bch_fs *c, struct btree *b)
+{
+	struct btree_cache *bc = &c->btree_cache;
+
+	if (test_and_clear_bit(BTREE_NODE_hot, &b->flags)) {
+		atomic_dec(&bc->nr_hot);
+		this_cpu_inc(c->counters[BCH_COUNTER_btree_cache_demote]);
+	}
+}
+
+static inline void btree_cache_miss(struct bch_fs *c, struct btree *b,
+				    bool streaming)
+{
+	this_cpu_inc(c->counters[BCH_COUNTER_btree_cache_miss]);
+
+	/*
+	 * A node that was evicted recently and is now being read back in wasn't
+	 * really cold - make sure it's promoted on the next pass of the
+	 * shrinker:
+	 */
+	if (!streaming &&
+	    btree_cache_ghost_hit(&c->btree_cache, b)) {
+		this_cpu_inc(c->counters[BCH_COUNTER_btree_cache_ghost_hit]);
+		set_btree_node_accessed(b);
+	}
+}
+
 __flatten
 static inline struct btree *btree_cache_find(struct btree_cache *bc,
 				     const struct bkey_i *k)
@@ -371,14 +473,27 @@ restart:
 	list_for_each_entry_safe(b, t, &bc->live, list) {
 		touched++;
 
-		if (btree_node_accessed(b)) {
+		if (btree_node_hot(b)) {
+			/*
+			 * Hot nodes get demoted after a full pass without being
+			 * accessed, and then have to go another full pass
+			 * before they're evicted:
+			 */
+			if (btree_node_accessed(b))
+				clear_btree_node_accessed(b);
+			else
+				btree_cache_demote(c, b);
+			bc->not_freed_hot++;
+		} else if (btree_node_accessed(b)) {
 			clear_btree_node_accessed(b);
+			btree_cache_promote(c, b);
 			bc->not_freed_access_bit++;
 		} else if (!btree_node_reclaim(c, b, true)) {
 			freed++;
 			btree_node_data_free(c, b);
 			bc->freed++;
 
+			btree_cache_ghost_add(bc, b);
 			bch2_btree_node_hash_remove(bc, b);
 			six_unlock_write(&b->c.lock);
 			six_unlock_intent(&b->c.lock);
@@ -440,6 +555,130 @@ static void bch2_btree_cache_shrinker_to_text(struct seq_buf *s, struct shrinker
 	seq_buf_commit(s, out.pos);
 }
 
+#define BTREE_LOCK_MODE_MIN_SAMPLES	4096
+#define BTREE_LOCK_MODE_EVICT_MAX	64
+
+/*
+ * Interior nodes default to percpu reader counts: they're read locked far more
+ * often than they're written to, and with a single atomic reader count every
+ * traversal bounces the lock's cacheline. But then taking a write lock has to
+ * sum the reader counts of every cpu - so if write locks are more than
+ * 1/nr_cpus of the lock traffic on some btree and level, nodes there get an
+ * atomic reader count instead, until reads dominate again.
+ *
+ * Returns true if the mode changed:
+ */
+static bool btree_lock_mode_update(struct bch_fs *c, enum btree_id id,
+				   unsigned level)
+{
+	struct btree_cache *bc = &c->btree_cache;
+	struct btree_lock_mode *m = &bc->lock_mode[id][level];
+	u64 read = 0, write = 0, nr_read, nr_write, nr_cpus = num_online_cpus();
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct btree_node_lock_stats *s = per_cpu_ptr(bc->lock_stats, cpu);
+
+		read	+= s->read[id][level];
+		write	+= s->write[id][level];
+	}
+
+	nr_read		= read - m->read;
+	nr_write	= write - m->write;
+
+	if (nr_read + nr_write < BTREE_LOCK_MODE_MIN_SAMPLES)
+		return false;
+
+	m->read		= read;
+	m->write	= write;
+
+	if (m->pcpu_readers && nr_write * nr_cpus > nr_read) {
+		WRITE_ONCE(m->pcpu_readers, false);
+		this_cpu_inc(c->counters[BCH_COUNTER_btree_node_pcpu_readers_off]);
+		return true;
+	}
+
+	if (!m->pcpu_readers && nr_read > nr_write * nr_cpus * 2) {
+		WRITE_ONCE(m->pcpu_readers, true);
+		this_cpu_inc(c->counters[BCH_COUNTER_btree_node_pcpu_readers_on]);
+		return true;
+	}
+
+	return false;
+}
+
+static bool btree_node_lock_mode_stale(struct btree_cache *bc, struct btree *b)
+{
+#ifdef __KERNEL__
+	return b->c.level &&
+		!b->c.lock.readers !=
+		!READ_ONCE(bc->lock_mode[b->c.btree_id][b->c.level].pcpu_readers);
+#else
+	/* six_lock_pcpu_alloc() is a noop in userspace: */
+	return false;
+#endif
+}
+
+/*
+ * Queued by btree_node_lock_account() at most once a second while there's
+ * interior node lock traffic: updates the mode for each btree and level.
+ *
+ * A lock can't be switched between modes while the node might be in use, so
+ * when the mode changes, cached nodes with the old mode are evicted if they're
+ * clean and nothing has them locked, and they'll be read back in with the new
+ * mode. Nodes we couldn't evict - and the rest, past BTREE_LOCK_MODE_EVICT_MAX,
+ * so that we don't trigger a storm of reads - are retried on the next pass.
+ * Roots aren't on the live list: they switch when they're next reallocated.
+ */
+static void bch2_btree_lock_mode_work(struct work_struct *work)
+{
+	struct bch_fs *c = container_of(work, struct bch_fs, btree_cache.lock_mode_work);
+	struct btree_cache *bc = &c->btree_cache;
+	struct btree *b, *t;
+	unsigned i, l, flags, nr_evicted = 0;
+	bool evict = false;
+
+	for (i = 0; i < BTREE_ID_NR; i++)
+		for (l = 1; l < BTREE_MAX_DEPTH; l++) {
+			struct btree_lock_mode *m = &bc->lock_mode[i][l];
+
+			if (btree_lock_mode_update(c, i, l))
+				m->evict = true;
+			evict |= m->evict;
+			m->evict = false;
+		}
+
+	if (!evict)
+		return;
+
+	flags = memalloc_nofs_save();
+	mutex_lock(&bc->lock);
+
+	list_for_each_entry_safe(b, t, &bc->live, list) {
+		if (!btree_node_lock_mode_stale(bc, b))
+			continue;
+
+		if (nr_evicted >= BTREE_LOCK_MODE_EVICT_MAX ||
+		    btree_node_reclaim(c, b, false)) {
+			bc->lock_mode[b->c.btree_id][b->c.level].evict = true;
+			continue;
+		}
+
+		btree_cache_demote(c, b);
+		btree_node_data_free(c, b);
+		btree_cache_ghost_add(bc, b);
+		bch2_btree_node_hash_remove(bc, b);
+		six_unlock_write(&b->c.lock);
+		six_unlock_intent(&b->c.lock);
+		nr_evicted++;
+	}
+
+	mutex_unlock(&bc->lock);
+	memalloc_nofs_restore(flags);
+
+	this_cpu_add(c->counters[BCH_COUNTER_btree_node_lock_mode_evict], nr_evicted);
+}
+
 void bch2_fs_btree_cache_exit(struct bch_fs *c)
 {
 	struct btree_cache *bc = &c->btree_cache;
@@ -449,6 +688,8 @@ void bch2_fs_btree_cache_exit(struct bch_fs *c)
 	if (bc->shrink.list.next)
 		unregister_shrinker(&bc->shrink);
 
+	cancel_work_sync(&bc->lock_mode_work);
+
 	/* vfree() can allocate memory: */
 	flags = memalloc_nofs_save();
 	mutex_lock(&bc->lock);
@@ -493,16 +734,28 @@ void bch2_fs_btree_cache_exit(struct bch_fs *c)
 
 	if (bc->table_init_done)
 		rhashtable_destroy(&bc->table);
+
+	free_percpu(bc->lock_stats);
 }
 
 int bch2_fs_btree_cache_init(struct bch_fs *c)
 {
 	struct btree_cache *bc = &c->btree_cache;
-	unsigned i;
+	unsigned i, j;
 	int ret = 0;
 
 	pr_verbose_init(c->opts, "");
 
+	bc->lock_stats = alloc_percpu(struct btree_node_lock_stats);
+	if (!bc->lock_stats) {
+		ret = -BCH_ERR_ENOMEM_fs_btree_cache_init;
+		goto out;
+	}
+
+	for (i = 0; i < BTREE_ID_NR; i++)
+		for (j = 1; j < BTREE_MAX_DEPTH; j++)
+			bc->lock_mode[i][j].pcpu_readers = true;
+
 	ret = rhashtable_init(&bc->table, &bch_btree_cache_params);
 	if (ret)
 		goto out;
@@ -538,6 +791,7 @@ void bch2_fs_btree_cache_init_early(struct btree_cache *bc)
 	INIT_LIST_HEAD(&bc->freeable);
 	INIT_LIST_HEAD(&bc->freed_pcpu);
 	INIT_LIST_HEAD(&bc->freed_nonpcpu);
+	INIT_WORK(&bc->lock_mode_work, bch2_btree_lock_mode_work);
 }
 
 /*
@@ -612,6 +866,23 @@ static struct btree *btree_node_cannibalize(struct bch_fs *c)
 	}
 }
 
+/*
+ * Whether a newly allocated interior node - read in, or new from a split,
+ * merge or rewrite - should get percpu reader counts:
+ */
+bool bch2_btree_node_want_pcpu_readers(struct bch_fs *c, enum btree_id id,
+				       unsigned level)
+{
+	if (!level)
+		return false;
+
+	if (id >= BTREE_ID_NR || level >= BTREE_MAX_DEPTH ||
+	    !c->opts.btree_adaptive_pcpu_readers)
+		return true;
+
+	return READ_ONCE(c->btree_cache.lock_mode[id][level].pcpu_readers);
+}
+
 struct btree *bch2_btree_node_mem_alloc(struct btree_trans *trans, bool pcpu_read_locks)
 {
 	struct bch_fs *c = trans->c;
@@ -700,6 +971,7 @@ err:
 	/* Try to cannibalize another cached btree node: */
 	if (bc->alloc_lock == current) {
 		b2 = btree_node_cannibalize(c);
+		btree_cache_ghost_add(bc, b2);
 		bch2_btree_node_hash_remove(bc, b2);
 
 		if (b) {
@@ -748,7 +1020,8 @@ static noinline struct btree *bch2_btree_node_fill(struct btree_trans *trans,
 		return ERR_PTR(btree_trans_restart(trans, BCH_ERR_transaction_restart_fill_relock));
 	}
 
-	b = bch2_btree_node_mem_alloc(trans, level != 0);
+	b = bch2_btree_node_mem_alloc(trans,
+			bch2_btree_node_want_pcpu_readers(c, btree_id, level));
 
 	if (bch2_err_matches(PTR_ERR_OR_ZERO(b), ENOMEM)) {
 		trans->memory_allocation_failure = true;
@@ -855,6 +1128,7 @@ static inline void btree_check_header(struct bch_fs *c, struct btree *b)
 static struct btree *__bch2_btree_node_get(struct btree_trans *trans, struct btree_path *path,
 					   const struct bkey_i *k, unsigned level,
 					   enum six_lock_type lock_type,
+					   bool streaming,
 					   unsigned long trace_ip)
 {
 	struct bch_fs *c = trans->c;
@@ -881,6 +1155,8 @@ retry:
 
 		if (IS_ERR(b))
 			return b;
+
+		btree_cache_miss(c, b, streaming);
 	} else {
 		if (btree_node_read_locked(path, level + 1))
 			btree_node_unlock(trans, path, level + 1);
@@ -902,9 +1178,7 @@ retry:
 			return ERR_PTR(btree_trans_restart(trans, BCH_ERR_transaction_restart_lock_node_reused));
 		}
 
-		/* avoid atomic set bit if it's not needed: */
-		if (!btree_node_accessed(b))
-			set_btree_node_accessed(b);
+		bch2_btree_cache_hit(c, b, streaming);
 	}
 
 	if (unlikely(btree_node_read_in_flight(b))) {
@@ -960,10 +1234,14 @@ retry:
  *
  * The btree node will have either a read or a write lock held, depending on
  * the @write parameter.
+ *
+ * @streaming indicates the caller is doing a large sequential scan, and this
+ * access shouldn't cause the node to be promoted in the btree node cache.
  */
 struct btree *bch2_btree_node_get(struct btree_trans *trans, struct btree_path *path,
 				  const struct bkey_i *k, unsigned level,
 				  enum six_lock_type lock_type,
+				  bool streaming,
 				  unsigned long trace_ip)
 {
 	struct bch_fs *c = trans->c;
@@ -983,7 +1261,7 @@ struct btree *bch2_btree_node_get(struct btree_trans *trans, struct btree_path *
 	if (unlikely(!c->opts.btree_node_mem_ptr_optimization ||
 		     !b ||
 		     b->hash_val != btree_ptr_hash_val(k)))
-		return __bch2_btree_node_get(trans, path, k, level, lock_type, trace_ip);
+		return __bch2_btree_node_get(trans, path, k, level, lock_type, streaming, trace_ip);
 
 	if (btree_node_read_locked(path, level + 1))
 		btree_node_unlock(trans, path, level + 1);
@@ -999,7 +1277,7 @@ struct btree *bch2_btree_node_get(struct btree_trans *trans, struct btree_path *
 		     race_fault())) {
 		six_unlock_type(&b->c.lock, lock_type);
 		if (bch2_btree_node_relock(trans, path, level + 1))
-			return __bch2_btree_node_get(trans, path, k, level, lock_type, trace_ip);
+			return __bch2_btree_node_get(trans, path, k, level, lock_type, streaming, trace_ip);
 
 		trace_and_count(c, trans_restart_btree_node_reused, trans, trace_ip, path);
 		return ERR_PTR(btree_trans_restart(trans, BCH_ERR_transaction_restart_lock_node_reused));
@@ -1027,7 +1305,7 @@ struct btree *bch2_btree_node_get(struct btree_trans *trans, struct btree_path *
 		}
 
 		if (!six_relock_type(&b->c.lock, lock_type, seq))
-			return __bch2_btree_node_get(trans, path, k, level, lock_type, trace_ip);
+			return __bch2_btree_node_get(trans, path, k, level, lock_type, streaming, trace_ip);
 	}
 
 	prefetch(b->aux_data);
@@ -1040,9 +1318,7 @@ struct btree *bch2_btree_node_get(struct btree_trans *trans, struct btree_path *
 		prefetch(p + L1_CACHE_BYTES * 2);
 	}
 
-	/* avoid atomic set bit if it's not needed: */
-	if (!btree_node_accessed(b))
-		set_btree_node_accessed(b);
+	bch2_btree_cache_hit(c, b, streaming);
 
 	if (unlikely(btree_node_read_error(b))) {
 		six_unlock_type(&b->c.lock, lock_type);
@@ -1123,9 +1399,7 @@ lock_node:
 		prefetch(p + L1_CACHE_BYTES * 2);
 	}
 
-	/* avoid atomic set bit if it's not needed: */
-	if (!btree_node_accessed(b))
-		set_btree_node_accessed(b);
+	bch2_btree_cache_hit(c, b, false);
 
 	if (unlikely(btree_node_read_error(b))) {
 		six_unlock_read(&b->c.lock);
@@ -1249,7 +1523,10 @@ void bch2_btree_node_to_text(struct printbuf *out, struct bch_fs *c,
 
 void bch2_btree_cache_to_text(struct printbuf *out, const struct btree_cache *bc)
 {
+	unsigned i, l;
+
 	prt_printf(out, "nr nodes:\t\t%u\n", bc->used);
+	prt_printf(out, "nr hot:\t\t\t%u\n", atomic_read(&bc->nr_hot));
 	prt_printf(out, "nr dirty:\t\t%u\n", atomic_read(&bc->dirty));
 	prt_printf(out, "cannibalize lock:\t%p\n", bc->alloc_lock);
 
@@ -1260,8 +1537,14 @@ void bch2_btree_cache_to_text(struct printbuf *out, const struct btree_cache *bc
 	prt_printf(out, "not freed, lock intent failed:\t%u\n", bc->not_freed_lock_intent);
 	prt_printf(out, "not freed, lock write failed:\t%u\n", bc->not_freed_lock_write);
 	prt_printf(out, "not freed, access bit:\t\t%u\n", bc->not_freed_access_bit);
+	prt_printf(out, "not freed, hot:\t\t%u\n", bc->not_freed_hot);
 	prt_printf(out, "not freed, no evict failed:\t%u\n", bc->not_freed_noevict);
 	prt_printf(out, "not freed, write blocked:\t%u\n", bc->not_freed_write_blocked);
 	prt_printf(out, "not freed, will make reachable:\t%u\n", bc->not_freed_will_make_reachable);
 
+	prt_printf(out, "\ninterior nodes with atomic reader counts:\n");
+	for (i = 0; i < BTREE_ID_NR; i++)
+		for (l = 1; l < BTREE_MAX_DEPTH; l++)
+			if (!READ_ONCE(bc->lock_mode[i][l].pcpu_readers))
+				prt_printf(out, "%s level %u\n", bch2_btree_ids[i], l);
 }
@@ -21,11 +21,12 @@ void bch2_btree_cache_cannibalize_unlock(struct bch_fs *);
 int bch2_btree_cache_cannibalize_lock(struct bch_fs *, struct closure *);
 
 struct btree *__bch2_btree_node_mem_alloc(struct bch_fs *);
+bool bch2_btree_node_want_pcpu_readers(struct bch_fs *, enum btree_id, unsigned);
 struct btree *bch2_btree_node_mem_alloc(struct btree_trans *, bool);
 
 struct btree *bch2_btree_node_get(struct btree_trans *, struct btree_path *,
 				  const struct bkey_i *, unsigned,
-				  enum six_lock_type, unsigned long);
+				  enum six_lock_type, bool, unsigned long);
 
 struct btree *bch2_btree_node_get_noiter(struct btree_trans *, const struct bkey_i *,
 					 enum btree_id, unsigned, bool);
@@ -58,6 +59,29 @@ static inline struct btree *btree_node_mem_ptr(const struct bkey_i *k)
 		: NULL;
 }
 
+/*
+ * Called on every cache hit: streaming accesses don't set the accessed bit, so
+ * that nodes only seen by a large sequential scan aren't promoted and are the
+ * first to be evicted:
+ */
+static inline void bch2_btree_cache_hit(struct bch_fs *c, struct btree *b,
+					bool streaming)
+{
+	if (streaming) {
+		this_cpu_inc(c->counters[BCH_COUNTER_btree_cache_hit_streaming]);
+		return;
+	}
+
+	if (btree_node_hot(b))
+		this_cpu_inc(c->counters[BCH_COUNTER_btree_cache_hit_hot]);
+	else
+		this_cpu_inc(c->counters[BCH_COUNTER_btree_cache_hit_cold]);
+
+	/* avoid atomic set bit if it's not needed: */
+	if (!btree_node_accessed(b))
+		set_btree_node_accessed(b);
+}
+
 /* is btree node in hash table? */
 static inline bool btree_node_hashed(struct btree *b)
 {
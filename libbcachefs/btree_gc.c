@@ -2002,7 +2002,9 @@ int bch2_gc_gens(struct bch_fs *c)
 			c->gc_gens_pos = POS_MIN;
 			ret = for_each_btree_key_commit(&trans, iter, i,
 					POS_MIN,
-					BTREE_ITER_PREFETCH|BTREE_ITER_ALL_SNAPSHOTS,
+					BTREE_ITER_PREFETCH|
+					BTREE_ITER_STREAMING|
+					BTREE_ITER_ALL_SNAPSHOTS,
 					k,
 					NULL, NULL,
 					BTREE_INSERT_NOFAIL,
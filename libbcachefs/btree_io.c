@@ -11,6 +11,7 @@
 #include "btree_update_interior.h"
 #include "buckets.h"
 #include "checksum.h"
+#include "compress.h"
 #include "debug.h"
 #include "error.h"
 #include "extents.h"
@@ -105,6 +106,35 @@ static void btree_bounce_free(struct bch_fs *c, size_t size,
 		vpfree(p, size);
 }
 
+/*
+ * For buffers that were a btree node's data until we swapped them out: lockless
+ * lookups may still be reading them, see btree_node_data_free():
+ */
+struct btree_bounce_rcu {
+	struct rcu_head		rcu;
+	struct bch_fs		*c;
+	size_t			size;
+	bool			used_mempool;
+};
+
+static void btree_bounce_free_rcu_cb(struct rcu_head *rcu)
+{
+	struct btree_bounce_rcu *p = container_of(rcu, struct btree_bounce_rcu, rcu);
+
+	btree_bounce_free(p->c, p->size, p->used_mempool, p);
+}
+
+static void btree_bounce_free_rcu(struct bch_fs *c, size_t size,
+				  bool used_mempool, void *_p)
+{
+	struct btree_bounce_rcu *p = _p;
+
+	p->c		= c;
+	p->size		= size;
+	p->used_mempool	= used_mempool;
+	call_rcu(&p->rcu, btree_bounce_free_rcu_cb);
+}
+
 static void *_btree_bounce_alloc(struct bch_fs *c, size_t size,
 				 bool *used_mempool)
 {
@@ -374,7 +404,10 @@ static void btree_node_sort(struct bch_fs *c, struct btree *b,
 	set_btree_bset_end(b, &b->set[start_idx]);
 	bch2_bset_set_no_aux_tree(b, &b->set[start_idx]);
 
-	btree_bounce_free(c, bytes, used_mempool, out);
+	if (sorting_entire_node)
+		btree_bounce_free_rcu(c, bytes, used_mempool, out);
+	else
+		btree_bounce_free(c, bytes, used_mempool, out);
 
 	bch2_verify_btree_nr_keys(b);
 }
@@ -829,8 +862,22 @@ static int bset_key_invalid(struct bch_fs *c, struct btree *b,
 		(rw == WRITE ? bch2_bkey_val_invalid(c, k, READ, err) : 0);
 }
 
+/*
+ * A bset that passed its checksum and was written by the current version had
+ * all its keys validated before it was written: with btree_node_lazy_validate
+ * we skip key validation on read, and leave it for bch2_btree_scrub().
+ */
+static bool bset_keys_trusted(struct bch_fs *c, struct bset *i, bool csum_good)
+{
+	return c->opts.btree_node_lazy_validate &&
+		BSET_CSUM_TYPE(i) != BCH_CSUM_none &&
+		csum_good &&
+		le16_to_cpu(i->version) >= bcachefs_metadata_version_current &&
+		!bch2_inject_invalid_keys;
+}
+
 static int validate_bset_keys(struct bch_fs *c, struct btree *b,
-			 struct bset *i, int write,
+			 struct bset *i, int write, bool csum_good,
 			 bool have_retry, bool *saw_error)
 {
 	unsigned version = le16_to_cpu(i->version);
@@ -838,8 +885,12 @@ static int validate_bset_keys(struct bch_fs *c, struct btree *b,
 	struct printbuf buf = PRINTBUF;
 	bool updated_range = b->key.k.type == KEY_TYPE_btree_ptr_v2 &&
 		BTREE_PTR_RANGE_UPDATED(&bkey_i_to_btree_ptr_v2(&b->key)->v);
+	bool trusted = write == READ && bset_keys_trusted(c, i, csum_good);
 	int ret = 0;
 
+	if (trusted)
+		set_btree_node_keys_unverified(b);
+
 	for (k = i->start;
 	     k != vstruct_last(i);) {
 		struct bkey_s u;
@@ -870,7 +921,8 @@ static int validate_bset_keys(struct bch_fs *c, struct btree *b,
 		u = __bkey_disassemble(b, k, &tmp);
 
 		printbuf_reset(&buf);
-		if (bset_key_invalid(c, b, u.s_c, updated_range, write, &buf)) {
+		if (!trusted &&
+		    bset_key_invalid(c, b, u.s_c, updated_range, write, &buf)) {
 			printbuf_reset(&buf);
 			prt_printf(&buf, "invalid bkey:  ");
 			bset_key_invalid(c, b, u.s_c, updated_range, write, &buf);
@@ -917,6 +969,61 @@ fsck_err:
 	return ret;
 }
 
+/*
+ * Decompress a bset in place, back into the space it occupies within the node -
+ * must be done after checksum verification and decryption:
+ */
+static int btree_node_bset_uncompress(struct bch_fs *c, struct bch_dev *ca,
+				      struct btree *b, struct bset *i,
+				      void *entry, bool have_retry,
+				      bool *saw_error)
+{
+	struct bset_compressed *cb = (void *) i->_data;
+	size_t u64s, src_bytes, bytes;
+	bool used_mempool;
+	void *buf;
+	int ret, write = READ;
+
+	if (!BSET_COMPRESSION_TYPE(i))
+		return 0;
+
+	u64s		= le32_to_cpu(cb->u64s);
+	src_bytes	= le32_to_cpu(cb->bytes);
+	bytes		= (void *) i->_data - entry +
+		u64s * sizeof(u64);
+
+	if (btree_err_on(BSET_COMPRESSION_TYPE(i) >= BCH_COMPRESSION_TYPE_NR ||
+			 BSET_COMPRESSION_TYPE(i) == BCH_COMPRESSION_TYPE_incompressible ||
+			 vstruct_bytes(i) - sizeof(*i) < sizeof(*cb) ||
+			 src_bytes > vstruct_bytes(i) - sizeof(*i) - sizeof(*cb) ||
+			 u64s > U16_MAX ||
+			 entry - (void *) b->data + bytes > btree_bytes(c),
+			 BTREE_ERR_WANT_RETRY, c, ca, b, i,
+			 "bad compressed bset header"))
+		goto fsck_err;
+
+	buf = btree_bounce_alloc(c, btree_bytes(c), &used_mempool);
+
+	ret = bch2_uncompress_buf(c, buf, u64s * sizeof(u64),
+				  cb->data, src_bytes, BSET_COMPRESSION_TYPE(i));
+	if (!ret) {
+		memcpy(i->_data, buf, u64s * sizeof(u64));
+		i->u64s = cpu_to_le16(u64s);
+		SET_BSET_COMPRESSION_TYPE(i, 0);
+	}
+
+	btree_bounce_free(c, btree_bytes(c), used_mempool, buf);
+
+	if (!ret)
+		return 0;
+
+	btree_err(BTREE_ERR_WANT_RETRY, c, ca, b, i,
+		  "error decompressing bset: %s", bch2_err_str(ret));
+fsck_err:
+	/* can't be fixed by dropping keys, never continue with this bset: */
+	return have_retry ? BTREE_RETRY_READ : -EIO;
+}
+
 int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
 			      struct btree *b, bool have_retry, bool *saw_error)
 {
@@ -926,7 +1033,7 @@ int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
 	struct bkey_packed *k;
 	struct bch_extent_ptr *ptr;
 	struct bset *i;
-	bool used_mempool, blacklisted;
+	bool used_mempool, blacklisted, all_trusted = true;
 	bool updated_range = b->key.k.type == KEY_TYPE_btree_ptr_v2 &&
 		BTREE_PTR_RANGE_UPDATED(&bkey_i_to_btree_ptr_v2(&b->key)->v);
 	unsigned u64s;
@@ -938,6 +1045,7 @@ int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
 	b->version_ondisk = U16_MAX;
 	/* We might get called multiple times on read retry: */
 	b->written = 0;
+	clear_btree_node_keys_unverified(b);
 
 	iter = mempool_alloc(&c->fill_iter, GFP_NOIO);
 	sort_iter_init(iter, b);
@@ -971,6 +1079,7 @@ int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
 		struct nonce nonce;
 		struct bch_csum csum;
 		bool first = !b->written;
+		bool csum_good;
 
 		if (!b->written) {
 			i = &b->data->keys;
@@ -982,8 +1091,9 @@ int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
 
 			nonce = btree_nonce(i, b->written << 9);
 			csum = csum_vstruct(c, BSET_CSUM_TYPE(i), nonce, b->data);
+			csum_good = !bch2_crc_cmp(csum, b->data->csum);
 
-			btree_err_on(bch2_crc_cmp(csum, b->data->csum),
+			btree_err_on(!csum_good,
 				     BTREE_ERR_WANT_RETRY, c, ca, b, i,
 				     "invalid checksum");
 
@@ -997,6 +1107,11 @@ int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
 				     BTREE_ERR_INCOMPATIBLE, c, NULL, b, NULL,
 				     "btree node does not have NEW_EXTENT_OVERWRITE set");
 
+			ret = btree_node_bset_uncompress(c, ca, b, i, b->data,
+							 have_retry, saw_error);
+			if (ret)
+				goto fsck_err;
+
 			sectors = vstruct_sectors(b->data, c->block_bits);
 		} else {
 			bne = write_block(b);
@@ -1012,8 +1127,9 @@ int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
 
 			nonce = btree_nonce(i, b->written << 9);
 			csum = csum_vstruct(c, BSET_CSUM_TYPE(i), nonce, bne);
+			csum_good = !bch2_crc_cmp(csum, bne->csum);
 
-			btree_err_on(bch2_crc_cmp(csum, bne->csum),
+			btree_err_on(!csum_good,
 				     BTREE_ERR_WANT_RETRY, c, ca, b, i,
 				     "invalid checksum");
 
@@ -1022,6 +1138,11 @@ int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
 					"error decrypting btree node: %i\n", ret))
 				goto fsck_err;
 
+			ret = btree_node_bset_uncompress(c, ca, b, i, bne,
+							 have_retry, saw_error);
+			if (ret)
+				goto fsck_err;
+
 			sectors = vstruct_sectors(bne, c->block_bits);
 		}
 
@@ -1036,10 +1157,13 @@ int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
 		if (!b->written)
 			btree_node_set_format(b, b->data->format);
 
-		ret = validate_bset_keys(c, b, i, READ, have_retry, saw_error);
+		ret = validate_bset_keys(c, b, i, READ, csum_good,
+					 have_retry, saw_error);
 		if (ret)
 			goto fsck_err;
 
+		all_trusted &= bset_keys_trusted(c, i, csum_good);
+
 		SET_BSET_BIG_ENDIAN(i, CPU_BIG_ENDIAN);
 
 		blacklisted = bch2_journal_seq_is_blacklisted(c,
@@ -1114,7 +1238,7 @@ int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
 
 	BUG_ON(b->nr.live_u64s != u64s);
 
-	btree_bounce_free(c, btree_bytes(c), used_mempool, sorted);
+	btree_bounce_free_rcu(c, btree_bytes(c), used_mempool, sorted);
 
 	if (updated_range)
 		bch2_btree_node_drop_keys_outside_node(b);
@@ -1126,7 +1250,8 @@ int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
 
 		printbuf_reset(&buf);
 
-		if (bch2_bkey_val_invalid(c, u.s_c, READ, &buf) ||
+		if ((!all_trusted &&
+		     bch2_bkey_val_invalid(c, u.s_c, READ, &buf)) ||
 		    (bch2_inject_invalid_keys &&
 		     !bversion_cmp(u.k->version, MAX_VERSION))) {
 			printbuf_reset(&buf);
@@ -1183,6 +1308,96 @@ fsck_err:
 	goto out;
 }
 
+/*
+ * Full key validation of a node that was read with btree_node_lazy_validate:
+ * caller must hold at least a read lock.
+ *
+ * Invalid keys can't be dropped from a node that's already in use, so they're
+ * reported as an inconsistency for fsck to repair.
+ */
+static unsigned btree_node_validate_keys(struct bch_fs *c, struct btree *b)
+{
+	struct btree_node_iter iter;
+	struct bkey unpacked;
+	struct bkey_s_c k;
+	struct printbuf buf = PRINTBUF;
+	bool updated_range = b->key.k.type == KEY_TYPE_btree_ptr_v2 &&
+		BTREE_PTR_RANGE_UPDATED(&bkey_i_to_btree_ptr_v2(&b->key)->v);
+	unsigned nr_invalid = 0;
+
+	for_each_btree_node_key_unpack(b, k, &iter, &unpacked) {
+		printbuf_reset(&buf);
+
+		if (bch2_bkey_invalid(c, k, btree_node_type(b), READ, &buf) ?:
+		    (!updated_range ? bch2_bkey_in_btree_node(b, k, &buf) : 0)) {
+			prt_printf(&buf, "\n  ");
+			bch2_bkey_val_to_text(&buf, c, k);
+			bch2_fs_inconsistent(c, "scrub: invalid bkey in btree %s level %u: %s",
+					     bch2_btree_ids[b->c.btree_id], b->c.level, buf.buf);
+			nr_invalid++;
+		}
+	}
+
+	clear_btree_node_keys_unverified(b);
+	printbuf_exit(&buf);
+	return nr_invalid;
+}
+
+static int btree_scrub_level(struct btree_trans *trans, enum btree_id btree_id,
+			     unsigned level, u64 *nr_nodes, u64 *nr_invalid)
+{
+	struct btree_iter iter;
+	struct btree *b;
+	int ret;
+
+	__for_each_btree_node(trans, iter, btree_id, POS_MIN,
+			      0, level, BTREE_ITER_PREFETCH, b, ret) {
+		if (b->c.level != level)
+			break;
+
+		if (btree_node_keys_unverified(b)) {
+			*nr_invalid += btree_node_validate_keys(trans->c, b);
+			(*nr_nodes)++;
+		}
+	}
+	bch2_trans_iter_exit(trans, &iter);
+
+	return ret;
+}
+
+/*
+ * Walk every btree node, doing the key validation that was skipped when nodes
+ * were read with btree_node_lazy_validate:
+ */
+int bch2_btree_scrub(struct bch_fs *c)
+{
+	struct btree_trans trans;
+	enum btree_id btree_id;
+	unsigned level;
+	u64 nr_nodes = 0, nr_invalid = 0;
+	int ret = 0;
+
+	bch2_trans_init(&trans, c, 0, 0);
+
+	for (btree_id = 0; btree_id < BTREE_ID_NR && !ret; btree_id++)
+		for (level = 0; level < BTREE_MAX_DEPTH && !ret; level++) {
+			do {
+				bch2_trans_begin(&trans);
+				ret = btree_scrub_level(&trans, btree_id, level,
+							&nr_nodes, &nr_invalid);
+			} while (bch2_err_matches(ret, BCH_ERR_transaction_restart));
+		}
+
+	bch2_trans_exit(&trans);
+
+	if (ret)
+		bch_err(c, "%s: error %s", __func__, bch2_err_str(ret));
+	else
+		bch_info(c, "scrub: validated %llu btree nodes, %llu invalid keys",
+			 nr_nodes, nr_invalid);
+	return ret;
+}
+
 static void btree_node_read_work(struct work_struct *work)
 {
 	struct btree_read_bio *rb =
@@ -1299,18 +1514,48 @@ static unsigned btree_node_sectors_written(struct bch_fs *c, void *data)
 
 	while (offset < btree_sectors(c)) {
 		if (!offset) {
-			offset += vstruct_sectors(bn, c->block_bits);
+			offset += bset_sectors(c, bn, &bn->keys);
 		} else {
 			bne = data + (offset << 9);
 			if (bne->keys.seq != bn->keys.seq)
 				break;
-			offset += vstruct_sectors(bne, c->block_bits);
+			offset += bset_sectors(c, bne, &bne->keys);
 		}
 	}
 
 	return offset;
 }
 
+/*
+ * The tail of the space a compressed bset occupies is never written, and may
+ * differ between replicas - zero it before comparing them:
+ */
+static void btree_node_zero_unwritten(struct bch_fs *c, void *data,
+				      unsigned written)
+{
+	struct btree_node *bn = data;
+	unsigned offset = 0;
+
+	while (offset < written) {
+		void *entry = data + (offset << 9);
+		struct bset *i = offset
+			? &((struct btree_node_entry *) entry)->keys
+			: &bn->keys;
+		unsigned sectors = bset_sectors(c, entry, i);
+
+		if (BSET_COMPRESSION_TYPE(i)) {
+			void *end = entry + round_up((void *) vstruct_end(i) - entry,
+						     block_bytes(c));
+			void *alloc_end = entry + (min(sectors, written - offset) << 9);
+
+			if (end < alloc_end)
+				memset(end, 0, alloc_end - end);
+		}
+
+		offset += sectors;
+	}
+}
+
 static bool btree_node_has_extra_bsets(struct bch_fs *c, unsigned offset, void *data)
 {
 	struct btree_node *bn = data;
@@ -1358,10 +1603,12 @@ static void btree_node_read_all_replicas_done(struct closure *cl)
 		if (best < 0) {
 			best = i;
 			written = btree_node_sectors_written(c, bn);
+			btree_node_zero_unwritten(c, bn, written);
 			continue;
 		}
 
 		written2 = btree_node_sectors_written(c, ra->buf[i]);
+		btree_node_zero_unwritten(c, ra->buf[i], written2);
 		if (btree_err_on(written2 != written, BTREE_ERR_FIXABLE, c, NULL, b, NULL,
 				 "btree node sectors written mismatch: %u != %u",
 				 written, written2) ||
@@ -1393,12 +1640,12 @@ fsck_err:
 
 			while (offset < btree_sectors(c)) {
 				if (!offset) {
-					sectors = vstruct_sectors(bn, c->block_bits);
+					sectors = bset_sectors(c, bn, &bn->keys);
 				} else {
 					bne = ra->buf[i] + (offset << 9);
 					if (bne->keys.seq != bn->keys.seq)
 						break;
-					sectors = vstruct_sectors(bne, c->block_bits);
+					sectors = bset_sectors(c, bne, &bne->keys);
 				}
 
 				prt_printf(&buf, " %u-%u", offset, offset + sectors);
@@ -1415,7 +1662,7 @@ fsck_err:
 						prt_printf(&buf, " GAP");
 					gap = true;
 
-					sectors = vstruct_sectors(bne, c->block_bits);
+					sectors = bset_sectors(c, bne, &bne->keys);
 					prt_printf(&buf, " %u-%u", offset, offset + sectors);
 					if (bch2_journal_seq_is_blacklisted(c,
 							le64_to_cpu(bne->keys.journal_seq), false))
@@ -1633,7 +1880,8 @@ static int __bch2_btree_root_read(struct btree_trans *trans, enum btree_id id,
 		closure_sync(&cl);
 	} while (ret);
 
-	b = bch2_btree_node_mem_alloc(trans, level != 0);
+	b = bch2_btree_node_mem_alloc(trans,
+			bch2_btree_node_want_pcpu_readers(c, id, level));
 	bch2_btree_cache_cannibalize_unlock(c);
 
 	BUG_ON(IS_ERR(b));
@@ -1783,6 +2031,136 @@ err:
 	goto out;
 }
 
+/*
+ * Btree node write scheduling:
+ *
+ * Btree node writes are issued as nodes are written out by journal reclaim,
+ * cache reclaim and interior updates - which, to the device, is random order.
+ * On rotational devices we cap the number of btree writes in flight, and queue
+ * the rest in a heap ordered by (sweep, priority, offset): a one way elevator,
+ * where writes behind the current position wait for the next sweep.
+ *
+ * Within a sweep, writes that journal reclaim and btree updates are waiting on
+ * are issued before writes done to free up memory - but new writes only ever
+ * join the current or next sweep, so background writes wait at most one sweep
+ * and the shrinker can't be starved.
+ *
+ * Queued writes aren't merged: writes to different nodes are only contiguous
+ * when the first node is written up to its very end, and there's never more
+ * than one write to the same node in flight.
+ */
+
+#define BTREE_WRITE_QUEUE_DEPTH_ROTATIONAL	8
+#define BTREE_WRITE_QUEUE_SIZE			512
+
+static unsigned btree_write_queue_depth(struct bch_fs *c, struct bch_dev *ca)
+{
+	unsigned depth = READ_ONCE(c->opts.btree_write_queue_depth);
+
+	if (depth)
+		return depth;
+
+	return blk_queue_nonrot(bdev_get_queue(ca->disk_sb.bdev))
+		? UINT_MAX
+		: BTREE_WRITE_QUEUE_DEPTH_ROTATIONAL;
+}
+
+static inline int btree_write_queue_cmp(void *h,
+					struct btree_write_queue_entry l,
+					struct btree_write_queue_entry r)
+{
+	return  cmp_int(l.sweep,	r.sweep) ?:
+		cmp_int(l.background,	r.background) ?:
+		cmp_int(l.sector,	r.sector);
+}
+
+static void btree_write_queue_work(struct work_struct *work)
+{
+	struct bch_dev *ca = container_of(work, struct bch_dev,
+					  btree_write_queue.work);
+	struct btree_write_queue *q = &ca->btree_write_queue;
+	unsigned depth = btree_write_queue_depth(ca->fs, ca);
+	struct btree_write_queue_entry e;
+
+	while (1) {
+		spin_lock_irq(&q->lock);
+		if (q->in_flight >= depth ||
+		    !heap_pop(&q->heap, e, btree_write_queue_cmp, NULL)) {
+			spin_unlock_irq(&q->lock);
+			break;
+		}
+
+		q->in_flight++;
+		q->sweep	= e.sweep;
+		q->pos		= e.sector;
+		spin_unlock_irq(&q->lock);
+
+		submit_bio(&e.wbio->bio);
+	}
+}
+
+/*
+ * Called by bch2_submit_wbio_replicas() for each device a btree node write
+ * goes to, instead of submit_bio():
+ */
+void bch2_btree_write_queue_submit(struct bch_dev *ca, struct bch_write_bio *wbio)
+{
+	struct btree_write_queue *q = &ca->btree_write_queue;
+	unsigned depth = btree_write_queue_depth(ca->fs, ca);
+	u64 sector = wbio->bio.bi_iter.bi_sector;
+
+	spin_lock_irq(&q->lock);
+	if (q->in_flight < depth || heap_full(&q->heap)) {
+		q->in_flight++;
+		spin_unlock_irq(&q->lock);
+
+		submit_bio(&wbio->bio);
+		return;
+	}
+
+	BUG_ON(!heap_add(&q->heap, ((struct btree_write_queue_entry) {
+		.wbio		= wbio,
+		.background	= !(wbio->bio.bi_opf & REQ_PRIO),
+		.sweep		= q->sweep + (sector < q->pos),
+		.sector		= sector,
+	}), btree_write_queue_cmp, NULL));
+	spin_unlock_irq(&q->lock);
+}
+
+static void btree_write_queue_done(struct bch_dev *ca)
+{
+	struct btree_write_queue *q = &ca->btree_write_queue;
+	unsigned long flags;
+
+	spin_lock_irqsave(&q->lock, flags);
+	q->in_flight--;
+	if (q->heap.used)
+		queue_work(ca->fs->io_complete_wq, &q->work);
+	spin_unlock_irqrestore(&q->lock, flags);
+}
+
+void bch2_dev_btree_write_queue_exit(struct bch_dev *ca)
+{
+	struct btree_write_queue *q = &ca->btree_write_queue;
+
+	if (!q->heap.data)
+		return;
+
+	cancel_work_sync(&q->work);
+	free_heap(&q->heap);
+}
+
+int bch2_dev_btree_write_queue_init(struct bch_dev *ca)
+{
+	struct btree_write_queue *q = &ca->btree_write_queue;
+
+	spin_lock_init(&q->lock);
+	INIT_WORK(&q->work, btree_write_queue_work);
+
+	return init_heap(&q->heap, BTREE_WRITE_QUEUE_SIZE, GFP_KERNEL)
+		? 0 : -BCH_ERR_ENOMEM_btree_write_queue_init;
+}
+
 static void btree_node_write_endio(struct bio *bio)
 {
 	struct bch_write_bio *wbio	= to_wbio(bio);
@@ -1794,8 +2172,10 @@ static void btree_node_write_endio(struct bio *bio)
 	struct bch_dev *ca		= bch_dev_bkey_exists(c, wbio->dev);
 	unsigned long flags;
 
-	if (wbio->have_ioref)
+	if (wbio->have_ioref) {
 		bch2_latency_acct(ca, wbio->submit_time, WRITE);
+		btree_write_queue_done(ca);
+	}
 
 	if (bch2_dev_io_err_on(bio->bi_status, ca, "btree write error: %s",
 			       bch2_blk_status_to_str(bio->bi_status)) ||
@@ -1836,7 +2216,7 @@ static int validate_bset_for_write(struct bch_fs *c, struct btree *b,
 	if (ret)
 		return ret;
 
-	ret = validate_bset_keys(c, b, i, WRITE, false, &saw_error) ?:
+	ret = validate_bset_keys(c, b, i, WRITE, false, false, &saw_error) ?:
 		validate_bset(c, NULL, b, i, b->written, sectors, WRITE, false, &saw_error);
 	if (ret) {
 		bch2_inconsistent_error(c);
@@ -1861,6 +2241,56 @@ static void btree_write_submit(struct work_struct *work)
 				  &tmp.k, false);
 }
 
+/*
+ * Compress the keys in @i in place, if that saves at least one block on disk -
+ * returns the number of sectors that actually have to be written. Must be done
+ * after validation and before checksumming:
+ */
+static unsigned btree_node_write_compress(struct bch_fs *c, void *data,
+					  struct bset *i, unsigned sectors,
+					  unsigned compression_type)
+{
+	struct bset_compressed *cb = (void *) i->_data;
+	size_t src_len = le16_to_cpu(i->u64s) * sizeof(u64);
+	ssize_t dst_len = (ssize_t) ((sectors << 9) - block_bytes(c)) -
+		((void *) cb->data - data);
+	size_t bytes;
+	void *buf;
+
+	if (!compression_type ||
+	    dst_len <= 0)
+		return sectors;
+
+	dst_len = round_down(dst_len, sizeof(u64));
+
+	/* can't use btree_bounce_pool, we may already be holding it: */
+	buf = kvpmalloc(dst_len, GFP_NOIO|__GFP_NOWARN);
+	if (!buf)
+		return sectors;
+
+	bytes = bch2_compress_buf(c, buf, dst_len, i->_data, src_len,
+				  compression_type);
+	if (bytes) {
+		cb->u64s	= cpu_to_le32(le16_to_cpu(i->u64s));
+		cb->bytes	= cpu_to_le32(bytes);
+		memcpy(cb->data, buf, bytes);
+
+		i->u64s		= cpu_to_le16((sizeof(*cb) + round_up(bytes, sizeof(u64))) /
+					      sizeof(u64));
+		SET_BSET_COMPRESSION_TYPE(i, compression_type);
+
+		sectors = round_up((void *) vstruct_end(i) - data,
+				   block_bytes(c)) >> 9;
+		memset(cb->data + bytes, 0,
+		       data + (sectors << 9) - (void *) (cb->data + bytes));
+
+		this_cpu_inc(c->counters[BCH_COUNTER_btree_node_compress]);
+	}
+
+	kvpfree(buf, dst_len);
+	return sectors;
+}
+
 void __bch2_btree_node_write(struct bch_fs *c, struct btree *b, unsigned flags)
 {
 	struct btree_write_bio *wbio;
@@ -1870,7 +2300,8 @@ void __bch2_btree_node_write(struct bch_fs *c, struct btree *b, unsigned flags)
 	struct btree_node_entry *bne = NULL;
 	struct sort_iter sort_iter;
 	struct nonce nonce;
-	unsigned bytes_to_write, sectors_to_write, bytes, u64s;
+	unsigned bytes_to_write, sectors_to_write, disk_sectors, bytes, u64s;
+	unsigned compression_type;
 	u64 seq = 0;
 	bool used_mempool;
 	unsigned long old, new;
@@ -2030,11 +2461,26 @@ do_write:
 	if (le16_to_cpu(i->version) < bcachefs_metadata_version_current)
 		validate_before_checksum = true;
 
+	/*
+	 * The compressed size has to be readable without decrypting, see
+	 * bset_sectors():
+	 */
+	compression_type = !bch2_csum_type_is_encryption(BSET_CSUM_TYPE(i))
+		? bch2_compression_opt_to_type[READ_ONCE(c->opts.btree_node_compression)]
+		: 0;
+
+	/* keys can't be validated once compressed: */
+	if (compression_type)
+		validate_before_checksum = true;
+
 	/* if we're going to be encrypting, check metadata validity first: */
 	if (validate_before_checksum &&
 	    validate_bset_for_write(c, b, i, sectors_to_write))
 		goto err;
 
+	disk_sectors = btree_node_write_compress(c, data, i, sectors_to_write,
+						 compression_type);
+
 	ret = bset_encrypt(c, i, b->written << 9);
 	if (bch2_fs_fatal_err_on(ret, c,
 			"error encrypting btree node: %i\n", ret))
@@ -2077,8 +2523,10 @@ do_write:
 	trace_and_count(c, btree_node_write, b, bytes_to_write, sectors_to_write);
 
 	wbio = container_of(bio_alloc_bioset(NULL,
-				buf_pages(data, sectors_to_write << 9),
-				REQ_OP_WRITE|REQ_META,
+				buf_pages(data, disk_sectors << 9),
+				REQ_OP_WRITE|REQ_META|
+				(type == BTREE_WRITE_cache_reclaim ||
+				 type == BTREE_WRITE_init_next_bset ? 0 : REQ_PRIO),
 				GFP_NOIO,
 				&c->btree_bio),
 			    struct btree_write_bio, wbio.bio);
@@ -2092,7 +2540,7 @@ do_write:
 	wbio->wbio.bio.bi_end_io	= btree_node_write_endio;
 	wbio->wbio.bio.bi_private	= b;
 
-	bch2_bio_map(&wbio->wbio.bio, data, sectors_to_write << 9);
+	bch2_bio_map(&wbio->wbio.bio, data, disk_sectors << 9);
 
 	bkey_copy(&wbio->key, &b->key);
 
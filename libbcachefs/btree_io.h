@@ -121,6 +121,25 @@ static inline int bset_encrypt(struct bch_fs *c, struct bset *i, unsigned offset
 			    vstruct_end(i) - (void *) i->_data);
 }
 
+/*
+ * Sectors @i occupies within the btree node, starting from @entry (the
+ * containing btree_node or btree_node_entry): a compressed bset still takes up
+ * its uncompressed size, only the compressed part of it is written.
+ */
+static inline unsigned bset_sectors(struct bch_fs *c, void *entry, struct bset *i)
+{
+	size_t bytes = (void *) vstruct_end(i) - entry;
+
+	if (BSET_COMPRESSION_TYPE(i)) {
+		struct bset_compressed *cb = (void *) i->_data;
+
+		bytes = (void *) i->_data - entry +
+			le32_to_cpu(cb->u64s) * sizeof(u64);
+	}
+
+	return round_up(bytes, block_bytes(c)) >> 9;
+}
+
 void bch2_btree_sort_into(struct bch_fs *, struct btree *, struct btree *);
 
 void bch2_btree_node_drop_keys_outside_node(struct btree *);
@@ -130,6 +149,7 @@ void bch2_btree_init_next(struct btree_trans *, struct btree *);
 
 int bch2_btree_node_read_done(struct bch_fs *, struct bch_dev *,
 			      struct btree *, bool, bool *);
+int bch2_btree_scrub(struct bch_fs *);
 void bch2_btree_node_read(struct bch_fs *, struct btree *, bool);
 int bch2_btree_root_read(struct bch_fs *, enum btree_id,
 			 const struct bkey_i *, unsigned);
@@ -146,6 +166,10 @@ enum btree_write_flags {
 #define BTREE_WRITE_ONLY_IF_NEED	(1U << __BTREE_WRITE_ONLY_IF_NEED )
 #define BTREE_WRITE_ALREADY_STARTED	(1U << __BTREE_WRITE_ALREADY_STARTED)
 
+void bch2_btree_write_queue_submit(struct bch_dev *, struct bch_write_bio *);
+void bch2_dev_btree_write_queue_exit(struct bch_dev *);
+int bch2_dev_btree_write_queue_init(struct bch_dev *);
+
 void __bch2_btree_node_write(struct bch_fs *, struct btree *, unsigned);
 void bch2_btree_node_write(struct bch_fs *, struct btree *,
 			   enum six_lock_type, unsigned);
@@ -789,6 +789,40 @@ static inline int btree_path_lock_root(struct btree_trans *trans,
 	}
 }
 
+/*
+ * Called when descending into the leaf ending at @leaf_end: if it's the leaf
+ * immediately after the last one we walked, we're doing a sequential scan and
+ * the readahead window grows, otherwise it shrinks:
+ */
+static void btree_path_readahead_update(struct btree_path *path,
+					struct bpos leaf_end)
+{
+	/* Retraversing the same leaf, e.g. after a transaction restart: */
+	if (bpos_eq(leaf_end, path->readahead_end))
+		return;
+
+	if (path->readahead &&
+	    !bpos_eq(path->readahead_end, SPOS_MAX) &&
+	    bpos_eq(path->pos, bpos_successor(path->readahead_end)))
+		path->readahead = min(path->readahead * 2,
+				      BTREE_PATH_READAHEAD_MAX);
+	else
+		path->readahead = max(path->readahead / 2,
+				      BTREE_PATH_READAHEAD_MIN);
+
+	path->readahead_end = leaf_end;
+}
+
+static unsigned btree_path_prefetch_nr(struct bch_fs *c, struct btree_path *path)
+{
+	if (path->level > 1)
+		return test_bit(BCH_FS_STARTED, &c->flags) ? 0 : 1;
+
+	return test_bit(BCH_FS_STARTED, &c->flags)
+		? path->readahead
+		: max_t(unsigned, path->readahead, 16);
+}
+
 noinline
 static int btree_path_prefetch(struct btree_trans *trans, struct btree_path *path)
 {
@@ -797,9 +831,7 @@ static int btree_path_prefetch(struct btree_trans *trans, struct btree_path *pat
 	struct btree_node_iter node_iter = l->iter;
 	struct bkey_packed *k;
 	struct bkey_buf tmp;
-	unsigned nr = test_bit(BCH_FS_STARTED, &c->flags)
-		? (path->level > 1 ? 0 :  2)
-		: (path->level > 1 ? 1 : 16);
+	unsigned nr = btree_path_prefetch_nr(c, path);
 	bool was_locked = btree_node_locked(path, path->level);
 	int ret = 0;
 
@@ -832,9 +864,7 @@ static int btree_path_prefetch_j(struct btree_trans *trans, struct btree_path *p
 	struct bch_fs *c = trans->c;
 	struct bkey_s_c k;
 	struct bkey_buf tmp;
-	unsigned nr = test_bit(BCH_FS_STARTED, &c->flags)
-		? (path->level > 1 ? 0 :  2)
-		: (path->level > 1 ? 1 : 16);
+	unsigned nr = btree_path_prefetch_nr(c, path);
 	bool was_locked = btree_node_locked(path, path->level);
 	int ret = 0;
 
@@ -900,8 +930,12 @@ static noinline int btree_node_iter_and_journal_peek(struct btree_trans *trans,
 
 	bch2_bkey_buf_reassemble(out, c, k);
 
-	if (flags & BTREE_ITER_PREFETCH)
+	if (flags & BTREE_ITER_PREFETCH) {
+		if (path->level == 1)
+			btree_path_readahead_update(path, out->k->k.p);
+
 		ret = btree_path_prefetch_j(trans, path, &jiter);
+	}
 
 	bch2_btree_and_journal_iter_exit(&jiter);
 	return ret;
@@ -933,13 +967,22 @@ static __always_inline int btree_path_down(struct btree_trans *trans,
 				 bch2_btree_node_iter_peek(&l->iter, l->b));
 
 		if (flags & BTREE_ITER_PREFETCH) {
+			if (path->level == 1)
+				btree_path_readahead_update(path, tmp.k->k.p);
+
 			ret = btree_path_prefetch(trans, path);
 			if (ret)
 				goto err;
 		}
 	}
 
-	b = bch2_btree_node_get(trans, path, tmp.k, level, lock_type, trace_ip);
+	/*
+	 * Only leaf nodes are treated as streaming - interior nodes are shared
+	 * with everything else walking this part of the btree:
+	 */
+	b = bch2_btree_node_get(trans, path, tmp.k, level, lock_type,
+				!level && (flags & BTREE_ITER_STREAMING),
+				trace_ip);
 	ret = PTR_ERR_OR_ZERO(b);
 	if (unlikely(ret))
 		goto err;
@@ -1104,6 +1147,113 @@ static inline unsigned btree_path_up_until_good_node(struct btree_trans *trans,
 		: __btree_path_up_until_good_node(trans, path, check_pos);
 }
 
+/*
+ * Lockless descent, for read only lookups (BTREE_ITER_LOCKLESS): interior
+ * nodes are searched under RCU without being locked, and each is validated
+ * against its lock sequence number after we've found the child pointer. Only
+ * the leaf gets locked, with six_relock_type() against the sequence number we
+ * read before looking at it.
+ *
+ * Interior nodes aren't kept in the path, so the next traverse that has to go
+ * up a level starts over from the root - node iterators and iterators that
+ * prefetch from the parent node never get BTREE_ITER_LOCKLESS.
+ *
+ * Returns false if we raced with something, in which case the caller falls
+ * back to a normal traversal.
+ */
+static noinline bool btree_path_traverse_lockless(struct btree_trans *trans,
+						  struct btree_path *path,
+						  unsigned flags)
+{
+	struct bch_fs *c = trans->c;
+	BKEY_PADDED_ONSTACK(k, BKEY_BTREE_PTR_VAL_U64s_MAX) tmp;
+	struct btree *b, *child;
+	unsigned root_level, level, i;
+	u32 seq, child_seq;
+
+	EBUG_ON(path->nodes_locked);
+
+	rcu_read_lock();
+	b = READ_ONCE(c->btree_roots[path->btree_id].b);
+	if (!b)
+		goto fail;
+
+	seq = READ_ONCE(b->c.lock.state.seq);
+	smp_rmb();
+	root_level = level = READ_ONCE(b->c.level);
+	if (root_level >= BTREE_MAX_DEPTH)
+		goto fail;
+
+	while (1) {
+		if ((seq & 1) ||
+		    btree_node_read_in_flight(b) ||
+		    btree_node_read_error(b))
+			goto fail;
+
+		if (!level)
+			break;
+
+		bch2_btree_cache_hit(c, b, false);
+
+		if (!bch2_btree_node_search_lockless(c, b, path->pos, &tmp.k,
+						     BKEY_BTREE_PTR_VAL_U64s_MAX))
+			goto fail;
+
+		smp_rmb();
+		if (READ_ONCE(b->c.lock.state.seq) != seq)
+			goto fail;
+
+		child = btree_node_mem_ptr(&tmp.k);
+		if (!child)
+			goto fail;
+
+		/*
+		 * mem_ptr may be stale - the node may have been evicted and
+		 * reused, so check that it's the node we want after reading
+		 * the sequence number we'll be validating against:
+		 */
+		child_seq = READ_ONCE(child->c.lock.state.seq);
+		smp_rmb();
+
+		if (READ_ONCE(child->hash_val) != btree_ptr_hash_val(&tmp.k) ||
+		    READ_ONCE(child->c.level) != level - 1 ||
+		    READ_ONCE(child->c.btree_id) != path->btree_id)
+			goto fail;
+
+		b	= child;
+		seq	= child_seq;
+		level--;
+	}
+
+	if (!six_relock_type(&b->c.lock, SIX_LOCK_read, seq))
+		goto fail;
+	rcu_read_unlock();
+
+	if (unlikely(!btree_path_pos_in_node(path, b))) {
+		six_unlock_read(&b->c.lock);
+		goto fail_unlocked;
+	}
+
+	bch2_btree_cache_hit(c, b, flags & BTREE_ITER_STREAMING);
+
+	for (i = 1; i <= root_level; i++)
+		path->l[i].b = ERR_PTR(-BCH_ERR_no_btree_node_lockless);
+	for (i = root_level + 1; i < BTREE_MAX_DEPTH; i++)
+		path->l[i].b = NULL;
+
+	path->level = 0;
+	mark_btree_node_locked(trans, path, 0, SIX_LOCK_read);
+	bch2_btree_path_level_init(trans, path, b);
+
+	this_cpu_inc(c->counters[BCH_COUNTER_btree_path_lockless]);
+	return true;
+fail:
+	rcu_read_unlock();
+fail_unlocked:
+	this_cpu_inc(c->counters[BCH_COUNTER_btree_path_lockless_fail]);
+	return false;
+}
+
 /*
  * This is the main state machine for walking down the btree - walks down to a
  * specified depth
@@ -1143,6 +1293,16 @@ int bch2_btree_path_traverse_one(struct btree_trans *trans,
 
 	path->level = btree_path_up_until_good_node(trans, path, 0);
 
+	if ((flags & BTREE_ITER_LOCKLESS) &&
+	    !depth_want &&
+	    !path->locks_want &&
+	    !btree_path_node(path, path->level) &&
+	    !trans->journal_replay_not_finished &&
+	    btree_path_traverse_lockless(trans, path, flags)) {
+		path->uptodate = BTREE_ITER_UPTODATE;
+		goto out;
+	}
+
 	EBUG_ON(btree_path_node(path, path->level) &&
 		!btree_node_locked(path, path->level));
 
@@ -1589,6 +1749,8 @@ struct btree_path *bch2_path_get(struct btree_trans *trans,
 		path->level			= level;
 		path->locks_want		= locks_want;
 		path->nodes_locked		= 0;
+		path->readahead			= 0;
+		path->readahead_end		= SPOS_MAX;
 		for (i = 0; i < ARRAY_SIZE(path->l); i++)
 			path->l[i].b		= ERR_PTR(-BCH_ERR_no_btree_node_init);
 #ifdef TRACK_PATH_ALLOCATED
@@ -2768,8 +2930,10 @@ void bch2_trans_node_iter_init(struct btree_trans *trans,
        flags |= __BTREE_ITER_ALL_SNAPSHOTS;
        flags |= BTREE_ITER_ALL_SNAPSHOTS;
 
+	/* bch2_btree_iter_next_node() needs the parent locked: */
 	bch2_trans_iter_init_common(trans, iter, btree_id, pos, locks_want, depth,
-			       __bch2_btree_iter_flags(trans, btree_id, flags),
+			       __bch2_btree_iter_flags(trans, btree_id, flags) &
+			       ~BTREE_ITER_LOCKLESS,
 			       _RET_IP_);
 
 	iter->min_depth	= depth;
@@ -2889,6 +3053,13 @@ u32 bch2_trans_begin(struct btree_trans *trans)
 	if (unlikely(time_after(jiffies, trans->srcu_lock_time + msecs_to_jiffies(10))))
 		bch2_trans_reset_srcu_lock(trans);
 
+	if (!trans->restarted)
+		trans->nr_deadlock_restarts = 0;
+	else if (trans->restarted == BCH_ERR_transaction_restart_would_deadlock ||
+		 trans->restarted == BCH_ERR_transaction_restart_would_deadlock_write ||
+		 trans->restarted == BCH_ERR_transaction_restart_deadlock_recursion_limit)
+		bch2_trans_deadlock_backoff(trans);
+
 	trans->last_begin_ip = _RET_IP_;
 	if (trans->restarted) {
 		bch2_btree_path_traverse_all(trans);
@@ -3056,7 +3227,7 @@ void bch2_trans_exit(struct btree_trans *trans)
 	kfree(trans->extra_journal_entries.data);
 
 	if (trans->fs_usage_deltas) {
-		if (trans->fs_usage_deltas->size + sizeof(trans->fs_usage_deltas) ==
+		if (trans->fs_usage_deltas->size + sizeof(*trans->fs_usage_deltas) ==
 		    REPLICAS_DELTA_LIST_MAX)
 			mempool_free(trans->fs_usage_deltas,
 				     &c->replicas_delta_pool);
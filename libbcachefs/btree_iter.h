@@ -379,6 +379,17 @@ static inline unsigned __bch2_btree_iter_flags(struct btree_trans *trans,
 	if (trans->journal_replay_not_finished)
 		flags |= BTREE_ITER_WITH_JOURNAL;
 
+	/*
+	 * Lockless traversal doesn't keep interior nodes in the path, so it's
+	 * no good for iterators that walk interior nodes or prefetch siblings
+	 * from them:
+	 */
+	if (trans->c->opts.btree_lockless_lookup &&
+	    trans->c->opts.btree_node_mem_ptr_optimization &&
+	    !(flags & (BTREE_ITER_INTENT|BTREE_ITER_CACHED|BTREE_ITER_WITH_JOURNAL|
+		       BTREE_ITER_ALL_LEVELS|BTREE_ITER_PREFETCH)))
+		flags |= BTREE_ITER_LOCKLESS;
+
 	return flags;
 }
 
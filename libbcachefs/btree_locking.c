@@ -11,6 +11,18 @@ void bch2_btree_lock_init(struct btree_bkey_cached_common *b)
 	__six_lock_init(&b->lock, "b->c.lock", &bch2_btree_node_lock_key);
 }
 
+/*
+ * Called from btree_node_lock_account() when it's time to look at interior node
+ * lock traffic again:
+ */
+void bch2_btree_lock_mode_kick(struct bch_fs *c)
+{
+	struct btree_cache *bc = &c->btree_cache;
+
+	WRITE_ONCE(bc->lock_mode_next_update, jiffies + HZ);
+	queue_work(system_long_wq, &bc->lock_mode_work);
+}
+
 #ifdef CONFIG_LOCKDEP
 void bch2_assert_btree_nodes_not_locked(void)
 {
@@ -182,9 +194,16 @@ static noinline int break_cycle(struct lock_graph *g, struct printbuf *cycle)
 		goto out;
 	}
 
+	/*
+	 * Among equally good candidates, abort the one that's been restarted
+	 * the fewest times, so that a transaction that keeps losing eventually
+	 * gets to make progress:
+	 */
 	for (i = g->g; i < g->g + g->nr; i++) {
 		pref = btree_trans_abort_preference(i->trans);
-		if (pref > best) {
+		if (pref > best ||
+		    (pref && pref == best &&
+		     i->trans->nr_deadlock_restarts < abort->trans->nr_deadlock_restarts)) {
 			abort = i;
 			best = pref;
 		}
@@ -357,11 +376,96 @@ next:
 	goto next;
 }
 
+/*
+ * Fast check: we can only be part of a lock cycle if someone's waiting on a
+ * lock we hold:
+ */
+static bool btree_trans_locks_have_waiters(struct btree_trans *trans)
+{
+	struct btree_path *path;
+	unsigned l;
+
+	trans_for_each_path(trans, path) {
+		if (!path->nodes_locked)
+			continue;
+
+		for (l = 0; l < BTREE_MAX_DEPTH; l++)
+			if (btree_node_locked(path, l) &&
+			    !list_empty_careful(&path->l[l].b->c.lock.wait_list))
+				return true;
+	}
+
+	return false;
+}
+
 int bch2_six_check_for_deadlock(struct six_lock *lock, void *p)
 {
 	struct btree_trans *trans = p;
+	struct bch_fs *c = trans->c;
+	u64 seq, start_time;
+	int ret;
+
+	if (trans->lock_must_abort)
+		return bch2_check_for_deadlock(trans, NULL);
+
+	/*
+	 * A lock cycle can only be closed by a transaction starting to wait on
+	 * a lock, and that transaction runs the cycle detector itself when it
+	 * does so - thus if no one has started waiting since the last time we
+	 * checked and found nothing, there's nothing new to find:
+	 */
+	seq = atomic64_read(&c->btree_lock_wait_seq);
+	if (trans->deadlock_check_seq == seq) {
+		this_cpu_inc(c->counters[BCH_COUNTER_btree_lock_cycle_check_skipped]);
+		return 0;
+	}
+
+	if (!btree_trans_locks_have_waiters(trans)) {
+		this_cpu_inc(c->counters[BCH_COUNTER_btree_lock_cycle_check_skipped]);
+		trans->deadlock_check_seq = seq;
+		return 0;
+	}
+
+	this_cpu_inc(c->counters[BCH_COUNTER_btree_lock_cycle_check]);
+
+	start_time = local_clock();
+	ret = bch2_check_for_deadlock(trans, NULL);
+	bch2_time_stats_update(&c->times[BCH_TIME_btree_lock_cycle_check], start_time);
+
+	if (!ret)
+		trans->deadlock_check_seq = seq;
+	return ret;
+}
+
+#define BTREE_TRANS_DEADLOCK_BACKOFF_YIELD	2
+#define BTREE_TRANS_DEADLOCK_BACKOFF_SLEEP	8
 
-	return bch2_check_for_deadlock(trans, NULL);
+/*
+ * Called from bch2_trans_begin() after a restart to break a lock cycle: under
+ * heavy contention, transactions that keep losing back off before retrying -
+ * first by yielding, then by sleeping for exponentially longer - so that we
+ * don't just recreate the same cycle:
+ */
+void bch2_trans_deadlock_backoff(struct btree_trans *trans)
+{
+	unsigned nr = trans->nr_deadlock_restarts;
+
+	if (nr < U8_MAX)
+		trans->nr_deadlock_restarts = ++nr;
+
+	if (nr < BTREE_TRANS_DEADLOCK_BACKOFF_YIELD)
+		return;
+
+	this_cpu_inc(trans->c->counters[BCH_COUNTER_trans_deadlock_backoff]);
+
+	bch2_trans_unlock(trans);
+
+	if (nr < BTREE_TRANS_DEADLOCK_BACKOFF_SLEEP) {
+		cond_resched();
+	} else {
+		set_current_state(TASK_UNINTERRUPTIBLE);
+		schedule_timeout(1UL << min(nr - BTREE_TRANS_DEADLOCK_BACKOFF_SLEEP, 3U));
+	}
 }
 
 int __bch2_btree_node_lock_write(struct btree_trans *trans, struct btree_path *path,
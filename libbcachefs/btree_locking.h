@@ -15,6 +15,7 @@
 #include "btree_iter.h"
 
 void bch2_btree_lock_init(struct btree_bkey_cached_common *);
+void bch2_btree_lock_mode_kick(struct bch_fs *);
 
 #ifdef CONFIG_LOCKDEP
 void bch2_assert_btree_nodes_not_locked(void);
@@ -200,16 +201,21 @@ static inline int __btree_node_lock_nopath(struct btree_trans *trans,
 					 bool lock_may_not_fail,
 					 unsigned long ip)
 {
+	u64 start_time = local_clock();
 	int ret;
 
 	trans->lock_may_not_fail = lock_may_not_fail;
 	trans->lock_must_abort	= false;
 	trans->locking		= b;
 
+	atomic64_inc(&trans->c->btree_lock_wait_seq);
+
 	ret = six_lock_type_ip_waiter(&b->lock, type, &trans->locking_wait,
 				   bch2_six_check_for_deadlock, trans, ip);
 	WRITE_ONCE(trans->locking, NULL);
 	WRITE_ONCE(trans->locking_wait.start_time, 0);
+
+	bch2_time_stats_update(&trans->c->times[BCH_TIME_blocked_btree_node_lock], start_time);
 	return ret;
 }
 
@@ -252,6 +258,65 @@ static inline bool btree_node_lock_increment(struct btree_trans *trans,
 	return false;
 }
 
+/*
+ * Interior node lock traffic, for deciding whether interior nodes should have
+ * percpu reader counts - see bch2_btree_lock_mode_work().
+ *
+ * Read locks are only sampled, one in BTREE_LOCK_ACCOUNT_SAMPLE per
+ * transaction, so that lookups don't pay for this - 17 and not 16, so that
+ * traversals that take the same number of interior node locks every time don't
+ * always sample the same level:
+ */
+#define BTREE_LOCK_ACCOUNT_SAMPLE	17
+
+static inline void btree_node_lock_account(struct btree_trans *trans,
+					   struct btree_bkey_cached_common *b,
+					   enum six_lock_type type)
+{
+	struct bch_fs *c = trans->c;
+	struct btree_cache *bc = &c->btree_cache;
+
+	if (!c->opts.btree_adaptive_pcpu_readers || b->cached || !b->level)
+		return;
+
+	switch (type) {
+	case SIX_LOCK_read:
+		if (likely(trans->lock_account_skip)) {
+			trans->lock_account_skip--;
+			return;
+		}
+
+		trans->lock_account_skip = BTREE_LOCK_ACCOUNT_SAMPLE - 1;
+		this_cpu_add(bc->lock_stats->read[b->btree_id][b->level],
+			     BTREE_LOCK_ACCOUNT_SAMPLE);
+		break;
+	case SIX_LOCK_write:
+		this_cpu_inc(bc->lock_stats->write[b->btree_id][b->level]);
+		break;
+	default:
+		return;
+	}
+
+	if (unlikely(time_after(jiffies, READ_ONCE(bc->lock_mode_next_update))))
+		bch2_btree_lock_mode_kick(c);
+}
+
+static inline void btree_node_lock_contended(struct bch_fs *c,
+					     enum six_lock_type type)
+{
+	switch (type) {
+	case SIX_LOCK_read:
+		this_cpu_inc(c->counters[BCH_COUNTER_btree_node_lock_contended_read]);
+		break;
+	case SIX_LOCK_intent:
+		this_cpu_inc(c->counters[BCH_COUNTER_btree_node_lock_contended_intent]);
+		break;
+	case SIX_LOCK_write:
+		this_cpu_inc(c->counters[BCH_COUNTER_btree_node_lock_contended_write]);
+		break;
+	}
+}
+
 static inline int btree_node_lock(struct btree_trans *trans,
 			struct btree_path *path,
 			struct btree_bkey_cached_common *b,
@@ -259,20 +324,26 @@ static inline int btree_node_lock(struct btree_trans *trans,
 			enum six_lock_type type,
 			unsigned long ip)
 {
-	int ret = 0;
+	int ret;
 
 	EBUG_ON(level >= BTREE_MAX_DEPTH);
 	EBUG_ON(!(trans->paths_allocated & (1ULL << path->idx)));
 
-	if (likely(six_trylock_type(&b->lock, type)) ||
-	    btree_node_lock_increment(trans, b, level, type) ||
-	    !(ret = btree_node_lock_nopath(trans, b, type, btree_path_ip_allocated(path)))) {
-#ifdef CONFIG_BCACHEFS_LOCK_TIME_STATS
-		path->l[b->level].lock_taken_time = local_clock();
-#endif
+	btree_node_lock_account(trans, b, type);
+
+	if (unlikely(!six_trylock_type(&b->lock, type)) &&
+	    !btree_node_lock_increment(trans, b, level, type)) {
+		btree_node_lock_contended(trans->c, type);
+
+		ret = btree_node_lock_nopath(trans, b, type, btree_path_ip_allocated(path));
+		if (ret)
+			return ret;
 	}
 
-	return ret;
+#ifdef CONFIG_BCACHEFS_LOCK_TIME_STATS
+	path->l[b->level].lock_taken_time = local_clock();
+#endif
+	return 0;
 }
 
 int __bch2_btree_node_lock_write(struct btree_trans *, struct btree_path *,
@@ -294,9 +365,13 @@ static inline int __btree_node_lock_write(struct btree_trans *trans,
 	 */
 	mark_btree_node_locked_noreset(path, b->level, SIX_LOCK_write);
 
-	return likely(six_trylock_write(&b->lock))
-		? 0
-		: __bch2_btree_node_lock_write(trans, path, b, lock_may_not_fail);
+	btree_node_lock_account(trans, b, SIX_LOCK_write);
+
+	if (likely(six_trylock_write(&b->lock)))
+		return 0;
+
+	btree_node_lock_contended(trans->c, SIX_LOCK_write);
+	return __bch2_btree_node_lock_write(trans, path, b, lock_may_not_fail);
 }
 
 static inline int __must_check
@@ -410,6 +485,7 @@ struct six_lock_count bch2_btree_node_lock_counts(struct btree_trans *,
 				unsigned);
 
 int bch2_check_for_deadlock(struct btree_trans *, struct printbuf *);
+void bch2_trans_deadlock_backoff(struct btree_trans *);
 
 #ifdef CONFIG_BCACHEFS_DEBUG
 void bch2_btree_path_verify_locks(struct btree_path *);
@@ -137,6 +137,24 @@ struct btree {
 	struct list_head	list;
 };
 
+#define BTREE_CACHE_NR_GHOSTS_BITS	9
+#define BTREE_CACHE_NR_GHOSTS		(1U << BTREE_CACHE_NR_GHOSTS_BITS)
+
+/* Interior node lock traffic, per cpu: */
+struct btree_node_lock_stats {
+	u64			read[BTREE_ID_NR][BTREE_MAX_DEPTH];
+	u64			write[BTREE_ID_NR][BTREE_MAX_DEPTH];
+};
+
+struct btree_lock_mode {
+	/* lock_stats totals as of the last time we picked a mode: */
+	u64			read;
+	u64			write;
+	bool			pcpu_readers;
+	/* cached nodes may still have the old mode: */
+	bool			evict;
+};
+
 struct btree_cache {
 	struct rhashtable	table;
 	bool			table_init_done;
@@ -172,7 +190,19 @@ struct btree_cache {
 	unsigned		not_freed_write_blocked;
 	unsigned		not_freed_will_make_reachable;
 	unsigned		not_freed_access_bit;
+	unsigned		not_freed_hot;
 	atomic_t		dirty;
+
+	/*
+	 * Scan resistant replacement: nodes read in from disk start out cold,
+	 * and are only promoted to the hot set if they're accessed again before
+	 * the shrinker gets to them, or if they're read back in shortly after
+	 * being evicted - @ghosts remembers the hash_val of recently evicted
+	 * nodes. Hot nodes have to go unaccessed for a full pass of the
+	 * shrinker before they're demoted, and another before they're evicted:
+	 */
+	atomic_t		nr_hot;
+	u64			ghosts[BTREE_CACHE_NR_GHOSTS];
 	struct shrinker		shrink;
 
 	/*
@@ -183,6 +213,15 @@ struct btree_cache {
 	 */
 	struct task_struct	*alloc_lock;
 	struct closure_waitlist	alloc_wait;
+
+	/*
+	 * Whether interior nodes get percpu reader counts, per btree and level
+	 * - see bch2_btree_lock_mode_work():
+	 */
+	struct btree_node_lock_stats __percpu *lock_stats;
+	struct btree_lock_mode	lock_mode[BTREE_ID_NR][BTREE_MAX_DEPTH];
+	unsigned long		lock_mode_next_update;
+	struct work_struct	lock_mode_work;
 };
 
 struct btree_node_iter {
@@ -194,33 +233,43 @@ struct btree_node_iter {
 /*
  * Iterate over all possible positions, synthesizing deleted keys for holes:
  */
-static const u16 BTREE_ITER_SLOTS		= 1 << 0;
-static const u16 BTREE_ITER_ALL_LEVELS		= 1 << 1;
+static const u32 BTREE_ITER_SLOTS		= 1 << 0;
+static const u32 BTREE_ITER_ALL_LEVELS		= 1 << 1;
 /*
  * Indicates that intent locks should be taken on leaf nodes, because we expect
  * to be doing updates:
  */
-static const u16 BTREE_ITER_INTENT		= 1 << 2;
+static const u32 BTREE_ITER_INTENT		= 1 << 2;
 /*
  * Causes the btree iterator code to prefetch additional btree nodes from disk:
  */
-static const u16 BTREE_ITER_PREFETCH		= 1 << 3;
+static const u32 BTREE_ITER_PREFETCH		= 1 << 3;
 /*
  * Used in bch2_btree_iter_traverse(), to indicate whether we're searching for
  * @pos or the first key strictly greater than @pos
  */
-static const u16 BTREE_ITER_IS_EXTENTS		= 1 << 4;
-static const u16 BTREE_ITER_NOT_EXTENTS		= 1 << 5;
-static const u16 BTREE_ITER_CACHED		= 1 << 6;
-static const u16 BTREE_ITER_WITH_KEY_CACHE	= 1 << 7;
-static const u16 BTREE_ITER_WITH_UPDATES	= 1 << 8;
-static const u16 BTREE_ITER_WITH_JOURNAL	= 1 << 9;
-static const u16 __BTREE_ITER_ALL_SNAPSHOTS	= 1 << 10;
-static const u16 BTREE_ITER_ALL_SNAPSHOTS	= 1 << 11;
-static const u16 BTREE_ITER_FILTER_SNAPSHOTS	= 1 << 12;
-static const u16 BTREE_ITER_NOPRESERVE		= 1 << 13;
-static const u16 BTREE_ITER_CACHED_NOFILL	= 1 << 14;
-static const u16 BTREE_ITER_KEY_CACHE_FILL	= 1 << 15;
+static const u32 BTREE_ITER_IS_EXTENTS		= 1 << 4;
+static const u32 BTREE_ITER_NOT_EXTENTS		= 1 << 5;
+static const u32 BTREE_ITER_CACHED		= 1 << 6;
+static const u32 BTREE_ITER_WITH_KEY_CACHE	= 1 << 7;
+static const u32 BTREE_ITER_WITH_UPDATES	= 1 << 8;
+static const u32 BTREE_ITER_WITH_JOURNAL	= 1 << 9;
+static const u32 __BTREE_ITER_ALL_SNAPSHOTS	= 1 << 10;
+static const u32 BTREE_ITER_ALL_SNAPSHOTS	= 1 << 11;
+static const u32 BTREE_ITER_FILTER_SNAPSHOTS	= 1 << 12;
+static const u32 BTREE_ITER_NOPRESERVE		= 1 << 13;
+static const u32 BTREE_ITER_CACHED_NOFILL	= 1 << 14;
+static const u32 BTREE_ITER_KEY_CACHE_FILL	= 1 << 15;
+/*
+ * Large sequential scans: leaf nodes visited by this iterator aren't marked as
+ * accessed, so they don't displace nodes other users have been hitting:
+ */
+static const u32 BTREE_ITER_STREAMING		= 1 << 16;
+/*
+ * Read only lookups: interior nodes are searched without being locked, see
+ * btree_path_traverse_lockless():
+ */
+static const u32 BTREE_ITER_LOCKLESS		= 1 << 17;
 
 enum btree_path_uptodate {
 	BTREE_ITER_UPTODATE		= 0,
@@ -253,6 +302,14 @@ struct btree_path {
 	unsigned		level:3,
 				locks_want:3;
 	u8			nodes_locked;
+	/*
+	 * BTREE_ITER_PREFETCH readahead window: number of leaf nodes to
+	 * prefetch, grown while we're walking leaves in order and shrunk on
+	 * random access. @readahead_end is the max key of the last leaf we
+	 * descended into:
+	 */
+	u8			readahead;
+	struct bpos		readahead_end;
 
 	struct btree_path_level {
 		struct btree	*b;
@@ -299,7 +356,7 @@ struct btree_iter {
 	unsigned		advanced:1;
 
 	/* btree_iter_copy starts here: */
-	u16			flags;
+	u32			flags;
 
 	/* When we're filtering by snapshot, the snapshot ID we're looking for: */
 	unsigned		snapshot;
@@ -397,6 +454,9 @@ struct btree_insert_entry {
 
 #define BTREE_ITER_MAX		64
 
+#define BTREE_PATH_READAHEAD_MIN	2
+#define BTREE_PATH_READAHEAD_MAX	32
+
 struct btree_trans_commit_hook;
 typedef int (btree_trans_commit_hook_fn)(struct btree_trans *, struct btree_trans_commit_hook *);
 
@@ -418,8 +478,14 @@ struct btree_trans {
 
 	u8			lock_may_not_fail;
 	u8			lock_must_abort;
+	/* consecutive restarts to break lock cycles: */
+	u8			nr_deadlock_restarts;
+	/* interior node read locks until the next one is accounted: */
+	u8			lock_account_skip;
 	struct btree_bkey_cached_common *locking;
 	struct six_lock_waiter	locking_wait;
+	/* c->btree_lock_wait_seq as of the last cycle check that found nothing */
+	u64			deadlock_check_seq;
 
 	int			srcu_idx;
 
@@ -492,6 +558,24 @@ enum btree_write_type {
 #define BTREE_WRITE_TYPE_MASK	(roundup_pow_of_two(BTREE_WRITE_TYPE_NR) - 1)
 #define BTREE_WRITE_TYPE_BITS	ilog2(roundup_pow_of_two(BTREE_WRITE_TYPE_NR))
 
+/* Per device btree node write scheduler, see btree_io.c: */
+struct btree_write_queue_entry {
+	struct bch_write_bio	*wbio;
+	bool			background;
+	u64			sweep;
+	u64			sector;
+};
+
+struct btree_write_queue {
+	spinlock_t		lock;
+	unsigned		in_flight;
+	/* elevator position: */
+	u64			sweep;
+	u64			pos;
+	HEAP(struct btree_write_queue_entry) heap;
+	struct work_struct	work;
+};
+
 #define BTREE_FLAGS()							\
 	x(read_in_flight)						\
 	x(read_error)							\
@@ -502,13 +586,15 @@ enum btree_write_type {
 	x(noevict)							\
 	x(write_idx)							\
 	x(accessed)							\
+	x(hot)								\
 	x(write_in_flight)						\
 	x(write_in_flight_inner)					\
 	x(just_written)							\
 	x(dying)							\
 	x(fake)								\
 	x(need_rewrite)							\
-	x(never_write)
+	x(never_write)							\
+	x(keys_unverified)
 
 enum btree_flags {
 	/* First bits for btree node write type */
@@ -237,7 +237,7 @@ static void bch2_btree_node_free_never_used(struct btree_update *as,
 static struct btree *__bch2_btree_node_alloc(struct btree_trans *trans,
 					     struct disk_reservation *res,
 					     struct closure *cl,
-					     bool interior_node,
+					     bool pcpu_read_locks,
 					     unsigned flags)
 {
 	struct bch_fs *c = trans->c;
@@ -301,7 +301,7 @@ retry:
 	bch2_open_bucket_get(c, wp, &ob);
 	bch2_alloc_sectors_done(c, wp);
 mem_alloc:
-	b = bch2_btree_node_mem_alloc(trans, interior_node);
+	b = bch2_btree_node_mem_alloc(trans, pcpu_read_locks);
 	six_unlock_write(&b->c.lock);
 	six_unlock_intent(&b->c.lock);
 
@@ -486,11 +486,18 @@ static int bch2_btree_reserve_get(struct btree_trans *trans,
 
 	for (interior = 0; interior < 2; interior++) {
 		struct prealloc_nodes *p = as->prealloc_nodes + interior;
+		/*
+		 * We don't know yet what level preallocated interior nodes will
+		 * end up at - use the lowest level they could be at:
+		 */
+		bool pcpu_read_locks = interior &&
+			bch2_btree_node_want_pcpu_readers(c, as->btree_id,
+						max(as->update_level, 1U));
 
 		while (p->nr < nr_nodes[interior]) {
 			b = __bch2_btree_node_alloc(trans, &as->disk_res,
 					flags & BTREE_INSERT_NOWAIT ? NULL : cl,
-					interior, flags);
+					pcpu_read_locks, flags);
 			if (IS_ERR(b)) {
 				ret = PTR_ERR(b);
 				goto err;
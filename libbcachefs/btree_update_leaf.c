@@ -641,7 +641,8 @@ bch2_trans_commit_write_locked(struct btree_trans *trans, unsigned flags,
 	}
 
 	if (trans->nr_wb_updates &&
-	    trans->nr_wb_updates + c->btree_write_buffer.state.nr > c->btree_write_buffer.size)
+	    trans->nr_wb_updates + c->btree_write_buffer.state.nr >
+	    bch2_btree_write_buffer_size(&c->btree_write_buffer))
 		return -BCH_ERR_btree_insert_need_flush_buffer;
 
 	/*
@@ -1004,30 +1005,9 @@ int bch2_trans_commit_error(struct btree_trans *trans, unsigned flags,
 		if (ret)
 			trace_and_count(c, trans_restart_journal_reclaim, trans, trace_ip);
 		break;
-	case -BCH_ERR_btree_insert_need_flush_buffer: {
-		struct btree_write_buffer *wb = &c->btree_write_buffer;
-
-		ret = 0;
-
-		if (wb->state.nr > wb->size * 3 / 4) {
-			bch2_trans_reset_updates(trans);
-			bch2_trans_unlock(trans);
-
-			mutex_lock(&wb->flush_lock);
-
-			if (wb->state.nr > wb->size * 3 / 4)
-				ret = __bch2_btree_write_buffer_flush(trans,
-						flags|BTREE_INSERT_NOCHECK_RW, true);
-			else
-				mutex_unlock(&wb->flush_lock);
-
-			if (!ret) {
-				trace_and_count(c, trans_restart_write_buffer_flush, trans, _THIS_IP_);
-				ret = btree_trans_restart(trans, BCH_ERR_transaction_restart_write_buffer_flush);
-			}
-		}
+	case -BCH_ERR_btree_insert_need_flush_buffer:
+		ret = bch2_btree_write_buffer_full(trans, flags);
 		break;
-	}
 	default:
 		BUG_ON(ret >= 0);
 		break;
@@ -1117,19 +1097,9 @@ int __bch2_trans_commit(struct btree_trans *trans, unsigned flags)
 			goto out_reset;
 	}
 
-	if (c->btree_write_buffer.state.nr > c->btree_write_buffer.size / 2 &&
-	    mutex_trylock(&c->btree_write_buffer.flush_lock)) {
-		bch2_trans_begin(trans);
-		bch2_trans_unlock(trans);
-
-		ret = __bch2_btree_write_buffer_flush(trans,
-					flags|BTREE_INSERT_NOCHECK_RW, true);
-		if (!ret) {
-			trace_and_count(c, trans_restart_write_buffer_flush, trans, _THIS_IP_);
-			ret = btree_trans_restart(trans, BCH_ERR_transaction_restart_write_buffer_flush);
-		}
+	ret = bch2_btree_write_buffer_backpressure(trans, flags);
+	if (ret)
 		goto out;
-	}
 
 	EBUG_ON(test_bit(BCH_FS_CLEAN_SHUTDOWN, &c->flags));
 
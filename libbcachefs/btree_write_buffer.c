@@ -11,17 +11,6 @@
 
 #include <linux/sort.h>
 
-static int btree_write_buffered_key_cmp(const void *_l, const void *_r)
-{
-	const struct btree_write_buffered_key *l = _l;
-	const struct btree_write_buffered_key *r = _r;
-
-	return  cmp_int(l->btree, r->btree) ?:
-		bpos_cmp(l->k.k.p, r->k.k.p) ?:
-		cmp_int(l->journal_seq, r->journal_seq) ?:
-		cmp_int(l->journal_offset, r->journal_offset);
-}
-
 static int btree_write_buffered_journal_cmp(const void *_l, const void *_r)
 {
 	const struct btree_write_buffered_key *l = _l;
@@ -82,6 +71,191 @@ trans_commit:
 				  BTREE_INSERT_JOURNAL_RECLAIM);
 }
 
+static inline u8 wb_key_ref_byte(const struct btree_write_buffered_key_ref *r,
+				 unsigned i)
+{
+	if (i < 8)
+		return r->journal_pos >> (i * 8);
+	i -= 8;
+	if (i < 4)
+		return r->snapshot >> (i * 8);
+	i -= 4;
+	if (i < 8)
+		return r->offset >> (i * 8);
+	i -= 8;
+	if (i < 8)
+		return r->inode >> (i * 8);
+	return r->btree;
+}
+
+/*
+ * LSD radix sort of the write buffer by (btree, pos, journal_seq,
+ * journal_offset): all the histograms are computed in a single pass, and
+ * passes where every key has the same digit are skipped - this is most of
+ * them, in practice (high bytes of inode, snapshot, journal seq).
+ *
+ * Returns whichever of @src and @dst ended up holding the result.
+ */
+static struct btree_write_buffered_key_ref *
+wb_key_refs_radix_sort(struct btree_write_buffered_key_ref *src,
+		       struct btree_write_buffered_key_ref *dst,
+		       size_t nr, u32 (*hist)[256])
+{
+	struct btree_write_buffered_key_ref *r;
+	unsigned b, d;
+
+	if (nr < 2)
+		return src;
+
+	memset(hist, 0, sizeof(hist[0]) * BTREE_WRITE_BUFFER_RADIX_BYTES);
+
+	for (r = src; r < src + nr; r++)
+		for (b = 0; b < BTREE_WRITE_BUFFER_RADIX_BYTES; b++)
+			hist[b][wb_key_ref_byte(r, b)]++;
+
+	for (b = 0; b < BTREE_WRITE_BUFFER_RADIX_BYTES; b++) {
+		u32 *h = hist[b], sum = 0;
+
+		if (h[wb_key_ref_byte(src, b)] == nr)
+			continue;
+
+		for (d = 0; d < 256; d++) {
+			u32 n = h[d];
+
+			h[d] = sum;
+			sum += n;
+		}
+
+		for (r = src; r < src + nr; r++)
+			dst[h[wb_key_ref_byte(r, b)]++] = *r;
+
+		swap(src, dst);
+	}
+
+	return src;
+}
+
+static struct btree_write_buffered_key_ref *
+wb_keys_sort(struct btree_write_buffer *wb,
+	     struct btree_write_buffered_key *keys, size_t nr)
+{
+	struct btree_write_buffered_key_ref *refs = wb->sort_refs[0];
+	u64 min_seq = U64_MAX;
+	size_t i;
+
+	for (i = 0; i < nr; i++)
+		min_seq = min(min_seq, keys[i].journal_seq);
+
+	for (i = 0; i < nr; i++) {
+		/* journal pins bound how many seqs can be in the buffer: */
+		EBUG_ON(keys[i].journal_seq - min_seq > U32_MAX);
+
+		refs[i] = (struct btree_write_buffered_key_ref) {
+			.inode		= keys[i].k.k.p.inode,
+			.offset		= keys[i].k.k.p.offset,
+			.snapshot	= keys[i].k.k.p.snapshot,
+			.btree		= keys[i].btree,
+			.journal_pos	= ((keys[i].journal_seq - min_seq) << 32)|
+				keys[i].journal_offset,
+			.idx		= i,
+		};
+	}
+
+	return wb_key_refs_radix_sort(refs, wb->sort_refs[1], nr, wb->sort_hist);
+}
+
+static inline bool wb_key_refs_same_pos(const struct btree_write_buffered_key_ref *l,
+					const struct btree_write_buffered_key_ref *r)
+{
+	return  l->btree	== r->btree &&
+		l->inode	== r->inode &&
+		l->offset	== r->offset &&
+		l->snapshot	== r->snapshot;
+}
+
+/*
+ * Flush a sorted range of the write buffer: keys that don't get flushed
+ * because doing so would deadlock journal reclaim are left with a nonzero
+ * journal_seq for the slowpath.
+ */
+static int wb_flush_range(struct btree_trans *trans,
+			  struct btree_write_buffered_key *keys,
+			  struct btree_write_buffered_key_ref *refs, size_t nr,
+			  unsigned commit_flags,
+			  struct btree_write_buffer_flush_work *w)
+{
+	struct btree_write_buffered_key_ref *r;
+	struct btree_write_buffered_key *i;
+	struct btree_iter iter = { NULL };
+	bool write_locked = false;
+	int ret = 0;
+
+	for (r = refs; r < refs + nr; r++) {
+		i = keys + r->idx;
+
+		if (r + 1 < refs + nr &&
+		    wb_key_refs_same_pos(r, r + 1)) {
+			w->skipped++;
+			i->journal_seq = 0;
+			continue;
+		}
+
+		if (write_locked &&
+		    (iter.path->btree_id != i->btree ||
+		     bpos_gt(i->k.k.p, iter.path->l[0].b->key.k.p))) {
+			bch2_btree_node_unlock_write(trans, iter.path, iter.path->l[0].b);
+			write_locked = false;
+		}
+
+		if (!iter.path || iter.path->btree_id != i->btree) {
+			bch2_trans_iter_exit(trans, &iter);
+			bch2_trans_iter_init(trans, &iter, i->btree, i->k.k.p, BTREE_ITER_INTENT);
+		}
+
+		bch2_btree_iter_set_pos(&iter, i->k.k.p);
+		iter.path->preserve = false;
+
+		do {
+			ret = bch2_btree_write_buffer_flush_one(trans, &iter, i,
+						commit_flags, &write_locked, &w->fast);
+			if (!write_locked)
+				bch2_trans_begin(trans);
+		} while (bch2_err_matches(ret, BCH_ERR_transaction_restart));
+
+		if (ret == -BCH_ERR_journal_reclaim_would_deadlock) {
+			w->slowpath++;
+			ret = 0;
+			continue;
+		}
+		if (ret)
+			break;
+
+		i->journal_seq = 0;
+	}
+
+	if (write_locked)
+		bch2_btree_node_unlock_write(trans, iter.path, iter.path->l[0].b);
+	bch2_trans_iter_exit(trans, &iter);
+
+	return ret;
+}
+
+static void wb_flush_work_fn(struct closure *cl)
+{
+	struct btree_write_buffer_flush_work *w =
+		container_of(cl, struct btree_write_buffer_flush_work, cl);
+
+	w->ret = bch2_trans_run(w->c,
+			wb_flush_range(&trans, w->keys, w->refs, w->nr,
+				       w->commit_flags, w));
+	closure_return(cl);
+}
+
+/*
+ * Don't bother handing off btrees with fewer keys than this to another thread:
+ */
+#define WB_FLUSH_PARALLEL_MIN	64
+
 static union btree_write_buffer_state btree_write_buffer_switch(struct btree_write_buffer *wb)
 {
 	union btree_write_buffer_state old, new;
@@ -102,6 +276,95 @@ static union btree_write_buffer_state btree_write_buffer_switch(struct btree_wri
 	return old;
 }
 
+/*
+ * Called after a buffer has been flushed, and before it's switched to again:
+ * size it so that it would have absorbed everything inserted while the other
+ * buffer was being flushed, with some headroom.
+ */
+static void btree_write_buffer_resize(struct btree_write_buffer *wb,
+				      unsigned idx, size_t nr, u64 flush_time)
+{
+	size_t want = wb->size[idx];
+	struct btree_write_buffered_key *keys;
+	u64 burst;
+
+	if (READ_ONCE(wb->saw_full)) {
+		WRITE_ONCE(wb->saw_full, false);
+		want *= 2;
+		wb->nr_underused = 0;
+	} else if (nr < want / 4) {
+		if (++wb->nr_underused >= BTREE_WRITE_BUFFER_SHRINK_AFTER) {
+			want /= 2;
+			wb->nr_underused = 0;
+		}
+	} else {
+		wb->nr_underused = 0;
+	}
+
+	burst = div_u64(wb->insert_rate * flush_time, NSEC_PER_SEC) * 2;
+	want = clamp_t(u64, max_t(u64, want, burst), wb->size_min, wb->size_max);
+
+	if (want == wb->size[idx])
+		return;
+
+	if (want > wb->sort_refs_size) {
+		struct btree_write_buffered_key_ref *r0, *r1;
+
+		r0 = kvmalloc_array(want, sizeof(*r0), GFP_NOFS|__GFP_NOWARN);
+		r1 = kvmalloc_array(want, sizeof(*r1), GFP_NOFS|__GFP_NOWARN);
+		if (!r0 || !r1) {
+			kvfree(r1);
+			kvfree(r0);
+			return;
+		}
+
+		kvfree(wb->sort_refs[0]);
+		kvfree(wb->sort_refs[1]);
+		wb->sort_refs[0]	= r0;
+		wb->sort_refs[1]	= r1;
+		wb->sort_refs_size	= want;
+	}
+
+	keys = kvmalloc_array(want, sizeof(*keys), GFP_NOFS|__GFP_NOWARN);
+	if (!keys)
+		return;
+
+	kvfree(wb->keys[idx]);
+	wb->keys[idx] = keys;
+	wb->size[idx] = want;
+
+	/* Must be visible before the next switch makes this buffer active: */
+	smp_wmb();
+}
+
+static void btree_write_buffer_account_switch(struct btree_write_buffer *wb,
+					      size_t nr, u64 now)
+{
+	if (wb->last_switch && now > wb->last_switch) {
+		u64 rate = div64_u64((u64) nr * NSEC_PER_SEC, now - wb->last_switch);
+
+		wb->insert_rate = wb->insert_rate
+			? ewma_add(wb->insert_rate, rate, 3)
+			: rate;
+	}
+
+	wb->last_switch = now;
+}
+
+static void btree_write_buffer_account_flush(struct btree_write_buffer *wb,
+					     size_t nr, u64 flush_time)
+{
+	u64 rate;
+
+	if (!nr)
+		return;
+
+	rate = div64_u64((u64) nr * NSEC_PER_SEC, max_t(u64, flush_time, 1));
+	wb->flush_rate = wb->flush_rate
+		? ewma_add(wb->flush_rate, rate, 3)
+		: rate;
+}
+
 int __bch2_btree_write_buffer_flush(struct btree_trans *trans, unsigned commit_flags,
 				    bool locked)
 {
@@ -110,12 +373,18 @@ int __bch2_btree_write_buffer_flush(struct btree_trans *trans, unsigned commit_f
 	struct btree_write_buffer *wb = &c->btree_write_buffer;
 	struct journal_entry_pin pin;
 	struct btree_write_buffered_key *i, *keys;
-	struct btree_iter iter = { NULL };
+	struct btree_write_buffered_key_ref *refs, *r, *end;
+	struct btree_write_buffer_flush_work inline_work = { .c = c }, *w;
+	struct closure cl;
 	size_t nr = 0, skipped = 0, fast = 0, slowpath = 0;
-	bool write_locked = false;
+	u64 parallel_btrees = 0;
+	bool have_inline = false;
 	union btree_write_buffer_state s;
+	u64 start_time;
 	int ret = 0;
 
+	BUILD_BUG_ON(BTREE_ID_NR > 64);
+
 	memset(&pin, 0, sizeof(pin));
 
 	if (!locked && !mutex_trylock(&wb->flush_lock))
@@ -124,10 +393,17 @@ int __bch2_btree_write_buffer_flush(struct btree_trans *trans, unsigned commit_f
 	bch2_journal_pin_copy(j, &pin, &wb->journal_pin, NULL);
 	bch2_journal_pin_drop(j, &wb->journal_pin);
 
+	start_time = local_clock();
+
 	s = btree_write_buffer_switch(wb);
 	keys = wb->keys[s.idx];
 	nr = s.nr;
 
+	/* Inserts waiting for space can go now: */
+	wake_up(&wb->wait);
+
+	btree_write_buffer_account_switch(wb, nr, start_time);
+
 	/*
 	 * We first sort so that we can detect and skip redundant updates, and
 	 * then we attempt to flush in sorted btree order, as this is most
@@ -141,67 +417,92 @@ int __bch2_btree_write_buffer_flush(struct btree_trans *trans, unsigned commit_f
 	 *
 	 * If that happens, simply skip the key so we can optimistically insert
 	 * as many keys as possible in the fast path.
+	 *
+	 * Different btrees don't interact, so btrees with enough keys to be
+	 * worth it (backpointers, lru, freespace...) are each flushed by their
+	 * own transaction in parallel; the rest are flushed here.
 	 */
-	sort(keys, nr, sizeof(keys[0]),
-	     btree_write_buffered_key_cmp, NULL);
+	refs = wb_keys_sort(wb, keys, nr);
 
-	for (i = keys; i < keys + nr; i++) {
-		if (i + 1 < keys + nr &&
-		    i[0].btree == i[1].btree &&
-		    bpos_eq(i[0].k.k.p, i[1].k.k.p)) {
-			skipped++;
-			i->journal_seq = 0;
+	closure_init_stack(&cl);
+
+	for (r = refs; r < refs + nr; r = end) {
+		for (end = r; end < refs + nr && end->btree == r->btree; end++)
+			;
+
+		if (end - r < WB_FLUSH_PARALLEL_MIN)
 			continue;
-		}
 
-		if (write_locked &&
-		    (iter.path->btree_id != i->btree ||
-		     bpos_gt(i->k.k.p, iter.path->l[0].b->key.k.p))) {
-			bch2_btree_node_unlock_write(trans, iter.path, iter.path->l[0].b);
-			write_locked = false;
+		/* The first big btree is flushed by this thread: */
+		if (!have_inline) {
+			have_inline = true;
+			continue;
 		}
 
-		if (!iter.path || iter.path->btree_id != i->btree) {
-			bch2_trans_iter_exit(trans, &iter);
-			bch2_trans_iter_init(trans, &iter, i->btree, i->k.k.p, BTREE_ITER_INTENT);
-		}
+		if (!parallel_btrees)
+			bch2_trans_unlock(trans);
 
-		bch2_btree_iter_set_pos(&iter, i->k.k.p);
-		iter.path->preserve = false;
+		parallel_btrees |= (1ULL << r->btree);
 
-		do {
-			ret = bch2_btree_write_buffer_flush_one(trans, &iter, i,
-						commit_flags, &write_locked, &fast);
-			if (!write_locked)
-				bch2_trans_begin(trans);
-		} while (bch2_err_matches(ret, BCH_ERR_transaction_restart));
+		w = wb->flush_work + r->btree;
+		*w = (struct btree_write_buffer_flush_work) {
+			.c		= c,
+			.keys		= keys,
+			.refs		= r,
+			.nr		= end - r,
+			.commit_flags	= commit_flags,
+		};
+		closure_call(&w->cl, wb_flush_work_fn, c->btree_write_buffer_flush_wq, &cl);
+	}
 
-		if (ret == -BCH_ERR_journal_reclaim_would_deadlock) {
-			slowpath++;
-			continue;
-		}
-		if (ret)
-			break;
+	for (r = refs; r < refs + nr && !ret; r = end) {
+		for (end = r; end < refs + nr && end->btree == r->btree; end++)
+			;
 
-		i->journal_seq = 0;
+		if (!(parallel_btrees & (1ULL << r->btree)))
+			ret = wb_flush_range(trans, keys, r, end - r,
+					     commit_flags, &inline_work);
 	}
 
-	if (write_locked)
-		bch2_btree_node_unlock_write(trans, iter.path, iter.path->l[0].b);
-	bch2_trans_iter_exit(trans, &iter);
+	closure_sync(&cl);
+
+	skipped		= inline_work.skipped;
+	fast		= inline_work.fast;
+	slowpath	= inline_work.slowpath;
+
+	for (w = wb->flush_work; w < wb->flush_work + BTREE_ID_NR; w++)
+		if (parallel_btrees & (1ULL << (w - wb->flush_work))) {
+			skipped		+= w->skipped;
+			fast		+= w->fast;
+			slowpath	+= w->slowpath;
+			ret		= ret ?: w->ret;
+		}
 
-	trace_write_buffer_flush(trans, nr, skipped, fast, wb->size);
+	trace_write_buffer_flush(trans, nr, skipped, fast, wb->size[s.idx]);
 
-	if (slowpath)
+	if (slowpath && !ret)
 		goto slowpath;
 
 	bch2_fs_fatal_err_on(ret, c, "%s: insert error %s", __func__, bch2_err_str(ret));
 out:
 	bch2_journal_pin_drop(j, &pin);
+
+	if (!ret) {
+		u64 flush_time = local_clock() - start_time;
+
+		btree_write_buffer_account_flush(wb, nr, flush_time);
+		btree_write_buffer_resize(wb, s.idx, nr, flush_time);
+	}
+
 	mutex_unlock(&wb->flush_lock);
+
+	/* Inserts kept coming while we were flushing? */
+	if (!ret && wb->state.nr > bch2_btree_write_buffer_size(wb) / 2)
+		bch2_btree_write_buffer_flush_async(c);
+
 	return ret;
 slowpath:
-	trace_write_buffer_flush_slowpath(trans, i - keys, nr);
+	trace_write_buffer_flush_slowpath(trans, slowpath, nr);
 
 	/*
 	 * Now sort the rest by journal seq and bump the journal pin as we go.
@@ -264,6 +565,135 @@ static int bch2_btree_write_buffer_journal_flush(struct journal *j,
 			__bch2_btree_write_buffer_flush(&trans, BTREE_INSERT_NOCHECK_RW, true));
 }
 
+static void bch2_btree_write_buffer_flush_work(struct work_struct *work)
+{
+	struct bch_fs *c = container_of(work, struct bch_fs, btree_write_buffer.flush_async);
+	struct btree_write_buffer *wb = &c->btree_write_buffer;
+
+	mutex_lock(&wb->flush_lock);
+	bch2_trans_run(c,
+		__bch2_btree_write_buffer_flush(&trans, BTREE_INSERT_NOCHECK_RW, true));
+	bch2_write_ref_put(c, BCH_WRITE_REF_btree_write_buffer);
+}
+
+/*
+ * Returns false if we couldn't kick off a flush because we're going read-only:
+ */
+bool bch2_btree_write_buffer_flush_async(struct bch_fs *c)
+{
+	if (!bch2_write_ref_tryget(c, BCH_WRITE_REF_btree_write_buffer))
+		return false;
+
+	if (!queue_work(c->btree_write_buffer_wq, &c->btree_write_buffer.flush_async))
+		bch2_write_ref_put(c, BCH_WRITE_REF_btree_write_buffer);
+	return true;
+}
+
+static inline bool btree_write_buffer_has_space(struct btree_write_buffer *wb,
+						unsigned nr)
+{
+	return wb->state.nr + nr <= bch2_btree_write_buffer_size(wb);
+}
+
+/*
+ * Graduated backpressure, called before every commit once the buffer is more
+ * than half full: kick off a background flush, and once we're past 3/4 full
+ * throttle transactions that add to the write buffer in proportion to how
+ * full it is and how fast we've been flushing - so that by the time it's full,
+ * inserts are limited to the flush rate instead of hitting a wall.
+ */
+int __bch2_btree_write_buffer_backpressure(struct btree_trans *trans, unsigned flags)
+{
+	struct bch_fs *c = trans->c;
+	struct btree_write_buffer *wb = &c->btree_write_buffer;
+	size_t size = bch2_btree_write_buffer_size(wb);
+	size_t nr = wb->state.nr;
+	u64 flush_rate = READ_ONCE(wb->flush_rate) ?: USEC_PER_SEC;
+	u64 delay;
+	unsigned long timeout;
+
+	if (nr <= size / 2)
+		return 0;
+
+	bch2_btree_write_buffer_flush_async(c);
+
+	if (!trans->nr_wb_updates ||
+	    (flags & BTREE_INSERT_JOURNAL_RECLAIM) ||
+	    nr <= size * 3 / 4)
+		return 0;
+
+	delay = div64_u64((u64) trans->nr_wb_updates * NSEC_PER_SEC, flush_rate);
+	delay = div64_u64(delay * (nr - size * 3 / 4) * 4, size);
+	timeout = nsecs_to_jiffies(min_t(u64, delay, 10 * NSEC_PER_MSEC));
+	if (!timeout)
+		return 0;
+
+	this_cpu_inc(c->counters[BCH_COUNTER_write_buffer_throttle]);
+
+	bch2_trans_unlock(trans);
+	wait_event_timeout(wb->wait,
+			   wb->state.nr <= bch2_btree_write_buffer_size(wb) * 3 / 4,
+			   timeout);
+	return bch2_trans_relock(trans);
+}
+
+/*
+ * How long a full write buffer waits for a background flush before flushing it
+ * itself:
+ */
+#define WB_FULL_WAIT_TIMEOUT	(HZ / 10)
+
+/*
+ * The write buffer was full: wait for a background flush to switch buffers,
+ * or if we're journal reclaim or shutting down and can't depend on that, or
+ * the background flush isn't getting anywhere, flush it ourselves.
+ */
+int bch2_btree_write_buffer_full(struct btree_trans *trans, unsigned flags)
+{
+	struct bch_fs *c = trans->c;
+	struct btree_write_buffer *wb = &c->btree_write_buffer;
+	bool timed_out = false;
+	int ret = 0;
+
+	WRITE_ONCE(wb->saw_full, true);
+
+	if (!(flags & (BTREE_INSERT_JOURNAL_RECLAIM|BTREE_INSERT_NOCHECK_RW)) &&
+	    bch2_btree_write_buffer_flush_async(c)) {
+		bch2_trans_unlock(trans);
+
+		if (wait_event_timeout(wb->wait,
+				btree_write_buffer_has_space(wb, trans->nr_wb_updates) ||
+				bch2_journal_error(&c->journal),
+				WB_FULL_WAIT_TIMEOUT))
+			return bch2_journal_error(&c->journal) ?:
+				bch2_trans_relock(trans);
+
+		timed_out = true;
+	}
+
+	if (timed_out ||
+	    wb->state.nr > bch2_btree_write_buffer_size(wb) * 3 / 4) {
+		bch2_trans_reset_updates(trans);
+		bch2_trans_unlock(trans);
+
+		mutex_lock(&wb->flush_lock);
+
+		if (timed_out ||
+		    wb->state.nr > bch2_btree_write_buffer_size(wb) * 3 / 4)
+			ret = __bch2_btree_write_buffer_flush(trans,
+					flags|BTREE_INSERT_NOCHECK_RW, true);
+		else
+			mutex_unlock(&wb->flush_lock);
+
+		if (!ret) {
+			trace_and_count(c, trans_restart_write_buffer_flush, trans, _THIS_IP_);
+			ret = btree_trans_restart(trans, BCH_ERR_transaction_restart_write_buffer_flush);
+		}
+	}
+
+	return ret;
+}
+
 static inline u64 btree_write_buffer_ref(int idx)
 {
 	return ((union btree_write_buffer_state) {
@@ -295,7 +725,7 @@ int bch2_btree_insert_keys_write_buffer(struct btree_trans *trans)
 
 		new.v += btree_write_buffer_ref(new.idx);
 		new.nr += trans->nr_wb_updates;
-		if (new.nr > wb->size) {
+		if (new.nr > wb->size[new.idx]) {
 			ret = -BCH_ERR_btree_insert_need_flush_buffer;
 			goto out;
 		}
@@ -320,6 +750,9 @@ void bch2_fs_btree_write_buffer_exit(struct bch_fs *c)
 
 	BUG_ON(wb->state.nr && !bch2_journal_error(&c->journal));
 
+	kvfree(wb->sort_hist);
+	kvfree(wb->sort_refs[1]);
+	kvfree(wb->sort_refs[0]);
 	kvfree(wb->keys[1]);
 	kvfree(wb->keys[0]);
 }
@@ -329,11 +762,22 @@ int bch2_fs_btree_write_buffer_init(struct bch_fs *c)
 	struct btree_write_buffer *wb = &c->btree_write_buffer;
 
 	mutex_init(&wb->flush_lock);
-	wb->size = c->opts.btree_write_buffer_size;
-
-	wb->keys[0] = kvmalloc_array(wb->size, sizeof(*wb->keys[0]), GFP_KERNEL);
-	wb->keys[1] = kvmalloc_array(wb->size, sizeof(*wb->keys[1]), GFP_KERNEL);
-	if (!wb->keys[0] || !wb->keys[1])
+	init_waitqueue_head(&wb->wait);
+	INIT_WORK(&wb->flush_async, bch2_btree_write_buffer_flush_work);
+
+	wb->size_min = c->opts.btree_write_buffer_size;
+	wb->size_max = min_t(size_t, wb->size_min * BTREE_WRITE_BUFFER_GROW_MAX,
+			     (1U << 20) - 1);
+	wb->size[0] = wb->size[1] = wb->sort_refs_size = wb->size_min;
+
+	wb->keys[0] = kvmalloc_array(wb->size[0], sizeof(*wb->keys[0]), GFP_KERNEL);
+	wb->keys[1] = kvmalloc_array(wb->size[1], sizeof(*wb->keys[1]), GFP_KERNEL);
+	wb->sort_refs[0] = kvmalloc_array(wb->sort_refs_size, sizeof(*wb->sort_refs[0]), GFP_KERNEL);
+	wb->sort_refs[1] = kvmalloc_array(wb->sort_refs_size, sizeof(*wb->sort_refs[1]), GFP_KERNEL);
+	wb->sort_hist = kvmalloc_array(BTREE_WRITE_BUFFER_RADIX_BYTES,
+				       sizeof(*wb->sort_hist), GFP_KERNEL);
+	if (!wb->keys[0] || !wb->keys[1] ||
+	    !wb->sort_refs[0] || !wb->sort_refs[1] || !wb->sort_hist)
 		return -BCH_ERR_ENOMEM_fs_btree_write_buffer_init;
 
 	return 0;
@@ -2,9 +2,29 @@
 #ifndef _BCACHEFS_BTREE_WRITE_BUFFER_H
 #define _BCACHEFS_BTREE_WRITE_BUFFER_H
 
+static inline size_t bch2_btree_write_buffer_size(struct btree_write_buffer *wb)
+{
+	return READ_ONCE(wb->size[wb->state.idx]);
+}
+
 int __bch2_btree_write_buffer_flush(struct btree_trans *, unsigned, bool);
 int bch2_btree_write_buffer_flush_sync(struct btree_trans *);
 int bch2_btree_write_buffer_flush(struct btree_trans *);
+bool bch2_btree_write_buffer_flush_async(struct bch_fs *);
+
+int __bch2_btree_write_buffer_backpressure(struct btree_trans *, unsigned);
+
+static inline int bch2_btree_write_buffer_backpressure(struct btree_trans *trans,
+						       unsigned flags)
+{
+	struct btree_write_buffer *wb = &trans->c->btree_write_buffer;
+
+	return unlikely(wb->state.nr > bch2_btree_write_buffer_size(wb) / 2)
+		? __bch2_btree_write_buffer_backpressure(trans, flags)
+		: 0;
+}
+
+int bch2_btree_write_buffer_full(struct btree_trans *, unsigned);
 
 int bch2_btree_insert_keys_write_buffer(struct btree_trans *);
 
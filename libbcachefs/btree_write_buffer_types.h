@@ -14,6 +14,36 @@ struct btree_write_buffered_key {
 	__BKEY_PADDED(k, BTREE_WRITE_BUFERED_VAL_U64s_MAX);
 };
 
+/*
+ * For sorting the write buffer before flushing: a radix sort key for
+ * (btree, pos, journal_seq, journal_offset) and the index of the key it refers
+ * to, so we don't have to move the full keys around:
+ */
+struct btree_write_buffered_key_ref {
+	u64			inode;
+	u64			offset;
+	u64			journal_pos;
+	u32			snapshot;
+	u32			idx;
+	u8			btree;
+};
+
+#define BTREE_WRITE_BUFFER_RADIX_BYTES	29
+
+struct btree_write_buffer_flush_work {
+	struct closure			cl;
+	struct bch_fs			*c;
+	struct btree_write_buffered_key	*keys;
+	struct btree_write_buffered_key_ref *refs;
+	size_t				nr;
+	unsigned			commit_flags;
+
+	size_t				skipped;
+	size_t				fast;
+	size_t				slowpath;
+	int				ret;
+};
+
 union btree_write_buffer_state {
 	struct {
 		atomic64_t	counter;
@@ -31,14 +61,45 @@ union btree_write_buffer_state {
 	};
 };
 
+/*
+ * The buffers grow (up to BTREE_WRITE_BUFFER_GROW_MAX times the
+ * btree_write_buffer_size option) when inserts fill them faster than they're
+ * flushed, and shrink back when they stay mostly empty:
+ */
+#define BTREE_WRITE_BUFFER_GROW_MAX	16
+#define BTREE_WRITE_BUFFER_SHRINK_AFTER	8
+
 struct btree_write_buffer {
 	struct mutex			flush_lock;
 	struct journal_entry_pin	journal_pin;
 
 	union btree_write_buffer_state	state;
-	size_t				size;
+	/*
+	 * Each buffer is only resized after it's been flushed, and before it's
+	 * switched to again:
+	 */
+	size_t				size[2];
+	size_t				size_min;
+	size_t				size_max;
 
 	struct btree_write_buffered_key	*keys[2];
+
+	/* Inserts waiting for space: */
+	wait_queue_head_t		wait;
+	struct work_struct		flush_async;
+	bool				saw_full;
+	unsigned			nr_underused;
+
+	/* Both in keys per second, moving averages: */
+	u64				insert_rate;
+	u64				flush_rate;
+	u64				last_switch;
+
+	/* Used only while flushing, under flush_lock: */
+	struct btree_write_buffered_key_ref *sort_refs[2];
+	size_t				sort_refs_size;
+	u32				(*sort_hist)[256];
+	struct btree_write_buffer_flush_work flush_work[BTREE_ID_NR];
 };
 
 #endif /* _BCACHEFS_BTREE_WRITE_BUFFER_TYPES_H */
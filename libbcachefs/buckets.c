@@ -282,6 +282,58 @@ bch2_fs_usage_read_short(struct bch_fs *c)
 	return ret;
 }
 
+static void bch2_fs_usage_snapshot_free_rcu(struct rcu_head *rcu)
+{
+	kfree(container_of(rcu, struct bch_fs_usage_snapshot, rcu));
+}
+
+/*
+ * Like bch2_fs_usage_read_short(), but may return numbers up to
+ * BCH_FS_USAGE_SNAPSHOT_MAX_AGE old: readers take neither mark_lock nor walk
+ * the percpu counters unless the snapshot has expired, and then only one
+ * thread at a time refreshes it - the rest keep using the old snapshot:
+ */
+struct bch_fs_usage_short
+bch2_fs_usage_read_short_cached(struct bch_fs *c)
+{
+	struct bch_fs_usage_snapshot *s, *old;
+	struct bch_fs_usage_short ret;
+	bool fresh;
+
+	rcu_read_lock();
+	s = rcu_dereference(c->usage_snapshot);
+	fresh = s && time_before(jiffies, s->time + BCH_FS_USAGE_SNAPSHOT_MAX_AGE);
+	if (s)
+		ret = s->u;
+	rcu_read_unlock();
+
+	if (fresh)
+		return ret;
+
+	if (!mutex_trylock(&c->usage_snapshot_lock)) {
+		if (s)
+			return ret;
+		mutex_lock(&c->usage_snapshot_lock);
+	}
+
+	ret = bch2_fs_usage_read_short(c);
+
+	s = kmalloc(sizeof(*s), GFP_NOFS);
+	if (s) {
+		s->time	= jiffies;
+		s->u	= ret;
+
+		old = rcu_dereference_protected(c->usage_snapshot,
+				lockdep_is_held(&c->usage_snapshot_lock));
+		rcu_assign_pointer(c->usage_snapshot, s);
+		if (old)
+			call_rcu(&old->rcu, bch2_fs_usage_snapshot_free_rcu);
+	}
+
+	mutex_unlock(&c->usage_snapshot_lock);
+	return ret;
+}
+
 void bch2_dev_usage_init(struct bch_dev *ca)
 {
 	ca->usage_base->d[BCH_DATA_free].buckets = ca->mi.nbuckets - ca->mi.first_bucket;
@@ -353,18 +405,36 @@ static void bch2_dev_usage_update_m(struct bch_fs *c, struct bch_dev *ca,
 	bch2_dev_usage_update(c, ca, old_a, new_a, journal_seq, gc);
 }
 
-static inline int __update_replicas(struct bch_fs *c,
-				    struct bch_fs_usage *fs_usage,
-				    struct bch_replicas_entry *r,
-				    s64 sectors)
+/*
+ * Replicas indices resolved by a previous apply/revert of the same delta list
+ * are cached in the list, and remain valid until c->replicas is next resized:
+ */
+static void replicas_deltas_check_gen(struct bch_fs *c,
+				      struct replicas_delta_list *deltas)
 {
-	int idx = bch2_replicas_entry_idx(c, r);
+	struct replicas_delta *d, *top = (void *) deltas->d + deltas->used;
 
-	if (idx < 0)
-		return -1;
+	if (deltas->replicas_gen == c->replicas_gen)
+		return;
 
-	fs_usage_data_type_to_base(fs_usage, r->data_type, sectors);
-	fs_usage->replicas[idx]		+= sectors;
+	for (d = deltas->d; d != top; d = replicas_delta_next(d))
+		d->idx = -1;
+	deltas->replicas_gen = c->replicas_gen;
+}
+
+static inline int update_replicas_delta(struct bch_fs *c,
+					struct bch_fs_usage *fs_usage,
+					struct replicas_delta *d,
+					s64 sectors)
+{
+	if (unlikely(d->idx < 0)) {
+		d->idx = bch2_replicas_entry_idx(c, &d->r);
+		if (d->idx < 0)
+			return -1;
+	}
+
+	fs_usage_data_type_to_base(fs_usage, d->r.data_type, sectors);
+	fs_usage->replicas[d->idx]	+= sectors;
 	return 0;
 }
 
@@ -453,25 +523,47 @@ replicas_deltas_realloc(struct btree_trans *trans, unsigned more)
 	return d;
 }
 
+/*
+ * Only the first few entries are checked for a duplicate to merge with -
+ * transactions rarely touch more than a handful of distinct replicas entries,
+ * and we don't want this to go quadratic for the ones that do:
+ */
+#define REPLICAS_DELTA_MERGE_SCAN	8
+
 static inline void update_replicas_list(struct btree_trans *trans,
 					struct bch_replicas_entry *r,
 					s64 sectors)
 {
-	struct replicas_delta_list *d;
-	struct replicas_delta *n;
-	unsigned b;
+	struct replicas_delta_list *d = trans->fs_usage_deltas;
+	struct replicas_delta *n, *top;
+	unsigned b, nr = 0;
 
 	if (!sectors)
 		return;
 
-	b = replicas_entry_bytes(r) + 8;
+	bch2_replicas_entry_sort(r);
+
+	if (d) {
+		top = (void *) d->d + d->used;
+
+		for (n = d->d;
+		     n != top && nr < REPLICAS_DELTA_MERGE_SCAN;
+		     n = replicas_delta_next(n), nr++)
+			if (n->r.nr_devs == r->nr_devs &&
+			    !memcmp(&n->r, r, replicas_entry_bytes(r))) {
+				n->delta += sectors;
+				return;
+			}
+	}
+
+	b = replicas_entry_bytes(r) + offsetof(struct replicas_delta, r);
 	d = replicas_deltas_realloc(trans, b);
 
 	n = (void *) d->d + d->used;
 	n->delta = sectors;
+	n->idx = -1;
 	memcpy((void *) n + offsetof(struct replicas_delta, r),
 	       r, replicas_entry_bytes(r));
-	bch2_replicas_entry_sort(&n->r);
 	d->used += b;
 }
 
@@ -1291,6 +1383,8 @@ void bch2_trans_fs_usage_revert(struct btree_trans *trans,
 	preempt_disable();
 	dst = fs_usage_ptr(c, trans->journal_res.seq, false);
 
+	replicas_deltas_check_gen(c, deltas);
+
 	/* revert changes: */
 	for (d = deltas->d; d != top; d = replicas_delta_next(d)) {
 		switch (d->r.data_type) {
@@ -1299,7 +1393,7 @@ void bch2_trans_fs_usage_revert(struct btree_trans *trans,
 		case BCH_DATA_parity:
 			added += d->delta;
 		}
-		BUG_ON(__update_replicas(c, dst, &d->r, -d->delta));
+		BUG_ON(update_replicas_delta(c, dst, d, -d->delta));
 	}
 
 	dst->nr_inodes -= deltas->nr_inodes;
@@ -1336,6 +1430,8 @@ int bch2_trans_fs_usage_apply(struct btree_trans *trans,
 	preempt_disable();
 	dst = fs_usage_ptr(c, trans->journal_res.seq, false);
 
+	replicas_deltas_check_gen(c, deltas);
+
 	for (d = deltas->d; d != top; d = replicas_delta_next(d)) {
 		switch (d->r.data_type) {
 		case BCH_DATA_btree:
@@ -1344,7 +1440,7 @@ int bch2_trans_fs_usage_apply(struct btree_trans *trans,
 			added += d->delta;
 		}
 
-		if (__update_replicas(c, dst, &d->r, d->delta))
+		if (update_replicas_delta(c, dst, d, d->delta))
 			goto need_mark;
 	}
 
@@ -1390,7 +1486,7 @@ int bch2_trans_fs_usage_apply(struct btree_trans *trans,
 need_mark:
 	/* revert changes: */
 	for (d2 = deltas->d; d2 != d; d2 = replicas_delta_next(d2))
-		BUG_ON(__update_replicas(c, dst, &d2->r, -d2->delta));
+		BUG_ON(update_replicas_delta(c, dst, d2, -d2->delta));
 
 	preempt_enable();
 	percpu_up_read(&c->mark_lock);
@@ -232,6 +232,12 @@ u64 bch2_fs_sectors_used(struct bch_fs *, struct bch_fs_usage_online *);
 struct bch_fs_usage_short
 bch2_fs_usage_read_short(struct bch_fs *);
 
+/* Maximum staleness of bch2_fs_usage_read_short_cached(): */
+#define BCH_FS_USAGE_SNAPSHOT_MAX_AGE	(HZ / 10)
+
+struct bch_fs_usage_short
+bch2_fs_usage_read_short_cached(struct bch_fs *);
+
 /* key/bucket marking: */
 
 void bch2_fs_usage_initialize(struct bch_fs *);
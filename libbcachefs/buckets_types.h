@@ -80,6 +80,17 @@ struct bch_fs_usage_short {
 	u64			nr_inodes;
 };
 
+/*
+ * Snapshot of bch_fs_usage_short, published via RCU so that readers that can
+ * tolerate slightly stale numbers (statfs) don't have to sum percpu counters
+ * under mark_lock:
+ */
+struct bch_fs_usage_snapshot {
+	struct rcu_head		rcu;
+	unsigned long		time;
+	struct bch_fs_usage_short u;
+};
+
 /*
  * A reservation for space on disk:
  */
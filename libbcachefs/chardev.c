@@ -332,7 +332,7 @@ static ssize_t bch2_data_job_read(struct file *file, char __user *buf,
 		.p.btree_id		= ctx->stats.btree_id,
 		.p.pos			= ctx->stats.pos,
 		.p.sectors_done		= atomic64_read(&ctx->stats.sectors_seen),
-		.p.sectors_total	= bch2_fs_usage_read_short(c).used,
+		.p.sectors_total	= bch2_fs_usage_read_short_cached(c).used,
 	};
 
 	if (len < sizeof(e))
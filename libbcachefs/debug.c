@@ -85,19 +85,18 @@ static bool bch2_btree_verify_replica(struct bch_fs *c, struct btree *b,
 		while (offset < v->written) {
 			if (!offset) {
 				i = &n_ondisk->keys;
-				sectors = vstruct_blocks(n_ondisk, c->block_bits) <<
-					c->block_bits;
+				sectors = bset_sectors(c, n_ondisk, i);
 			} else {
 				struct btree_node_entry *bne =
 					(void *) n_ondisk + (offset << 9);
 				i = &bne->keys;
 
-				sectors = vstruct_blocks(bne, c->block_bits) <<
-					c->block_bits;
+				sectors = bset_sectors(c, bne, i);
 			}
 
 			printk(KERN_ERR "*** on disk block %u:\n", offset);
-			bch2_dump_bset(c, b, i, offset);
+			if (!BSET_COMPRESSION_TYPE(i))
+				bch2_dump_bset(c, b, i, offset);
 
 			offset += sectors;
 		}
@@ -248,7 +247,7 @@ void bch2_btree_node_ondisk_to_text(struct printbuf *out, struct bch_fs *c,
 
 			bset_encrypt(c, i, offset << 9);
 
-			sectors = vstruct_sectors(n_ondisk, c->block_bits);
+			sectors = bset_sectors(c, n_ondisk, i);
 		} else {
 			struct btree_node_entry *bne = (void *) n_ondisk + (offset << 9);
 
@@ -273,7 +272,7 @@ void bch2_btree_node_ondisk_to_text(struct printbuf *out, struct bch_fs *c,
 
 			bset_encrypt(c, i, offset << 9);
 
-			sectors = vstruct_sectors(bne, c->block_bits);
+			sectors = bset_sectors(c, bne, i);
 		}
 
 		prt_printf(out, "  offset %u version %u, journal seq %llu\n",
@@ -282,6 +281,13 @@ void bch2_btree_node_ondisk_to_text(struct printbuf *out, struct bch_fs *c,
 			   le64_to_cpu(i->journal_seq));
 		offset += sectors;
 
+		if (BSET_COMPRESSION_TYPE(i)) {
+			prt_printf(out, "  compression type %llu, %u/%u sectors\n",
+				   BSET_COMPRESSION_TYPE(i),
+				   (unsigned) vstruct_sectors(i, c->block_bits), sectors);
+			continue;
+		}
+
 		printbuf_indent_add(out, 4);
 
 		for (k = i->start; k != vstruct_last(i); k = bkey_p_next(k)) {
@@ -382,6 +388,7 @@ static ssize_t bch2_read_btree(struct file *file, char __user *buf,
 
 	ret = for_each_btree_key2(&trans, iter, i->id, i->from,
 				  BTREE_ITER_PREFETCH|
+				  BTREE_ITER_STREAMING|
 				  BTREE_ITER_ALL_SNAPSHOTS, k, ({
 		ret = flush_buf(i);
 		if (ret)
@@ -478,6 +485,7 @@ static ssize_t bch2_read_bfloat_failed(struct file *file, char __user *buf,
 
 	ret = for_each_btree_key2(&trans, iter, i->id, i->from,
 				  BTREE_ITER_PREFETCH|
+				  BTREE_ITER_STREAMING|
 				  BTREE_ITER_ALL_SNAPSHOTS, k, ({
 		struct btree_path_level *l = &iter.path->l[0];
 		struct bkey_packed *_k =
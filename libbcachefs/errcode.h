@@ -34,6 +34,7 @@
 	x(ENOMEM,			ENOMEM_sb_journal_v2_validate)		\
 	x(ENOMEM,			ENOMEM_journal_entry_add)		\
 	x(ENOMEM,			ENOMEM_journal_read_buf_realloc)	\
+	x(ENOMEM,			ENOMEM_journal_entry_uncompress)	\
 	x(ENOMEM,			ENOMEM_btree_interior_update_worker_init)\
 	x(ENOMEM,			ENOMEM_btree_interior_update_pool_init)	\
 	x(ENOMEM,			ENOMEM_bio_read_init)			\
@@ -44,6 +45,7 @@
 	x(ENOMEM,			ENOMEM_dio_read_bioset_init)		\
 	x(ENOMEM,			ENOMEM_dio_write_bioset_init)		\
 	x(ENOMEM,			ENOMEM_nocow_flush_bioset_init)		\
+	x(ENOMEM,			ENOMEM_bucket_alloc_cache_init)		\
 	x(ENOMEM,			ENOMEM_promote_table_init)		\
 	x(ENOMEM,			ENOMEM_compression_bounce_read_init)	\
 	x(ENOMEM,			ENOMEM_compression_bounce_write_init)	\
@@ -54,6 +56,7 @@
 	x(ENOMEM,			ENOMEM_usage_init)			\
 	x(ENOMEM,			ENOMEM_btree_node_read_all_replicas)	\
 	x(ENOMEM,			ENOMEM_btree_node_reclaim)		\
+	x(ENOMEM,			ENOMEM_btree_write_queue_init)		\
 	x(ENOMEM,			ENOMEM_btree_node_mem_alloc)		\
 	x(ENOMEM,			ENOMEM_btree_cache_cannibalize_lock)	\
 	x(ENOMEM,			ENOMEM_buckets_waiting_for_journal_init)\
@@ -129,6 +132,7 @@
 	x(BCH_ERR_no_btree_node,	no_btree_node_init)			\
 	x(BCH_ERR_no_btree_node,	no_btree_node_cached)			\
 	x(BCH_ERR_no_btree_node,	no_btree_node_srcu_reset)		\
+	x(BCH_ERR_no_btree_node,	no_btree_node_lockless)			\
 	x(0,				btree_insert_fail)			\
 	x(BCH_ERR_btree_insert_fail,	btree_insert_btree_node_full)		\
 	x(BCH_ERR_btree_insert_fail,	btree_insert_need_mark_replicas)	\
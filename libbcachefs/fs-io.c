@@ -1487,7 +1487,8 @@ static void bch2_writepage_io_alloc(struct bch_fs *c,
 				    struct bch_writepage_state *w,
 				    struct bch_inode_info *inode,
 				    u64 sector,
-				    unsigned nr_replicas)
+				    unsigned nr_replicas,
+				    struct write_point_specifier write_point)
 {
 	struct bch_write_op *op;
 
@@ -1503,7 +1504,7 @@ static void bch2_writepage_io_alloc(struct bch_fs *c,
 	op->target		= w->opts.foreground_target;
 	op->nr_replicas		= nr_replicas;
 	op->res.nr_replicas	= nr_replicas;
-	op->write_point		= writepoint_hashed(inode->ei_last_dirtied);
+	op->write_point		= write_point;
 	op->subvol		= inode->ei_subvol;
 	op->pos			= POS(inode->v.i_ino, sector);
 	op->end_io		= bch2_writepage_io_done;
@@ -1601,6 +1602,8 @@ do_io:
 	offset = 0;
 	while (1) {
 		unsigned sectors = 0, dirty_sectors = 0, reserved_sectors = 0;
+		unsigned overwrite_sectors = 0;
+		struct write_point_specifier write_point;
 		u64 sector;
 
 		while (offset < f_sectors &&
@@ -1614,14 +1617,25 @@ do_io:
 		       w->tmp[offset + sectors].state >= SECTOR_dirty) {
 			reserved_sectors += w->tmp[offset + sectors].replicas_reserved;
 			dirty_sectors += w->tmp[offset + sectors].state == SECTOR_dirty;
+			overwrite_sectors += w->tmp[offset + sectors].state == SECTOR_allocated;
 			sectors++;
 		}
 		BUG_ON(!sectors);
 
 		sector = folio_sector(folio) + offset;
 
+		/*
+		 * Data that's overwriting existing data is likely to be
+		 * overwritten again soon - keep it separate from new data:
+		 */
+		write_point = writepoint_hashed_temp(inode->ei_last_dirtied,
+					overwrite_sectors
+					? BCH_DATA_TEMP_hot
+					: BCH_DATA_TEMP_warm);
+
 		if (w->io &&
 		    (w->io->op.res.nr_replicas != nr_replicas_this_write ||
+		     w->io->op.write_point.v != write_point.v ||
 		     bio_full(&w->io->op.wbio.bio, sectors << 9) ||
 		     w->io->op.wbio.bio.bi_iter.bi_size + (sectors << 9) >=
 		     (BIO_MAX_VECS * PAGE_SIZE) ||
@@ -1630,7 +1644,8 @@ do_io:
 
 		if (!w->io)
 			bch2_writepage_io_alloc(c, wbc, w, inode, sector,
-						nr_replicas_this_write);
+						nr_replicas_this_write,
+						write_point);
 
 		atomic_inc(&s->write_count);
 
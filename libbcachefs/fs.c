@@ -1527,7 +1527,7 @@ static int bch2_statfs(struct dentry *dentry, struct kstatfs *buf)
 {
 	struct super_block *sb = dentry->d_sb;
 	struct bch_fs *c = sb->s_fs_info;
-	struct bch_fs_usage_short usage = bch2_fs_usage_read_short(c);
+	struct bch_fs_usage_short usage = bch2_fs_usage_read_short_cached(c);
 	unsigned shift = sb->s_blocksize_bits - 9;
 	/*
 	 * this assumes inodes take up 64 bytes, which is a decent average
@@ -1027,7 +1027,8 @@ static int check_inodes(struct bch_fs *c, bool full)
 
 	ret = for_each_btree_key_commit(&trans, iter, BTREE_ID_inodes,
 			POS_MIN,
-			BTREE_ITER_PREFETCH|BTREE_ITER_ALL_SNAPSHOTS, k,
+			BTREE_ITER_PREFETCH|BTREE_ITER_STREAMING|
+			BTREE_ITER_ALL_SNAPSHOTS, k,
 			NULL, NULL, BTREE_INSERT_LAZY_RW|BTREE_INSERT_NOFAIL,
 		check_inode(&trans, &iter, k, &prev, &s, full));
 
@@ -1418,7 +1419,8 @@ static int check_extents(struct bch_fs *c)
 
 	ret = for_each_btree_key_commit(&trans, iter, BTREE_ID_extents,
 			POS(BCACHEFS_ROOT_INO, 0),
-			BTREE_ITER_PREFETCH|BTREE_ITER_ALL_SNAPSHOTS, k,
+			BTREE_ITER_PREFETCH|BTREE_ITER_STREAMING|
+			BTREE_ITER_ALL_SNAPSHOTS, k,
 			&res, NULL,
 			BTREE_INSERT_LAZY_RW|BTREE_INSERT_NOFAIL, ({
 		bch2_disk_reservation_put(c, &res);
@@ -1790,7 +1792,8 @@ static int check_dirents(struct bch_fs *c)
 
 	ret = for_each_btree_key_commit(&trans, iter, BTREE_ID_dirents,
 			POS(BCACHEFS_ROOT_INO, 0),
-			BTREE_ITER_PREFETCH|BTREE_ITER_ALL_SNAPSHOTS,
+			BTREE_ITER_PREFETCH|BTREE_ITER_STREAMING|
+			BTREE_ITER_ALL_SNAPSHOTS,
 			k,
 			NULL, NULL,
 			BTREE_INSERT_LAZY_RW|BTREE_INSERT_NOFAIL,
@@ -1861,7 +1864,8 @@ static int check_xattrs(struct bch_fs *c)
 
 	ret = for_each_btree_key_commit(&trans, iter, BTREE_ID_xattrs,
 			POS(BCACHEFS_ROOT_INO, 0),
-			BTREE_ITER_PREFETCH|BTREE_ITER_ALL_SNAPSHOTS,
+			BTREE_ITER_PREFETCH|BTREE_ITER_STREAMING|
+			BTREE_ITER_ALL_SNAPSHOTS,
 			k,
 			NULL, NULL,
 			BTREE_INSERT_LAZY_RW|BTREE_INSERT_NOFAIL,
@@ -2098,7 +2102,7 @@ static int check_directory_structure(struct bch_fs *c)
 
 	for_each_btree_key(&trans, iter, BTREE_ID_inodes, POS_MIN,
 			   BTREE_ITER_INTENT|
-			   BTREE_ITER_PREFETCH|
+			   BTREE_ITER_PREFETCH|BTREE_ITER_STREAMING|
 			   BTREE_ITER_ALL_SNAPSHOTS, k, ret) {
 		if (!bkey_is_inode(k.k))
 			continue;
@@ -2217,7 +2221,7 @@ static int check_nlinks_find_hardlinks(struct bch_fs *c,
 	for_each_btree_key(&trans, iter, BTREE_ID_inodes,
 			   POS(0, start),
 			   BTREE_ITER_INTENT|
-			   BTREE_ITER_PREFETCH|
+			   BTREE_ITER_PREFETCH|BTREE_ITER_STREAMING|
 			   BTREE_ITER_ALL_SNAPSHOTS, k, ret) {
 		if (!bkey_is_inode(k.k))
 			continue;
@@ -2269,7 +2273,7 @@ static int check_nlinks_walk_dirents(struct bch_fs *c, struct nlink_table *links
 
 	for_each_btree_key(&trans, iter, BTREE_ID_dirents, POS_MIN,
 			   BTREE_ITER_INTENT|
-			   BTREE_ITER_PREFETCH|
+			   BTREE_ITER_PREFETCH|BTREE_ITER_STREAMING|
 			   BTREE_ITER_ALL_SNAPSHOTS, k, ret) {
 		ret = snapshots_seen_update(c, &s, iter.btree_id, k.k->p);
 		if (ret)
@@ -2353,7 +2357,8 @@ static int check_nlinks_update_hardlinks(struct bch_fs *c,
 
 	ret = for_each_btree_key_commit(&trans, iter, BTREE_ID_inodes,
 			POS(0, range_start),
-			BTREE_ITER_INTENT|BTREE_ITER_PREFETCH|BTREE_ITER_ALL_SNAPSHOTS, k,
+			BTREE_ITER_INTENT|BTREE_ITER_PREFETCH|BTREE_ITER_STREAMING|
+			BTREE_ITER_ALL_SNAPSHOTS, k,
 			NULL, NULL, BTREE_INSERT_LAZY_RW|BTREE_INSERT_NOFAIL,
 		check_nlinks_update_inode(&trans, &iter, k, links, &idx, range_end));
 
@@ -2448,7 +2453,8 @@ static int fix_reflink_p(struct bch_fs *c)
 
 	ret = for_each_btree_key_commit(&trans, iter,
 			BTREE_ID_extents, POS_MIN,
-			BTREE_ITER_INTENT|BTREE_ITER_PREFETCH|BTREE_ITER_ALL_SNAPSHOTS, k,
+			BTREE_ITER_INTENT|BTREE_ITER_PREFETCH|BTREE_ITER_STREAMING|
+			BTREE_ITER_ALL_SNAPSHOTS, k,
 			NULL, NULL, BTREE_INSERT_NOFAIL|BTREE_INSERT_LAZY_RW,
 		fix_reflink_p_key(&trans, &iter, k));
 
@@ -11,6 +11,7 @@
 #include "alloc_foreground.h"
 #include "bkey_buf.h"
 #include "bset.h"
+#include "btree_io.h"
 #include "btree_update.h"
 #include "buckets.h"
 #include "checksum.h"
@@ -697,7 +698,10 @@ void bch2_submit_wbio_replicas(struct bch_write_bio *wbio, struct bch_fs *c,
 				continue;
 			}
 
-			submit_bio(&n->bio);
+			if (type == BCH_DATA_btree)
+				bch2_btree_write_queue_submit(ca, n);
+			else
+				submit_bio(&n->bio);
 		} else {
 			n->bio.bi_status	= BLK_STS_REMOVED;
 			bio_endio(&n->bio);
@@ -592,21 +592,85 @@ out:
 
 /* journal flushing: */
 
+/*
+ * Adaptive group commit:
+ *
+ * When flush requests (fsyncs) arrive further apart than a flush write takes,
+ * we issue flushes immediately, as before. When they arrive faster than that,
+ * the device's flushes are the bottleneck anyway, so we hold the journal entry
+ * open for up to one flush write latency (capped at journal_flush_delay) to
+ * let more requests join the same flush:
+ */
+#define JOURNAL_FLUSH_REQ_INTERVAL_MAX	NSEC_PER_SEC
+
+static void journal_flush_req_acct(struct journal *j)
+{
+	u64 now = local_clock();
+	u64 last = xchg(&j->flush_req_last, now);
+	u64 interval = min_t(u64, now - min(now, last),
+			     JOURNAL_FLUSH_REQ_INTERVAL_MAX);
+	u64 old = READ_ONCE(j->flush_req_interval);
+
+	WRITE_ONCE(j->flush_req_interval,
+		   old ? ewma_add(old, interval, 2) : interval);
+}
+
+void bch2_journal_flush_latency_acct(struct journal *j, u64 latency)
+{
+	u64 old = READ_ONCE(j->flush_write_latency);
+
+	WRITE_ONCE(j->flush_write_latency,
+		   old ? ewma_add(old, latency, 3) : latency);
+}
+
+static unsigned long journal_group_commit_delay(struct journal *j)
+{
+	struct bch_fs *c = container_of(j, struct bch_fs, journal);
+	u64 interval	= READ_ONCE(j->flush_req_interval);
+	u64 latency	= READ_ONCE(j->flush_write_latency);
+
+	if (!interval || interval >= latency)
+		return 0;
+
+	return nsecs_to_jiffies(min_t(u64, latency,
+			(u64) c->opts.journal_flush_delay * NSEC_PER_MSEC));
+}
+
+static void journal_buf_want_flush(struct journal *j, struct journal_buf *buf)
+{
+	unsigned long expires = jiffies + journal_group_commit_delay(j);
+
+	buf->must_flush = true;
+
+	if (!buf->flush_time) {
+		buf->flush_time	= local_clock() ?: 1;
+		buf->expires	= expires;
+	} else if (time_after((unsigned long) buf->expires, expires)) {
+		buf->expires	= expires;
+	}
+}
+
 /**
  * bch2_journal_flush_seq_async - wait for a journal entry to be written
  *
- * like bch2_journal_wait_on_seq, except that it triggers a write immediately if
- * necessary
+ * like bch2_journal_wait_on_seq, except that it triggers a write if necessary -
+ * immediately, or after the group commit delay when flush requests are arriving
+ * faster than flush writes complete (see journal_group_commit_delay())
  */
 int bch2_journal_flush_seq_async(struct journal *j, u64 seq,
 				 struct closure *parent)
 {
+	struct bch_fs *c = container_of(j, struct bch_fs, journal);
 	struct journal_buf *buf;
 	int ret = 0;
 
 	if (seq <= j->flushed_seq_ondisk)
 		return 1;
 
+	/* bch2_journal_flush_seq() calls us repeatedly, and accounts itself: */
+	if (parent)
+		journal_flush_req_acct(j);
+
 	spin_lock(&j->lock);
 
 	if (WARN_ONCE(seq > journal_cur_seq(j),
@@ -643,12 +707,7 @@ recheck_need_open:
 
 		seq = res.seq;
 		buf = j->buf + (seq & JOURNAL_BUF_MASK);
-		buf->must_flush = true;
-
-		if (!buf->flush_time) {
-			buf->flush_time	= local_clock() ?: 1;
-			buf->expires = jiffies;
-		}
+		journal_buf_want_flush(j, buf);
 
 		if (parent && !closure_wait(&buf->wait, parent))
 			BUG();
@@ -669,13 +728,19 @@ recheck_need_open:
 		goto recheck_need_open;
 	}
 
-	buf->must_flush = true;
+	journal_buf_want_flush(j, buf);
 
 	if (parent && !closure_wait(&buf->wait, parent))
 		BUG();
 want_write:
-	if (seq == journal_cur_seq(j))
-		journal_entry_want_write(j);
+	if (seq == journal_cur_seq(j)) {
+		long delta = journal_cur_buf(j)->expires - jiffies;
+
+		if (delta > 0 && journal_entry_is_open(j))
+			mod_delayed_work(c->io_complete_wq, &j->write_work, delta);
+		else
+			journal_entry_want_write(j);
+	}
 out:
 	spin_unlock(&j->lock);
 	return ret;
@@ -692,6 +757,8 @@ int bch2_journal_flush_seq(struct journal *j, u64 seq)
 	if (seq <= j->flushed_seq_ondisk)
 		return 0;
 
+	journal_flush_req_acct(j);
+
 	ret = wait_event_interruptible(j->wait, (ret2 = bch2_journal_flush_seq_async(j, seq, NULL)));
 
 	if (!ret)
@@ -1214,6 +1281,7 @@ void bch2_fs_journal_exit(struct journal *j)
 
 	for (i = 0; i < ARRAY_SIZE(j->buf); i++)
 		kvpfree(j->buf[i].data, j->buf[i].buf_size);
+	kvpfree(j->compress_buf, j->compress_buf_size);
 	free_fifo(&j->pin);
 }
 
@@ -1290,6 +1358,11 @@ void __bch2_journal_debug_to_text(struct printbuf *out, struct journal *j)
 	prt_printf(out, "each entry reserved:\t%u\n",	j->entry_u64s_reserved);
 	prt_printf(out, "nr flush writes:\t%llu\n",		j->nr_flush_writes);
 	prt_printf(out, "nr noflush writes:\t%llu\n",	j->nr_noflush_writes);
+	prt_printf(out, "nr compressed writes:\t%llu\n",	j->nr_compressed_writes);
+	prt_printf(out, "compressed sectors saved:\t%llu\n", j->compressed_sectors_saved);
+	prt_printf(out, "flush req interval:\t%llu ns\n",	READ_ONCE(j->flush_req_interval));
+	prt_printf(out, "flush write latency:\t%llu ns\n",	READ_ONCE(j->flush_write_latency));
+	prt_printf(out, "group commit delay:\t%lu jiffies\n",	journal_group_commit_delay(j));
 	prt_printf(out, "nr direct reclaim:\t%llu\n",	j->nr_direct_reclaim);
 	prt_printf(out, "nr background reclaim:\t%llu\n",	j->nr_background_reclaim);
 	prt_printf(out, "reclaim kicked:\t\t%u\n",		j->reclaim_kicked);
@@ -6,6 +6,7 @@
 #include "btree_update_interior.h"
 #include "buckets.h"
 #include "checksum.h"
+#include "compress.h"
 #include "disk_groups.h"
 #include "error.h"
 #include "io.h"
@@ -813,6 +814,16 @@ static int jset_validate_early(struct bch_fs *c,
 	    sectors_read < bucket_sectors_left)
 		return JOURNAL_ENTRY_REREAD;
 
+	if (journal_entry_err_on(JSET_COMPRESSION_TYPE(jset) &&
+				 (JSET_COMPRESSION_TYPE(jset) >= BCH_COMPRESSION_TYPE_NR ||
+				  JSET_COMPRESSION_TYPE(jset) == BCH_COMPRESSION_TYPE_incompressible),
+				 c, jset, NULL,
+			"%s sector %llu seq %llu: journal entry with unknown compression type %llu",
+			ca ? ca->name : c->name,
+			sector, le64_to_cpu(jset->seq),
+			JSET_COMPRESSION_TYPE(jset)))
+		return JOURNAL_ENTRY_NONE;
+
 	if (journal_entry_err_on(bytes > bucket_sectors_left << 9,
 				 c, jset, NULL,
 			"%s sector %llu seq %llu: journal entry too big (%zu bytes)",
@@ -829,6 +840,52 @@ struct journal_read_buf {
 	size_t		size;
 };
 
+/*
+ * Returns a new, uncompressed copy of @j, or NULL if @j wasn't compressed:
+ */
+static struct jset *journal_entry_uncompress(struct bch_fs *c,
+					     struct bch_dev *ca,
+					     struct jset *j, u64 sector)
+{
+	struct jset_compressed *cj = (void *) j->start;
+	struct jset *n;
+	size_t u64s, src_bytes;
+	int ret;
+
+	if (!JSET_COMPRESSION_TYPE(j))
+		return NULL;
+
+	u64s		= le32_to_cpu(cj->u64s);
+	src_bytes	= le32_to_cpu(cj->bytes);
+
+	if (le32_to_cpu(j->u64s) * sizeof(u64) < sizeof(*cj) ||
+	    src_bytes > le32_to_cpu(j->u64s) * sizeof(u64) - sizeof(*cj) ||
+	    sizeof(*j) + u64s * sizeof(u64) > JOURNAL_ENTRY_SIZE_MAX)
+		goto err;
+
+	n = kvpmalloc(sizeof(*j) + u64s * sizeof(u64), GFP_KERNEL);
+	if (!n)
+		return ERR_PTR(-BCH_ERR_ENOMEM_journal_entry_uncompress);
+
+	*n = *j;
+	n->u64s = cpu_to_le32(u64s);
+	SET_JSET_COMPRESSION_TYPE(n, 0);
+
+	ret = bch2_uncompress_buf(c, n->_data, u64s * sizeof(u64),
+				  cj->data, src_bytes,
+				  JSET_COMPRESSION_TYPE(j));
+	if (ret) {
+		kvpfree(n, vstruct_bytes(n));
+		goto err;
+	}
+
+	return n;
+err:
+	bch_err(c, "%s sector %llu seq %llu: error decompressing journal entry",
+		ca->name, sector, le64_to_cpu(j->seq));
+	return ERR_PTR(-EIO);
+}
+
 static int journal_read_buf_realloc(struct journal_read_buf *b,
 				    size_t new_size)
 {
@@ -856,7 +913,7 @@ static int journal_read_bucket(struct bch_dev *ca,
 {
 	struct bch_fs *c = ca->fs;
 	struct journal_device *ja = &ca->journal;
-	struct jset *j = NULL;
+	struct jset *j = NULL, *uncompressed;
 	unsigned sectors, sectors_read = 0;
 	u64 offset = bucket_to_sector(ca, ja->buckets[bucket]),
 	    end = offset + ca->mi.bucket_size;
@@ -948,6 +1005,16 @@ reread:
 		bch2_fs_fatal_err_on(ret, c,
 				"error decrypting journal entry: %i", ret);
 
+		uncompressed = journal_entry_uncompress(c, ca, j, offset);
+		if (IS_ERR(uncompressed)) {
+			ret = PTR_ERR(uncompressed);
+			if (bch2_err_matches(ret, ENOMEM))
+				return ret;
+			/* Treat it like a checksum error: */
+			saw_bad = true;
+			goto next_block;
+		}
+
 		mutex_lock(&jlist->lock);
 		ret = journal_entry_add(c, ca, (struct journal_ptr) {
 					.csum_good	= csum_good,
@@ -955,10 +1022,14 @@ reread:
 					.bucket		= bucket,
 					.bucket_offset	= offset -
 						bucket_to_sector(ca, ja->buckets[bucket]),
+					.sectors	= sectors,
 					.sector		= offset,
-					}, jlist, j);
+					}, jlist, uncompressed ?: j);
 		mutex_unlock(&jlist->lock);
 
+		if (uncompressed)
+			kvpfree(uncompressed, vstruct_bytes(uncompressed));
+
 		switch (ret) {
 		case JOURNAL_ENTRY_ADD_OK:
 			break;
@@ -1018,7 +1089,7 @@ static void bch2_journal_read_device(struct closure *cl)
 		for (i = 0; i < r->nr_ptrs; i++) {
 			if (r->ptrs[i].dev == ca->dev_idx) {
 				unsigned wrote = bucket_remainder(ca, r->ptrs[i].sector) +
-					vstruct_sectors(&r->j, c->block_bits);
+					r->ptrs[i].sectors;
 
 				ja->cur_idx = r->ptrs[i].bucket;
 				ja->sectors_free = ca->mi.bucket_size - wrote;
@@ -1230,7 +1301,7 @@ int bch2_journal_read(struct bch_fs *c,
 
 			if (prev) {
 				bch2_journal_ptrs_to_text(&buf1, c, prev);
-				prt_printf(&buf1, " size %zu", vstruct_sectors(&prev->j, c->block_bits));
+				prt_printf(&buf1, " size %u", prev->ptrs[0].sectors);
 			} else
 				prt_printf(&buf1, "(none)");
 			bch2_journal_ptrs_to_text(&buf2, c, i);
@@ -1453,6 +1524,57 @@ static void journal_buf_realloc(struct journal *j, struct journal_buf *buf)
 	kvpfree(new_buf, new_size);
 }
 
+/*
+ * Compress the entries in @jset in place, if that saves at least one block on
+ * disk - must be done before encryption and checksumming:
+ */
+static void journal_write_compress(struct journal *j, struct jset *jset,
+				   unsigned compression_type)
+{
+	struct bch_fs *c = container_of(j, struct bch_fs, journal);
+	struct jset_compressed *cj = (void *) jset->start;
+	size_t src_len = vstruct_bytes(jset) - sizeof(*jset);
+	size_t blocks = DIV_ROUND_UP(vstruct_bytes(jset), block_bytes(c));
+	ssize_t dst_len = (ssize_t) ((blocks - 1) * block_bytes(c)) -
+		sizeof(*jset) - sizeof(*cj);
+	size_t bytes;
+
+	if (!compression_type || dst_len <= 0)
+		return;
+
+	dst_len = round_down(dst_len, sizeof(u64));
+
+	if (j->compress_buf_size < src_len) {
+		size_t new_size = roundup_pow_of_two(src_len);
+		void *n = kvpmalloc(new_size, GFP_NOIO|__GFP_NOWARN);
+
+		if (!n)
+			return;
+
+		kvpfree(j->compress_buf, j->compress_buf_size);
+		j->compress_buf		= n;
+		j->compress_buf_size	= new_size;
+	}
+
+	bytes = bch2_compress_buf(c, j->compress_buf, dst_len,
+				  jset->start, src_len, compression_type);
+	if (!bytes)
+		return;
+
+	cj->u64s	= jset->u64s;
+	cj->bytes	= cpu_to_le32(bytes);
+	memcpy(cj->data, j->compress_buf, bytes);
+	memset(cj->data + bytes, 0, round_up(bytes, sizeof(u64)) - bytes);
+
+	jset->u64s	= cpu_to_le32((sizeof(*cj) + round_up(bytes, sizeof(u64))) /
+				      sizeof(u64));
+	SET_JSET_COMPRESSION_TYPE(jset, compression_type);
+
+	j->nr_compressed_writes++;
+	j->compressed_sectors_saved += (blocks << c->block_bits) -
+		vstruct_sectors(jset, c->block_bits);
+}
+
 static inline struct journal_buf *journal_last_unwritten_buf(struct journal *j)
 {
 	return j->buf + (journal_last_unwritten_seq(j) & JOURNAL_BUF_MASK);
@@ -1472,6 +1594,9 @@ static void journal_write_done(struct closure *cl)
 			       ? j->flush_write_time
 			       : j->noflush_write_time, j->write_start_time);
 
+	if (!JSET_NO_FLUSH(w->data))
+		bch2_journal_flush_latency_acct(j, local_clock() - j->write_start_time);
+
 	if (!w->devs_written.nr) {
 		bch_err(c, "unable to write journal to sufficient devices");
 		err = -EIO;
@@ -1678,7 +1803,7 @@ void bch2_journal_write(struct closure *cl)
 	struct bio *bio;
 	struct printbuf journal_debug_buf = PRINTBUF;
 	bool validate_before_checksum = false;
-	unsigned i, sectors, bytes, u64s, nr_rw_members = 0;
+	unsigned i, sectors, bytes, u64s, nr_rw_members = 0, compression_type;
 	int ret;
 
 	BUG_ON(BCH_SB_CLEAN(c->disk_sb.sb));
@@ -1769,10 +1894,21 @@ void bch2_journal_write(struct closure *cl)
 	if (le32_to_cpu(jset->version) < bcachefs_metadata_version_current)
 		validate_before_checksum = true;
 
+	/*
+	 * entries can only be validated uncompressed - journal_compression can
+	 * change at runtime, so only read it once:
+	 */
+	compression_type =
+		bch2_compression_opt_to_type[READ_ONCE(c->opts.journal_compression)];
+	if (compression_type)
+		validate_before_checksum = true;
+
 	if (validate_before_checksum &&
 	    jset_validate(c, NULL, jset, 0, WRITE))
 		goto err;
 
+	journal_write_compress(j, jset, compression_type);
+
 	ret = bch2_encrypt(c, JSET_CSUM_TYPE(jset), journal_nonce(jset),
 		    jset->encrypted_start,
 		    vstruct_end(jset) - (void *) jset->encrypted_start);
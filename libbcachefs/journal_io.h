@@ -12,6 +12,8 @@ struct journal_replay {
 		u8		dev;
 		u32		bucket;
 		u32		bucket_offset;
+		/* size on disk - differs from vstruct_sectors() if compressed */
+		u32		sectors;
 		u64		sector;
 	}			ptrs[BCH_REPLICAS_MAX];
 	unsigned		nr_ptrs;
@@ -193,6 +193,14 @@ struct journal {
 	union journal_res_state reservations;
 	enum journal_watermark	watermark;
 
+	} __aligned(SMP_CACHE_BYTES);
+
+	/*
+	 * Prereservations are taken on every transaction commit just like
+	 * reservations are - don't make them fight over the same cacheline:
+	 */
+	struct {
+
 	union journal_preres_state prereserved;
 
 	} __aligned(SMP_CACHE_BYTES);
@@ -226,6 +234,10 @@ struct journal {
 	 */
 	struct journal_buf	buf[JOURNAL_BUF_NR];
 
+	/* Bounce buffer for compressing journal writes: */
+	void			*compress_buf;
+	size_t			compress_buf_size;
+
 	spinlock_t		lock;
 
 	/* if nonzero, we may not open a new journal entry: */
@@ -304,8 +316,18 @@ struct journal {
 	u64			res_get_blocked_start;
 	u64			write_start_time;
 
+	/*
+	 * For group commit: moving averages of the time between flush
+	 * requests, and of how long flush writes take, in nanoseconds:
+	 */
+	u64			flush_req_last;
+	u64			flush_req_interval;
+	u64			flush_write_latency;
+
 	u64			nr_flush_writes;
 	u64			nr_noflush_writes;
+	u64			nr_compressed_writes;
+	u64			compressed_sectors_saved;
 
 	struct bch2_time_stats	*flush_write_time;
 	struct bch2_time_stats	*noflush_write_time;
@@ -23,6 +23,7 @@
 
 #include <linux/ioprio.h>
 #include <linux/kthread.h>
+#include <linux/sort.h>
 
 #include <trace/events/bcachefs.h>
 
@@ -82,6 +83,8 @@ struct moving_io {
 
 	unsigned			read_sectors;
 	unsigned			write_sectors;
+	/* charged against the device of the bucket being evacuated: */
+	unsigned			dev_sectors;
 
 	struct bch_read_bio		rbio;
 
@@ -94,8 +97,11 @@ static void move_free(struct moving_io *io)
 {
 	struct moving_context *ctxt = io->write.ctxt;
 
-	if (io->b)
+	if (io->b) {
+		atomic_sub(io->dev_sectors,
+			   &ctxt->dev_sectors[io->b->bucket.k.bucket.inode]);
 		atomic_dec(&io->b->count);
+	}
 
 	bch2_data_update_exit(&io->write);
 
@@ -377,6 +383,9 @@ static int bch2_move_extent(struct btree_trans *trans,
 
 	if (bucket_in_flight) {
 		io->b = bucket_in_flight;
+		io->dev_sectors = k.k->size;
+		atomic_add(io->dev_sectors,
+			   &ctxt->dev_sectors[io->b->bucket.k.bucket.inode]);
 		atomic_inc(&io->b->count);
 	}
 
@@ -543,6 +552,7 @@ static int __bch2_move_data(struct moving_context *ctxt,
 
 	bch2_trans_iter_init(&trans, &iter, btree_id, start,
 			     BTREE_ITER_PREFETCH|
+			     BTREE_ITER_STREAMING|
 			     BTREE_ITER_ALL_SNAPSHOTS);
 
 	if (ctxt->rate)
@@ -655,11 +665,99 @@ int bch2_move_data(struct bch_fs *c,
 	return ret;
 }
 
+static int evacuate_bucket_bp(struct btree_trans *trans,
+			      struct moving_context *ctxt,
+			      struct move_bucket_in_flight *bucket_in_flight,
+			      struct bpos bucket,
+			      struct bpos bp_pos, struct bch_backpointer bp,
+			      struct data_update_opts _data_opts,
+			      struct bch_io_opts *io_opts, u64 *cur_inum,
+			      struct bkey_buf *sk)
+{
+	struct bch_fs *c = trans->c;
+	struct btree_iter iter;
+	struct data_update_opts data_opts;
+	int ret;
+
+	if (!bp.level) {
+		const struct bch_extent_ptr *ptr;
+		struct bkey_s_c k;
+		unsigned i = 0;
+
+		k = bch2_backpointer_get_key(trans, &iter, bp_pos, bp, 0);
+		ret = bkey_err(k);
+		if (ret)
+			return ret;
+		if (!k.k)
+			return 0;
+
+		bch2_bkey_buf_reassemble(sk, c, k);
+		k = bkey_i_to_s_c(sk->k);
+
+		ret = move_get_io_opts(trans, io_opts, k, cur_inum);
+		if (ret) {
+			bch2_trans_iter_exit(trans, &iter);
+			return ret;
+		}
+
+		data_opts = _data_opts;
+		data_opts.target	= io_opts->background_target;
+		data_opts.rewrite_ptrs = 0;
+
+		bkey_for_each_ptr(bch2_bkey_ptrs_c(k), ptr) {
+			if (ptr->dev == bucket.inode) {
+				data_opts.rewrite_ptrs |= 1U << i;
+				if (ptr->cached) {
+					bch2_trans_iter_exit(trans, &iter);
+					return 0;
+				}
+			}
+			i++;
+		}
+
+		ret = bch2_move_extent(trans, &iter, ctxt,
+				bucket_in_flight,
+				*io_opts, bp.btree_id, k, data_opts);
+		bch2_trans_iter_exit(trans, &iter);
+		if (ret)
+			return ret;
+
+		if (ctxt->rate)
+			bch2_ratelimit_increment(ctxt->rate, k.k->size);
+		if (ctxt->stats)
+			atomic64_add(k.k->size, &ctxt->stats->sectors_seen);
+	} else {
+		struct btree *b;
+
+		b = bch2_backpointer_get_node(trans, &iter, bp_pos, bp);
+		ret = PTR_ERR_OR_ZERO(b);
+		if (ret)
+			return ret;
+		if (!b)
+			return 0;
+
+		ret = bch2_btree_node_rewrite(trans, &iter, b, 0);
+		bch2_trans_iter_exit(trans, &iter);
+		if (ret)
+			return ret;
+
+		if (ctxt->rate)
+			bch2_ratelimit_increment(ctxt->rate,
+						 c->opts.btree_node_size >> 9);
+		if (ctxt->stats) {
+			atomic64_add(c->opts.btree_node_size >> 9, &ctxt->stats->sectors_seen);
+			atomic64_add(c->opts.btree_node_size >> 9, &ctxt->stats->sectors_moved);
+		}
+	}
+
+	return 0;
+}
+
 int __bch2_evacuate_bucket(struct btree_trans *trans,
 			   struct moving_context *ctxt,
 			   struct move_bucket_in_flight *bucket_in_flight,
 			   struct bpos bucket, int gen,
-			   struct data_update_opts _data_opts)
+			   struct data_update_opts data_opts)
 {
 	struct bch_fs *c = ctxt->c;
 	struct bch_io_opts io_opts = bch2_opts_to_inode_opts(c->opts);
@@ -669,7 +767,6 @@ int __bch2_evacuate_bucket(struct btree_trans *trans,
 	struct bch_alloc_v4 a_convert;
 	const struct bch_alloc_v4 *a;
 	struct bkey_s_c k;
-	struct data_update_opts data_opts;
 	unsigned dirty_sectors, bucket_size;
 	u64 fragmentation;
 	u64 cur_inum = U64_MAX;
@@ -720,99 +817,164 @@ int __bch2_evacuate_bucket(struct btree_trans *trans,
 		if (bkey_eq(bp_pos, POS_MAX))
 			break;
 
-		if (!bp.level) {
-			const struct bch_extent_ptr *ptr;
-			struct bkey_s_c k;
-			unsigned i = 0;
+		ret = evacuate_bucket_bp(trans, ctxt, bucket_in_flight, bucket,
+					 bp_pos, bp, data_opts,
+					 &io_opts, &cur_inum, &sk);
+		if (bch2_err_matches(ret, BCH_ERR_transaction_restart) ||
+		    ret == -BCH_ERR_backpointer_to_overwritten_btree_node)
+			continue;
+		if (ret == -ENOMEM) {
+			/* memory allocation failure, wait for some IO to finish */
+			bch2_move_ctxt_wait_for_io(ctxt, trans);
+			continue;
+		}
+		if (ret)
+			goto err;
 
-			k = bch2_backpointer_get_key(trans, &iter, bp_pos, bp, 0);
-			ret = bkey_err(k);
-			if (bch2_err_matches(ret, BCH_ERR_transaction_restart))
-				continue;
-			if (ret)
-				goto err;
-			if (!k.k)
-				goto next;
+		bp_pos = bpos_nosnap_successor(bp_pos);
+	}
 
-			bch2_bkey_buf_reassemble(&sk, c, k);
-			k = bkey_i_to_s_c(sk.k);
+	trace_evacuate_bucket(c, &bucket, dirty_sectors, bucket_size, fragmentation, ret);
+err:
+	bch2_bkey_buf_exit(&sk, c);
+	return ret;
+}
 
-			ret = move_get_io_opts(trans, &io_opts, k, &cur_inum);
-			if (ret) {
-				bch2_trans_iter_exit(trans, &iter);
-				continue;
-			}
+struct evacuate_bp {
+	struct move_bucket_in_flight	*b;
+	struct bpos			pos;
+	struct bch_backpointer		bp;
+};
 
-			data_opts = _data_opts;
-			data_opts.target	= io_opts.background_target;
-			data_opts.rewrite_ptrs = 0;
-
-			bkey_for_each_ptr(bch2_bkey_ptrs_c(k), ptr) {
-				if (ptr->dev == bucket.inode) {
-					data_opts.rewrite_ptrs |= 1U << i;
-					if (ptr->cached) {
-						bch2_trans_iter_exit(trans, &iter);
-						goto next;
-					}
-				}
-				i++;
-			}
+static int evacuate_bp_cmp(const void *_l, const void *_r)
+{
+	const struct evacuate_bp *l = _l, *r = _r;
 
-			ret = bch2_move_extent(trans, &iter, ctxt,
-					bucket_in_flight,
-					io_opts, bp.btree_id, k, data_opts);
-			bch2_trans_iter_exit(trans, &iter);
+	return  cmp_int(l->bp.level,	r->bp.level) ?:
+		cmp_int(l->bp.btree_id,	r->bp.btree_id) ?:
+		bpos_cmp(l->bp.pos,	r->bp.pos);
+}
+
+static inline bool evacuate_dev_has_budget(struct moving_context *ctxt,
+					   struct evacuate_bp *i)
+{
+	return atomic_read(&ctxt->dev_sectors[i->b->bucket.k.bucket.inode]) <
+		ctxt->c->opts.move_bytes_in_flight_per_dev >> 9;
+}
+
+/*
+ * Evacuate a batch of buckets at once: backpointers for every bucket are read
+ * up front and sorted, so that the extents and btree nodes they point to are
+ * looked up in key order, and moves from different buckets and devices are
+ * in flight at the same time - when a device hits its in flight limit we skip
+ * ahead to backpointers for other devices, instead of waiting:
+ */
+int bch2_evacuate_buckets(struct btree_trans *trans,
+			  struct moving_context *ctxt,
+			  struct move_bucket_in_flight **buckets,
+			  size_t nr,
+			  struct data_update_opts data_opts)
+{
+	struct bch_fs *c = ctxt->c;
+	struct bch_io_opts io_opts = bch2_opts_to_inode_opts(c->opts);
+	DARRAY(struct evacuate_bp) bps = { 0 };
+	struct evacuate_bp *i, *blocked;
+	struct bkey_buf sk;
+	u64 cur_inum = U64_MAX;
+	size_t b, nr_done = 0;
+	int ret = 0;
+
+	bch2_bkey_buf_init(&sk);
 
+	ret = bch2_btree_write_buffer_flush(trans);
+	if (ret) {
+		bch_err(c, "%s: error flushing btree write buffer: %s", __func__, bch2_err_str(ret));
+		goto err;
+	}
+
+	for (b = 0; b < nr; b++) {
+		struct bpos bucket = buckets[b]->bucket.k.bucket;
+		struct bpos bp_pos = POS_MIN;
+		struct bch_backpointer bp;
+
+		trace_bucket_evacuate(c, bucket);
+
+		while (1) {
+			bch2_trans_begin(trans);
+
+			ret = bch2_get_next_backpointer(trans, bucket,
+						buckets[b]->bucket.k.gen,
+						&bp_pos, &bp,
+						BTREE_ITER_CACHED);
 			if (bch2_err_matches(ret, BCH_ERR_transaction_restart))
 				continue;
-			if (ret == -ENOMEM) {
-				/* memory allocation failure, wait for some IO to finish */
-				bch2_move_ctxt_wait_for_io(ctxt, trans);
-				continue;
-			}
 			if (ret)
 				goto err;
+			if (bkey_eq(bp_pos, POS_MAX))
+				break;
 
-			if (ctxt->rate)
-				bch2_ratelimit_increment(ctxt->rate, k.k->size);
-			if (ctxt->stats)
-				atomic64_add(k.k->size, &ctxt->stats->sectors_seen);
-		} else {
-			struct btree *b;
+			ret = darray_push(&bps, ((struct evacuate_bp) {
+				.b	= buckets[b],
+				.pos	= bp_pos,
+				.bp	= bp,
+			}));
+			if (ret)
+				goto err;
 
-			b = bch2_backpointer_get_node(trans, &iter, bp_pos, bp);
-			ret = PTR_ERR_OR_ZERO(b);
-			if (ret == -BCH_ERR_backpointer_to_overwritten_btree_node)
+			bp_pos = bpos_nosnap_successor(bp_pos);
+		}
+	}
+
+	sort(bps.data, bps.nr, sizeof(bps.data[0]), evacuate_bp_cmp, NULL);
+
+	while (nr_done < bps.nr) {
+		blocked = NULL;
+
+		darray_for_each(bps, i) {
+			if (!i->b)
 				continue;
-			if (bch2_err_matches(ret, BCH_ERR_transaction_restart))
+
+			if (!evacuate_dev_has_budget(ctxt, i)) {
+				blocked = blocked ?: i;
 				continue;
+			}
+
+			ret = move_ratelimit(trans, ctxt);
 			if (ret)
 				goto err;
-			if (!b)
-				goto next;
 
-			ret = bch2_btree_node_rewrite(trans, &iter, b, 0);
-			bch2_trans_iter_exit(trans, &iter);
+			while (1) {
+				bch2_trans_begin(trans);
+
+				ret = evacuate_bucket_bp(trans, ctxt, i->b,
+							 i->b->bucket.k.bucket,
+							 i->pos, i->bp, data_opts,
+							 &io_opts, &cur_inum, &sk);
+				if (bch2_err_matches(ret, BCH_ERR_transaction_restart))
+					continue;
+				if (ret == -ENOMEM) {
+					bch2_move_ctxt_wait_for_io(ctxt, trans);
+					continue;
+				}
+				break;
+			}
 
-			if (bch2_err_matches(ret, BCH_ERR_transaction_restart))
-				continue;
+			/* btree node was rewritten since we read the backpointer: */
+			if (ret == -BCH_ERR_backpointer_to_overwritten_btree_node)
+				ret = 0;
 			if (ret)
 				goto err;
 
-			if (ctxt->rate)
-				bch2_ratelimit_increment(ctxt->rate,
-							 c->opts.btree_node_size >> 9);
-			if (ctxt->stats) {
-				atomic64_add(c->opts.btree_node_size >> 9, &ctxt->stats->sectors_seen);
-				atomic64_add(c->opts.btree_node_size >> 9, &ctxt->stats->sectors_moved);
-			}
+			i->b = NULL;
+			nr_done++;
 		}
-next:
-		bp_pos = bpos_nosnap_successor(bp_pos);
-	}
 
-	trace_evacuate_bucket(c, &bucket, dirty_sectors, bucket_size, fragmentation, ret);
+		if (blocked)
+			move_ctxt_wait_event(ctxt, trans,
+				evacuate_dev_has_budget(ctxt, blocked));
+	}
 err:
+	darray_exit(&bps);
 	bch2_bkey_buf_exit(&sk, c);
 	return ret;
 }
@@ -868,7 +1030,8 @@ static int bch2_move_btree(struct bch_fs *c,
 		stats->btree_id = id;
 
 		bch2_trans_node_iter_init(&trans, &iter, id, POS_MIN, 0, 0,
-					  BTREE_ITER_PREFETCH);
+					  BTREE_ITER_PREFETCH|
+					  BTREE_ITER_STREAMING);
 retry:
 		ret = 0;
 		while (bch2_trans_begin(&trans),
@@ -1057,7 +1220,8 @@ int bch2_data_job(struct bch_fs *c,
 				     op.end_btree,	op.end_pos,
 				     NULL,
 				     stats,
-				     writepoint_hashed((unsigned long) current),
+				     writepoint_hashed_temp((unsigned long) current,
+							    BCH_DATA_TEMP_cold),
 				     true,
 				     rereplicate_pred, c) ?: ret;
 		ret = bch2_replicas_gc2(c) ?: ret;
@@ -1081,7 +1245,8 @@ int bch2_data_job(struct bch_fs *c,
 				     op.end_btree,	op.end_pos,
 				     NULL,
 				     stats,
-				     writepoint_hashed((unsigned long) current),
+				     writepoint_hashed_temp((unsigned long) current,
+							    BCH_DATA_TEMP_cold),
 				     true,
 				     migrate_pred, &op) ?: ret;
 		ret = bch2_replicas_gc2(c) ?: ret;
@@ -33,6 +33,9 @@ struct moving_context {
 	atomic_t		read_ios;
 	atomic_t		write_ios;
 
+	/* sectors in flight evacuating buckets, per device: */
+	atomic_t		dev_sectors[BCH_SB_MEMBERS_MAX];
+
 	wait_queue_head_t	wait;
 };
 
@@ -77,6 +80,10 @@ int __bch2_evacuate_bucket(struct btree_trans *,
 			   struct move_bucket_in_flight *,
 			   struct bpos, int,
 			   struct data_update_opts);
+int bch2_evacuate_buckets(struct btree_trans *,
+			  struct moving_context *,
+			  struct move_bucket_in_flight **, size_t,
+			  struct data_update_opts);
 int bch2_evacuate_bucket(struct bch_fs *, struct bpos, int,
 			 struct data_update_opts,
 			 struct bch_ratelimit *,
@@ -78,7 +78,8 @@ move_bucket_in_flight_add(struct buckets_in_flight *list, struct move_bucket b)
 }
 
 static int bch2_bucket_is_movable(struct btree_trans *trans,
-				  struct move_bucket *b, u64 time)
+				  struct move_bucket *b, u64 time,
+				  u64 *io_time)
 {
 	struct btree_iter iter;
 	struct bkey_s_c k;
@@ -103,6 +104,7 @@ static int bch2_bucket_is_movable(struct btree_trans *trans,
 	a = bch2_alloc_to_v4(k, &_a);
 	b->k.gen	= a->gen;
 	b->sectors	= a->dirty_sectors;
+	*io_time	= a->io_time[WRITE];
 
 	ret = data_type_movable(a->data_type) &&
 		a->fragmentation_lru &&
@@ -158,6 +160,66 @@ static bool bucket_in_flight(struct buckets_in_flight *list,
 
 typedef DARRAY(struct move_bucket) move_buckets;
 
+struct copygc_candidate {
+	struct move_bucket	b;
+	u64			score;
+};
+
+typedef DARRAY(struct copygc_candidate) copygc_candidates;
+
+/*
+ * With the cost-benefit policies, we look at this many times more buckets (in
+ * fragmentation LRU order, i.e. emptiest first) than we're going to move, and
+ * pick the best of them:
+ */
+#define COPYGC_CANDIDATES_SCAN		4
+#define COPYGC_AGE_MAX			(1ULL << 32)
+#define COPYGC_DEV_WEIGHT_MAX		(1U << 12)
+
+/*
+ * LFS style cost-benefit: free space reclaimed, times the age of the data
+ * (older data is less likely to be overwritten soon, so is worth compacting
+ * now), over the cost of reading and rewriting the live data:
+ */
+static u64 copygc_bucket_score(struct bch_dev *ca, unsigned sectors,
+			       u64 io_time, u64 now)
+{
+	u64 size = ca->mi.bucket_size;
+	u64 live = min_t(u64, sectors, size);
+	u64 age	 = min(now - min(now, io_time), COPYGC_AGE_MAX);
+
+	return div64_u64((size - live) * (age + 1), size + live);
+}
+
+/*
+ * For BCH_COPYGC_POLICY_device_pressure: weight devices by how close they are
+ * to running out of free buckets:
+ */
+static void copygc_dev_weights(struct bch_fs *c, u32 *weights)
+{
+	struct bch_dev *ca;
+	unsigned i;
+
+	for (i = 0; i < BCH_SB_MEMBERS_MAX; i++)
+		weights[i] = 1;
+
+	for_each_rw_member(ca, c, i) {
+		u64 avail = __dev_buckets_available(ca, bch2_dev_usage_read(ca),
+						    RESERVE_none);
+
+		weights[ca->dev_idx] = clamp_t(u64,
+			div64_u64(ca->mi.nbuckets - ca->mi.first_bucket, avail + 1),
+			1, COPYGC_DEV_WEIGHT_MAX);
+	}
+}
+
+static int copygc_candidate_cmp(const void *_l, const void *_r)
+{
+	const struct copygc_candidate *l = _l, *r = _r;
+
+	return cmp_int(r->score, l->score);
+}
+
 static int bch2_copygc_get_buckets(struct btree_trans *trans,
 			struct moving_context *ctxt,
 			struct buckets_in_flight *buckets_in_flight,
@@ -166,10 +228,21 @@ static int bch2_copygc_get_buckets(struct btree_trans *trans,
 	struct bch_fs *c = trans->c;
 	struct btree_iter iter;
 	struct bkey_s_c k;
+	enum bch_copygc_policy policy = c->opts.copygc_policy;
+	copygc_candidates candidates = { 0 };
+	struct copygc_candidate *i;
+	u32 dev_weights[BCH_SB_MEMBERS_MAX];
+	u64 now = atomic64_read(&c->io_clock[WRITE].now);
 	size_t nr_to_get = max(16UL, buckets_in_flight->nr / 4);
+	size_t nr_to_scan = policy == BCH_COPYGC_POLICY_greedy
+		? nr_to_get
+		: nr_to_get * COPYGC_CANDIDATES_SCAN;
 	size_t saw = 0, in_flight = 0, not_movable = 0, sectors = 0;
 	int ret;
 
+	if (policy == BCH_COPYGC_POLICY_device_pressure)
+		copygc_dev_weights(c, dev_weights);
+
 	move_buckets_wait(trans, ctxt, buckets_in_flight, false);
 
 	ret = bch2_btree_write_buffer_flush(trans);
@@ -181,23 +254,49 @@ static int bch2_copygc_get_buckets(struct btree_trans *trans,
 				  lru_pos(BCH_LRU_FRAGMENTATION_START, 0, 0),
 				  lru_pos(BCH_LRU_FRAGMENTATION_START, U64_MAX, LRU_TIME_MAX),
 				  0, k, ({
-		struct move_bucket b = { .k.bucket = u64_to_bucket(k.k->p.offset) };
+		struct copygc_candidate n = {
+			.b.k.bucket = u64_to_bucket(k.k->p.offset),
+		};
+		u64 io_time = 0;
 		int ret = 0;
 
 		saw++;
 
-		if (!bch2_bucket_is_movable(trans, &b, lru_pos_time(k.k->p)))
+		if (!bch2_bucket_is_movable(trans, &n.b, lru_pos_time(k.k->p), &io_time))
 			not_movable++;
-		else if (bucket_in_flight(buckets_in_flight, b.k))
+		else if (bucket_in_flight(buckets_in_flight, n.b.k))
 			in_flight++;
 		else {
-			ret = darray_push(buckets, b) ?: buckets->nr >= nr_to_get;
-			if (ret >= 0)
-				sectors += b.sectors;
+			if (policy != BCH_COPYGC_POLICY_greedy)
+				n.score = copygc_bucket_score(bch_dev_bkey_exists(c, n.b.k.bucket.inode),
+							      n.b.sectors, io_time, now);
+			if (policy == BCH_COPYGC_POLICY_device_pressure)
+				n.score *= dev_weights[n.b.k.bucket.inode];
+
+			ret = darray_push(&candidates, n) ?: candidates.nr >= nr_to_scan;
 		}
 		ret;
 	}));
 
+	if (policy != BCH_COPYGC_POLICY_greedy)
+		sort(candidates.data, candidates.nr, sizeof(candidates.data[0]),
+		     copygc_candidate_cmp, NULL);
+
+	darray_for_each(candidates, i) {
+		int ret2;
+
+		if (buckets->nr >= nr_to_get)
+			break;
+
+		ret2 = darray_push(buckets, i->b);
+		if (ret2) {
+			ret = ret2;
+			break;
+		}
+		sectors += i->b.sectors;
+	}
+	darray_exit(&candidates);
+
 	pr_debug("have: %zu (%zu) saw %zu in flight %zu not movable %zu got %zu (%zu)/%zu buckets ret %i",
 		 buckets_in_flight->nr, buckets_in_flight->sectors,
 		 saw, in_flight, not_movable, buckets->nr, sectors, nr_to_get, ret);
@@ -214,6 +313,7 @@ static int bch2_copygc(struct btree_trans *trans,
 		.btree_insert_flags = BTREE_INSERT_USE_RESERVE|JOURNAL_WATERMARK_copygc,
 	};
 	move_buckets buckets = { 0 };
+	DARRAY(struct move_bucket_in_flight *) to_evacuate = { 0 };
 	struct move_bucket_in_flight *f;
 	struct move_bucket *i;
 	u64 moved = atomic64_read(&ctxt->stats->sectors_moved);
@@ -235,13 +335,21 @@ static int bch2_copygc(struct btree_trans *trans,
 			ret = 0;
 			break;
 		}
-
-		ret = __bch2_evacuate_bucket(trans, ctxt, f, f->bucket.k.bucket,
-					     f->bucket.k.gen, data_opts);
 		if (ret)
 			goto err;
+
+		ret = darray_push(&to_evacuate, f);
+		if (ret) {
+			/* bucket is on the in flight list with nothing in flight: */
+			ret = 0;
+			break;
+		}
 	}
+
+	ret = bch2_evacuate_buckets(trans, ctxt, to_evacuate.data,
+				    to_evacuate.nr, data_opts);
 err:
+	darray_exit(&to_evacuate);
 	darray_exit(&buckets);
 
 	/* no entries in LRU btree found, or got to end: */
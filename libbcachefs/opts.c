@@ -87,6 +87,11 @@ const char * const bch2_fs_usage_types[] = {
 	NULL
 };
 
+const char * const bch2_copygc_policies[] = {
+	BCH_COPYGC_POLICIES()
+	NULL
+};
+
 #undef x
 
 const char * const bch2_d_types[BCH_DT_MAX] = {
@@ -360,6 +365,16 @@ int bch2_opt_check_may_set(struct bch_fs *c, int id, u64 v)
 	case Opt_background_compression:
 		ret = bch2_check_set_has_compressed_data(c, v);
 		break;
+	case Opt_journal_compression:
+		ret = bch2_check_set_has_compressed_data(c, v);
+		if (!ret && v)
+			bch2_check_set_feature(c, BCH_FEATURE_journal_compression);
+		break;
+	case Opt_btree_node_compression:
+		ret = bch2_check_set_has_compressed_data(c, v);
+		if (!ret && v)
+			bch2_check_set_feature(c, BCH_FEATURE_btree_node_compression);
+		break;
 	case Opt_erasure_code:
 		if (v)
 			bch2_check_set_feature(c, BCH_FEATURE_ec);
@@ -24,12 +24,34 @@ extern const char * const bch2_member_states[];
 extern const char * const bch2_jset_entry_types[];
 extern const char * const bch2_fs_usage_types[];
 extern const char * const bch2_d_types[];
+extern const char * const bch2_copygc_policies[];
 
 static inline const char *bch2_d_type_str(unsigned d_type)
 {
 	return (d_type < BCH_DT_MAX ? bch2_d_types[d_type] : NULL) ?: "(bad d_type)";
 }
 
+/*
+ * How copygc picks buckets to evacuate:
+ *
+ * greedy:		emptiest buckets first
+ * cost_benefit:	weigh free space reclaimed against live data moved and
+ *			bucket age, as in LFS
+ * device_pressure:	cost_benefit, biased towards the devices with the least
+ *			free space
+ */
+#define BCH_COPYGC_POLICIES()			\
+	x(greedy,			0)	\
+	x(cost_benefit,			1)	\
+	x(device_pressure,		2)
+
+enum bch_copygc_policy {
+#define x(t, n) BCH_COPYGC_POLICY_##t = n,
+	BCH_COPYGC_POLICIES()
+#undef x
+	BCH_COPYGC_POLICY_NR
+};
+
 /*
  * Mount options; we also store defaults in the superblock.
  *
@@ -212,6 +234,35 @@ enum opt_type {
 	  OPT_BOOL(),							\
 	  BCH2_NO_SB_OPT,		true,				\
 	  NULL,		"Stash pointer to in memory btree node in btree ptr")\
+	x(btree_lockless_lookup,	u8,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_BOOL(),							\
+	  BCH2_NO_SB_OPT,		false,				\
+	  NULL,		"Walk interior btree nodes without locking them for lookups")\
+	x(btree_adaptive_pcpu_readers,	u8,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_BOOL(),							\
+	  BCH2_NO_SB_OPT,		true,				\
+	  NULL,		"Pick percpu or atomic reader counts for interior btree node locks from lock traffic")\
+	x(btree_node_compression,	u8,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_STR(bch2_compression_opts),				\
+	  BCH2_NO_SB_OPT,		BCH_COMPRESSION_OPT_none,	\
+	  NULL,		"Compress btree node writes")			\
+	x(btree_node_lazy_validate,	u8,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_BOOL(),							\
+	  BCH2_NO_SB_OPT,		false,				\
+	  NULL,		"Skip key validation when reading checksummed btree\n"\
+			"nodes written by the current version - keys are\n"\
+			"validated before being written; see trigger_btree_scrub")\
+	x(btree_write_queue_depth,	u32,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(0, 1024),						\
+	  BCH2_NO_SB_OPT,		0,				\
+	  NULL,		"Max btree node writes in flight per device; more\n"\
+			"are queued and issued in device offset order.\n"\
+			"0 = auto (unlimited for non-rotational devices)")\
 	x(btree_write_buffer_size, u32,					\
 	  OPT_FS|OPT_MOUNT,						\
 	  OPT_UINT(16, (1U << 20) - 1),					\
@@ -229,6 +280,11 @@ enum opt_type {
 	  BCH_SB_GC_RESERVE_BYTES,	0,				\
 	  "%",		"Amount of disk space to reserve for copygc\n"	\
 			"Takes precedence over gc_reserve_percent if set")\
+	x(copygc_policy,		u8,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_STR(bch2_copygc_policies),				\
+	  BCH2_NO_SB_OPT,		BCH_COPYGC_POLICY_cost_benefit,	\
+	  NULL,		"How copygc selects buckets to evacuate")	\
 	x(root_reserve_percent,		u8,				\
 	  OPT_FS|OPT_FORMAT|OPT_MOUNT,					\
 	  OPT_UINT(0, 100),						\
@@ -279,6 +335,17 @@ enum opt_type {
 	  OPT_BOOL(),							\
 	  BCH2_NO_SB_OPT,		true,				\
 	  NULL,		"Enable discard/TRIM support")			\
+	x(discard_max_inflight,		u32,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(1, 1024),						\
+	  BCH2_NO_SB_OPT,		16,				\
+	  NULL,		"Maximum number of discards in flight at once")	\
+	x(discard_max_rate,		u64,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME|OPT_HUMAN_READABLE,		\
+	  OPT_UINT(0, U64_MAX),						\
+	  BCH2_NO_SB_OPT,		0,				\
+	  NULL,		"Maximum rate at which to discard buckets, in bytes/sec\n"\
+			"0 for no limit")				\
 	x(verbose,			u8,				\
 	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
 	  OPT_BOOL(),							\
@@ -289,6 +356,11 @@ enum opt_type {
 	  OPT_UINT(1, U32_MAX),						\
 	  BCH_SB_JOURNAL_FLUSH_DELAY,	1000,				\
 	  NULL,		"Delay in milliseconds before automatic journal commits")\
+	x(journal_compression,		u8,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_STR(bch2_compression_opts),				\
+	  BCH2_NO_SB_OPT,		BCH_COMPRESSION_OPT_none,	\
+	  NULL,		"Compress journal entries")			\
 	x(journal_flush_disabled,	u8,				\
 	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
 	  OPT_BOOL(),							\
@@ -311,6 +383,12 @@ enum opt_type {
 	  OPT_UINT(1, 1024),						\
 	  BCH2_NO_SB_OPT,		32,				\
 	  NULL,		"Maximum number of IOs to keep in flight by the move path")\
+	x(move_bytes_in_flight_per_dev,	u32,				\
+	  OPT_HUMAN_READABLE|OPT_FS|OPT_MOUNT|OPT_RUNTIME,		\
+	  OPT_UINT(1024, U32_MAX),					\
+	  BCH2_NO_SB_OPT,		1U << 19,			\
+	  NULL,		"Maximum amount of IO to keep in flight per device\n"\
+			"when evacuating buckets (copygc)")		\
 	x(fsck,				u8,				\
 	  OPT_FS|OPT_MOUNT,						\
 	  OPT_BOOL(),							\
@@ -327,6 +327,7 @@ static int replicas_table_update(struct bch_fs *c,
 	swap(c->usage_scratch,	new_scratch);
 	swap(c->usage_gc,	new_gc);
 	swap(c->replicas,	*new_r);
+	c->replicas_gen++;
 out:
 	free_percpu(new_gc);
 	kfree(new_scratch);
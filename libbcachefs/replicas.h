@@ -30,7 +30,8 @@ int bch2_mark_replicas(struct bch_fs *,
 static inline struct replicas_delta *
 replicas_delta_next(struct replicas_delta *d)
 {
-	return (void *) d + replicas_entry_bytes(&d->r) + 8;
+	return (void *) d + replicas_entry_bytes(&d->r) +
+		offsetof(struct replicas_delta, r);
 }
 
 int bch2_replicas_delta_list_mark(struct bch_fs *, struct replicas_delta_list *);
@@ -10,12 +10,15 @@ struct bch_replicas_cpu {
 
 struct replicas_delta {
 	s64			delta;
+	/* index into c->replicas, valid if replicas_delta_list.replicas_gen is current */
+	s32			idx;
 	struct bch_replicas_entry r;
 } __packed;
 
 struct replicas_delta_list {
 	unsigned		size;
 	unsigned		used;
+	unsigned		replicas_gen;
 
 	struct			{} memset_start;
 	u64			nr_inodes;
@@ -484,6 +484,8 @@ static void __bch2_fs_free(struct bch_fs *c)
 	free_percpu(c->btree_paths_bufs);
 	free_percpu(c->pcpu);
 	mempool_exit(&c->large_bkey_pool);
+	/* btree node buffers may still be waiting to be freed via RCU: */
+	rcu_barrier();
 	mempool_exit(&c->btree_bounce_pool);
 	bioset_exit(&c->btree_bio);
 	mempool_exit(&c->fill_iter);
@@ -491,6 +493,7 @@ static void __bch2_fs_free(struct bch_fs *c)
 	percpu_ref_exit(&c->writes);
 #endif
 	kfree(rcu_dereference_protected(c->disk_groups, 1));
+	kfree(rcu_dereference_protected(c->usage_snapshot, 1));
 	kfree(c->journal_seq_blacklist_table);
 	kfree(c->unused_inode_hints);
 
@@ -504,6 +507,10 @@ static void __bch2_fs_free(struct bch_fs *c)
 		destroy_workqueue(c->btree_io_complete_wq);
 	if (c->btree_update_wq)
 		destroy_workqueue(c->btree_update_wq);
+	if (c->btree_write_buffer_flush_wq)
+		destroy_workqueue(c->btree_write_buffer_flush_wq);
+	if (c->btree_write_buffer_wq)
+		destroy_workqueue(c->btree_write_buffer_wq);
 
 	bch2_free_super(&c->disk_sb);
 	kvpfree(c, sizeof(*c));
@@ -691,6 +698,7 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 	INIT_LIST_HEAD(&c->list);
 
 	mutex_init(&c->usage_scratch_lock);
+	mutex_init(&c->usage_snapshot_lock);
 
 	mutex_init(&c->bio_bounce_pages_lock);
 	mutex_init(&c->snapshot_table_lock);
@@ -791,6 +799,10 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 				WQ_FREEZABLE|WQ_HIGHPRI|WQ_MEM_RECLAIM, 1)) ||
 	    !(c->write_ref_wq = alloc_workqueue("bcachefs_write_ref",
 				WQ_FREEZABLE, 0)) ||
+	    !(c->btree_write_buffer_wq = alloc_workqueue("bcachefs_write_buffer",
+				WQ_FREEZABLE|WQ_UNBOUND|WQ_MEM_RECLAIM, 1)) ||
+	    !(c->btree_write_buffer_flush_wq = alloc_workqueue("bcachefs_write_buffer_flush",
+				WQ_FREEZABLE|WQ_UNBOUND|WQ_MEM_RECLAIM, 0)) ||
 #ifndef BCH_WRITE_REF_DEBUG
 	    percpu_ref_init(&c->writes, bch2_writes_disabled,
 			    PERCPU_REF_INIT_DEAD, GFP_KERNEL) ||
@@ -1017,6 +1029,7 @@ static void bch2_dev_release(struct kobject *kobj)
 static void bch2_dev_free(struct bch_dev *ca)
 {
 	cancel_work_sync(&ca->io_error_work);
+	bch2_dev_btree_write_queue_exit(ca);
 
 	if (ca->kobj.state_in_sysfs &&
 	    ca->disk_sb.bdev)
@@ -1029,6 +1042,7 @@ static void bch2_dev_free(struct bch_dev *ca)
 	bch2_dev_journal_exit(ca);
 
 	free_percpu(ca->io_done);
+	bch2_dev_bucket_alloc_cache_exit(ca);
 	bioset_exit(&ca->replica_set);
 	bch2_dev_buckets_free(ca);
 	free_page((unsigned long) ca->sb_read_scratch);
@@ -1139,9 +1153,11 @@ static struct bch_dev *__bch2_dev_alloc(struct bch_fs *c,
 			    PERCPU_REF_INIT_DEAD, GFP_KERNEL) ||
 	    !(ca->sb_read_scratch = (void *) __get_free_page(GFP_KERNEL)) ||
 	    bch2_dev_buckets_alloc(c, ca) ||
+	    bch2_dev_btree_write_queue_init(ca) ||
 	    bioset_init(&ca->replica_set, 4,
 			offsetof(struct bch_write_bio, bio), 0) ||
-	    !(ca->io_done	= alloc_percpu(*ca->io_done)))
+	    !(ca->io_done	= alloc_percpu(*ca->io_done)) ||
+	    bch2_dev_bucket_alloc_cache_init(ca))
 		goto err;
 
 	return ca;
@@ -166,6 +166,7 @@ do {									\
 write_attribute(trigger_gc);
 write_attribute(trigger_discards);
 write_attribute(trigger_invalidates);
+write_attribute(trigger_btree_scrub);
 write_attribute(prune_cache);
 write_attribute(btree_wakeup);
 rw_attribute(btree_gc_periodic);
@@ -547,6 +548,9 @@ STORE(bch2_fs)
 	if (attr == &sysfs_trigger_invalidates)
 		bch2_do_invalidates(c);
 
+	if (attr == &sysfs_trigger_btree_scrub)
+		bch2_btree_scrub(c);
+
 #ifdef CONFIG_BCACHEFS_TESTS
 	if (attr == &sysfs_perf_test) {
 		char *tmp = kstrdup(buf, GFP_KERNEL), *p = tmp;
@@ -665,6 +669,7 @@ struct attribute *bch2_fs_internal_files[] = {
 	&sysfs_trigger_gc,
 	&sysfs_trigger_discards,
 	&sysfs_trigger_invalidates,
+	&sysfs_trigger_btree_scrub,
 	&sysfs_prune_cache,
 	&sysfs_btree_wakeup,
 
@@ -867,6 +872,11 @@ static void dev_alloc_debug_to_text(struct printbuf *out, struct bch_dev *ca)
 	prt_u64(out, OPEN_BUCKETS_COUNT - c->open_buckets_nr_free);
 	prt_newline(out);
 
+	prt_str(out, "open buckets cached");
+	prt_tab(out);
+	prt_u64(out, atomic_read(&c->open_buckets_cached));
+	prt_newline(out);
+
 	prt_str(out, "open buckets this dev");
 	prt_tab(out);
 	prt_u64(out, ca->nr_open_buckets);
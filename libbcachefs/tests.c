@@ -3,6 +3,7 @@
 
 #include "bcachefs.h"
 #include "btree_update.h"
+#include "journal.h"
 #include "journal_reclaim.h"
 #include "subvolume.h"
 #include "tests.h"
@@ -603,6 +604,89 @@ static int rand_insert(struct bch_fs *c, u64 nr)
 	return ret;
 }
 
+static int bset_search_check(struct bch_fs *c, struct btree *b,
+			     struct bpos search)
+{
+	struct btree_node_iter iter, linear;
+	struct bkey_packed *k, *k_linear;
+
+	bch2_btree_node_iter_init(&iter, b, &search);
+
+	bch2_btree_node_iter_init_from_start(&linear, b);
+	while ((k_linear = bch2_btree_node_iter_peek(&linear, b)) &&
+	       bkey_iter_pos_cmp(b, k_linear, &search) < 0)
+		bch2_btree_node_iter_advance(&linear, b);
+
+	k = bch2_btree_node_iter_peek(&iter, b);
+	if (k != k_linear) {
+		bch_err(c, "%s(): search for %llu:%llu:%u returned key at %u, linear search %u",
+			__func__, search.inode, search.offset, search.snapshot,
+			k ? __btree_node_key_to_offset(b, k) : 0,
+			k_linear ? __btree_node_key_to_offset(b, k_linear) : 0);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Check lookups within each leaf node against a linear scan of the node: nodes
+ * of varying sizes exercise every shape of read only aux search tree, including
+ * the ones where the two level descent in bset_search_tree() overshoots:
+ */
+static int test_bset_search(struct bch_fs *c, u64 nr)
+{
+	struct btree_trans trans;
+	struct btree_iter iter;
+	struct btree *b;
+	u64 nr_ro_trees = 0, nr_searches = 0;
+	int ret;
+
+	ret = rand_insert(c, nr);
+	if (ret)
+		return ret;
+
+	/* write out dirty nodes, so that their older bsets get ro aux trees: */
+	bch2_journal_flush_all_pins(&c->journal);
+
+	bch2_trans_init(&trans, c, 0, 0);
+
+	for_each_btree_node(&trans, iter, BTREE_ID_xattrs, POS_MIN, 0, b, ret) {
+		struct btree_node_iter node_iter;
+		struct bset_tree *t;
+		struct bkey_packed *k;
+
+		for_each_bset(b, t)
+			nr_ro_trees += bset_has_ro_aux_tree(t);
+
+		ret = bset_search_check(c, b, b->data->min_key);
+		if (ret)
+			break;
+
+		for_each_btree_node_key(b, k, &node_iter) {
+			struct bpos pos = bkey_unpack_pos(b, k);
+
+			ret = bset_search_check(c, b, pos) ?:
+				(bpos_lt(pos, b->data->max_key)
+				 ? bset_search_check(c, b, bpos_successor(pos))
+				 : 0);
+			if (ret)
+				break;
+
+			nr_searches += 2;
+		}
+
+		if (ret)
+			break;
+	}
+	bch2_trans_iter_exit(&trans, &iter);
+
+	bch2_trans_exit(&trans);
+
+	pr_info("checked %llu searches, %llu ro aux trees", nr_searches, nr_ro_trees);
+	return ret;
+}
+
 static int rand_insert_multi(struct bch_fs *c, u64 nr)
 {
 	struct btree_trans trans;
@@ -639,7 +723,7 @@ static int rand_insert_multi(struct bch_fs *c, u64 nr)
 	return ret;
 }
 
-static int rand_lookup(struct bch_fs *c, u64 nr)
+static int __rand_lookup(struct bch_fs *c, u64 nr, unsigned flags)
 {
 	struct btree_trans trans;
 	struct btree_iter iter;
@@ -649,7 +733,7 @@ static int rand_lookup(struct bch_fs *c, u64 nr)
 
 	bch2_trans_init(&trans, c, 0, 0);
 	bch2_trans_iter_init(&trans, &iter, BTREE_ID_xattrs,
-			     SPOS(0, 0, U32_MAX), 0);
+			     SPOS(0, 0, U32_MAX), flags);
 
 	for (i = 0; i < nr; i++) {
 		bch2_btree_iter_set_pos(&iter, SPOS(0, test_rand(), U32_MAX));
@@ -667,6 +751,20 @@ static int rand_lookup(struct bch_fs *c, u64 nr)
 	return ret;
 }
 
+static int rand_lookup(struct bch_fs *c, u64 nr)
+{
+	return __rand_lookup(c, nr, 0);
+}
+
+/*
+ * Same as rand_lookup, but walking interior nodes without locks - compare the
+ * two with nr_threads > 1 to see how lookups scale:
+ */
+static int rand_lookup_lockless(struct bch_fs *c, u64 nr)
+{
+	return __rand_lookup(c, nr, BTREE_ITER_LOCKLESS);
+}
+
 static int rand_mixed_trans(struct btree_trans *trans,
 			    struct btree_iter *iter,
 			    struct bkey_i_cookie *cookie,
@@ -853,6 +951,29 @@ static int seq_delete(struct bch_fs *c, u64 nr)
 	return ret;
 }
 
+/*
+ * Journal reservations only, no btree updates: for measuring contention on
+ * the journal reservation fastpath as the number of threads increases
+ */
+static int journal_res_get(struct bch_fs *c, u64 nr)
+{
+	struct journal_res res = { 0 };
+	int ret = 0;
+	u64 i;
+
+	for (i = 0; i < nr; i++) {
+		ret = bch2_journal_res_get(&c->journal, &res, jset_u64s(0), 0);
+		if (ret) {
+			bch_err(c, "%s(): error %s", __func__, bch2_err_str(ret));
+			break;
+		}
+
+		bch2_journal_res_put(&c->journal, &res);
+	}
+
+	return ret;
+}
+
 typedef int (*perf_test_fn)(struct bch_fs *, u64);
 
 struct test_job {
@@ -920,6 +1041,7 @@ int bch2_btree_perf_test(struct bch_fs *c, const char *testname,
 	perf_test(rand_insert);
 	perf_test(rand_insert_multi);
 	perf_test(rand_lookup);
+	perf_test(rand_lookup_lockless);
 	perf_test(rand_mixed);
 	perf_test(rand_delete);
 
@@ -928,6 +1050,8 @@ int bch2_btree_perf_test(struct bch_fs *c, const char *testname,
 	perf_test(seq_overwrite);
 	perf_test(seq_delete);
 
+	perf_test(journal_res_get);
+
 	/* a unit test, not a perf test: */
 	perf_test(test_delete);
 	perf_test(test_delete_written);
@@ -945,6 +1069,8 @@ int bch2_btree_perf_test(struct bch_fs *c, const char *testname,
 
 	perf_test(test_snapshots);
 
+	perf_test(test_bset_search);
+
 	if (!j.fn) {
 		pr_err("unknown test %s", testname);
 		return -EINVAL;
@@ -33,23 +33,25 @@ impl<'f> Drop for BtreeTrans<'f> {
 }
 
 bitflags! {
-    pub struct BtreeIterFlags: u16 {
-        const SLOTS = c::BTREE_ITER_SLOTS as u16;
-        const ALL_LEVELS = c::BTREE_ITER_ALL_LEVELS as u16;
-        const INTENT = c::BTREE_ITER_INTENT	 as u16;
-        const PREFETCH = c::BTREE_ITER_PREFETCH as u16;
-        const IS_EXTENTS = c::BTREE_ITER_IS_EXTENTS as u16;
-        const NOT_EXTENTS = c::BTREE_ITER_NOT_EXTENTS as u16;
-        const CACHED = c::BTREE_ITER_CACHED	as u16;
-        const KEY_CACHED = c::BTREE_ITER_WITH_KEY_CACHE as u16;
-        const WITH_UPDATES = c::BTREE_ITER_WITH_UPDATES as u16;
-        const WITH_JOURNAL = c::BTREE_ITER_WITH_JOURNAL as u16;
-        const __ALL_SNAPSHOTS = c::__BTREE_ITER_ALL_SNAPSHOTS as u16;
-        const ALL_SNAPSHOTS = c::BTREE_ITER_ALL_SNAPSHOTS as u16;
-        const FILTER_SNAPSHOTS = c::BTREE_ITER_FILTER_SNAPSHOTS as u16;
-        const NOPRESERVE = c::BTREE_ITER_NOPRESERVE as u16;
-        const CACHED_NOFILL = c::BTREE_ITER_CACHED_NOFILL as u16;
-        const KEY_CACHE_FILL = c::BTREE_ITER_KEY_CACHE_FILL as u16;
+    pub struct BtreeIterFlags: u32 {
+        const SLOTS = c::BTREE_ITER_SLOTS as u32;
+        const ALL_LEVELS = c::BTREE_ITER_ALL_LEVELS as u32;
+        const INTENT = c::BTREE_ITER_INTENT	 as u32;
+        const PREFETCH = c::BTREE_ITER_PREFETCH as u32;
+        const IS_EXTENTS = c::BTREE_ITER_IS_EXTENTS as u32;
+        const NOT_EXTENTS = c::BTREE_ITER_NOT_EXTENTS as u32;
+        const CACHED = c::BTREE_ITER_CACHED	as u32;
+        const KEY_CACHED = c::BTREE_ITER_WITH_KEY_CACHE as u32;
+        const WITH_UPDATES = c::BTREE_ITER_WITH_UPDATES as u32;
+        const WITH_JOURNAL = c::BTREE_ITER_WITH_JOURNAL as u32;
+        const __ALL_SNAPSHOTS = c::__BTREE_ITER_ALL_SNAPSHOTS as u32;
+        const ALL_SNAPSHOTS = c::BTREE_ITER_ALL_SNAPSHOTS as u32;
+        const FILTER_SNAPSHOTS = c::BTREE_ITER_FILTER_SNAPSHOTS as u32;
+        const NOPRESERVE = c::BTREE_ITER_NOPRESERVE as u32;
+        const CACHED_NOFILL = c::BTREE_ITER_CACHED_NOFILL as u32;
+        const KEY_CACHE_FILL = c::BTREE_ITER_KEY_CACHE_FILL as u32;
+        const STREAMING = c::BTREE_ITER_STREAMING as u32;
+        const LOCKLESS = c::BTREE_ITER_LOCKLESS as u32;
     }
 }
 